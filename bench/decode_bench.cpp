@@ -0,0 +1,286 @@
+// Times the raster decode, warp and tile compositing paths on synthetic GeoTIFFs covering a range of
+// sizes, band counts, data types, tilings and compressions, and reports throughput and peak RSS.
+//
+//   decode_bench [work directory]
+//
+// The GeoTIFFs are generated into the work directory (a temporary one by default) on every run, so
+// results only depend on the code and the machine.
+
+#include "mappedraster.h"
+#include "rasterreader.h"
+#include "tilerenderer.h"
+#include "warpgrid.h"
+
+#include <QDir>
+#include <QImage>
+#include <QTemporaryDir>
+#include <gdal_priv.h>
+#include <ogr_spatialref.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <memory>
+#include <random>
+#include <vector>
+
+#if defined(Q_OS_UNIX)
+#include <sys/resource.h>
+#endif
+
+static constexpr int s_repetitions = 3;
+static constexpr int s_outputSize = 1024;
+// UTM zone 33N, so that reads to Web Mercator need a real reprojection.
+static constexpr int s_epsg = 32633;
+
+struct Case
+{
+    int size;
+    int bands;
+    GDALDataType dataType;
+    int blockSize;          // 0 for strips
+    const char *compression;
+    bool overviews;
+};
+
+static const Case s_cases[] = {
+    { 4096, 1, GDT_Byte, 0, "NONE", false },
+    { 4096, 3, GDT_Byte, 256, "NONE", false },
+    { 4096, 4, GDT_Byte, 0, "NONE", false },
+    { 4096, 3, GDT_Byte, 256, "DEFLATE", false },
+    { 4096, 4, GDT_Byte, 512, "LZW", false },
+    { 4096, 1, GDT_UInt16, 256, "DEFLATE", false },
+    { 4096, 3, GDT_UInt16, 0, "LZW", false },
+    { 4096, 1, GDT_Float32, 256, "NONE", false },
+    { 8192, 3, GDT_Byte, 256, "DEFLATE", true },
+};
+
+template <typename Function>
+static double bestSeconds(Function function)
+{
+    double best = 1e30;
+    for (int i = 0; i < s_repetitions; ++i) {
+        auto start = std::chrono::steady_clock::now();
+        function();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        best = std::min(best, elapsed.count());
+    }
+    return best;
+}
+
+// Peak resident set size of the process so far in MiB, or -1 where it isn't available.
+static double peakRssMiB()
+{
+#if defined(Q_OS_MACOS)
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss / (1024.0 * 1024.0);
+#elif defined(Q_OS_UNIX)
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss / 1024.0;
+#else
+    return -1;
+#endif
+}
+
+static QString caseName(const Case &c)
+{
+    return QString("%1px %2b %3 %4 %5%6")
+        .arg(c.size).arg(c.bands).arg(GDALGetDataTypeName(c.dataType))
+        .arg(c.blockSize > 0 ? QString("tiled%1").arg(c.blockSize) : QString("strip"))
+        .arg(c.compression).arg(c.overviews ? " ovr" : "");
+}
+
+// Smooth gradients with some noise, so compression has work to do without being trivial.
+static bool generate(const Case &c, const QString &filePath)
+{
+    GDALDriver *driver = GetGDALDriverManager()->GetDriverByName("GTiff");
+    char **options = nullptr;
+    options = CSLSetNameValue(options, "COMPRESS", c.compression);
+    if (c.blockSize > 0) {
+        options = CSLSetNameValue(options, "TILED", "YES");
+        options = CSLSetNameValue(options, "BLOCKXSIZE", QByteArray::number(c.blockSize).constData());
+        options = CSLSetNameValue(options, "BLOCKYSIZE", QByteArray::number(c.blockSize).constData());
+    }
+    if (c.bands == 4)
+        options = CSLSetNameValue(options, "ALPHA", "YES");
+    std::unique_ptr<GDALDataset> dataset(driver->Create(filePath.toUtf8().constData(), c.size, c.size, c.bands,
+                                                         c.dataType, options));
+    CSLDestroy(options);
+    if (!dataset)
+        return false;
+
+    double geoTransform[6] = { 500000, 10, 0, 5500000, 0, -10 };
+    dataset->SetGeoTransform(geoTransform);
+    OGRSpatialReference srs;
+    srs.importFromEPSG(s_epsg);
+    dataset->SetSpatialRef(&srs);
+
+    double maxValue = c.dataType == GDT_Byte ? 255 : c.dataType == GDT_UInt16 ? 4000 : 1000;
+    std::mt19937 random(42);
+    std::uniform_real_distribution<float> noise(-0.05f, 0.05f);
+    std::vector<float> row(c.size);
+    for (int band = 1; band <= c.bands; ++band) {
+        GDALRasterBand *rasterBand = dataset->GetRasterBand(band);
+        for (int y = 0; y < c.size; ++y) {
+            for (int x = 0; x < c.size; ++x) {
+                float value = band == 4 ? 1.0f : 0.5f + 0.45f * std::sin((x + band * 300) * 0.002f) * std::cos(y * 0.003f) + noise(random);
+                row[x] = std::clamp(value, 0.0f, 1.0f) * maxValue;
+            }
+            if (rasterBand->RasterIO(GF_Write, 0, y, c.size, 1, row.data(), c.size, 1, GDT_Float32, 0, 0) != CE_None)
+                return false;
+        }
+    }
+
+    if (c.overviews) {
+        int levels[] = { 2, 4, 8, 16 };
+        if (dataset->BuildOverviews("AVERAGE", 4, levels, 0, nullptr, GDALDummyProgress, nullptr) != CE_None)
+            return false;
+    }
+    return true;
+}
+
+// Reads a window centred on the raster at each decimation into a s_outputSize image, the way the
+// overlay reads tiles at successive zoom levels.
+static void benchRead(GDALDataset *dataset, const QList<ChannelStretch> &stretch)
+{
+    QRect rasterRect(0, 0, dataset->GetRasterXSize(), dataset->GetRasterYSize());
+    for (int decimation = 1; decimation * s_outputSize / 2 <= rasterRect.width(); decimation *= 2) {
+        int span = std::min(rasterRect.width(), s_outputSize * decimation);
+        QRect window(QPoint(0, 0), QSize(span, span));
+        window.moveCenter(rasterRect.center());
+        QSize outSize(span / decimation, span / decimation);
+        int overviewLevel = RasterReader::selectOverview(dataset, window, outSize);
+        double seconds = bestSeconds([&]() {
+            QImage image = RasterReader::read(dataset, window, outSize, overviewLevel, GRIORA_Average, stretch);
+            if (image.isNull())
+                std::printf("  read failed\n");
+        });
+        std::printf("  read   1/%-3d ovr %2d  %8.1f MPix/s out  %8.1f MPix/s src\n", decimation, overviewLevel,
+                    double(outSize.width()) * outSize.height() / seconds / 1e6,
+                    double(window.width()) * window.height() / seconds / 1e6);
+    }
+}
+
+// Reads every full resolution tile of the raster through GDAL and, for files that qualify, through a
+// memory mapping of the file, the way the overlay reads tiles when zoomed in all the way.
+static void benchMapped(GDALDataset *dataset)
+{
+    constexpr int tileSize = 256;
+    QList<QRect> tiles;
+    for (int y = 0; y < dataset->GetRasterYSize(); y += tileSize) {
+        for (int x = 0; x < dataset->GetRasterXSize(); x += tileSize)
+            tiles.append(QRect(x, y, std::min(tileSize, dataset->GetRasterXSize() - x),
+                               std::min(tileSize, dataset->GetRasterYSize() - y)));
+    }
+    double pixels = double(dataset->GetRasterXSize()) * dataset->GetRasterYSize();
+    double gdalSeconds = bestSeconds([&]() {
+        for (const QRect &tile : std::as_const(tiles))
+            RasterReader::read(dataset, tile, tile.size());
+    });
+    std::printf("  tiles  1/1   gdal    %8.1f MPix/s\n", pixels / gdalSeconds / 1e6);
+
+    std::shared_ptr<const MappedRaster> mapped = MappedRaster::map(dataset);
+    if (!mapped)
+        return;
+    double mappedSeconds = bestSeconds([&]() {
+        for (const QRect &tile : std::as_const(tiles))
+            mapped->read(tile, tile.size());
+    });
+    std::printf("  tiles  1/1   mmap    %8.1f MPix/s  %.1fx\n", pixels / mappedSeconds / 1e6, gdalSeconds / mappedSeconds);
+}
+
+// Builds the warp grid used for placing the overlay and maps a dense set of points through it.
+static void benchWarp(GDALDataset *dataset)
+{
+    double geoTransform[6];
+    dataset->GetGeoTransform(geoTransform);
+    OGRSpatialReference srcSRS;
+    srcSRS.importFromEPSG(s_epsg);
+    srcSRS.SetAxisMappingStrategy(OAMS_TRADITIONAL_GIS_ORDER);
+    OGRSpatialReference dstSRS;
+    dstSRS.importFromEPSG(4326);
+    dstSRS.SetAxisMappingStrategy(OAMS_TRADITIONAL_GIS_ORDER);
+    std::unique_ptr<OGRCoordinateTransformation> transform(OGRCreateCoordinateTransformation(&srcSRS, &dstSRS));
+    QSize size(dataset->GetRasterXSize(), dataset->GetRasterYSize());
+
+    WarpGrid grid;
+    double buildSeconds = bestSeconds([&]() { grid.build(geoTransform, size, transform.get()); });
+    constexpr int steps = 512;
+    // Keeps the mapping from being optimized away
+    volatile double sum = 0;
+    double mapSeconds = bestSeconds([&]() {
+        for (int y = 0; y < steps; ++y) {
+            for (int x = 0; x < steps; ++x)
+                sum = sum + grid.map(QPointF(x * size.width() / double(steps), y * size.height() / double(steps))).x();
+        }
+    });
+    std::printf("  warp   grid %dx%d built in %.2f ms, %8.1f Mpoints/s mapped\n", grid.columns(), grid.rows(),
+                buildSeconds * 1e3, double(steps) * steps / mapSeconds / 1e6);
+}
+
+// Renders (up to 64 of) the Web Mercator tiles of the raster at its native zoom level and the two above it.
+static void benchTiles(GDALDataset *dataset, const QList<ChannelStretch> &stretch)
+{
+    QRectF bounds = TileRenderer::mercatorBounds(dataset);
+    int nativeZoom = TileRenderer::nativeZoomLevel(dataset, bounds);
+    for (int z = std::max(0, nativeZoom - 2); z <= nativeZoom; ++z) {
+        QList<QPoint> tiles;
+        for (int x = 0; x < (1 << z); ++x) {
+            for (int y = 0; y < (1 << z); ++y) {
+                if (TileRenderer::tileBounds(z, x, y).intersects(bounds))
+                    tiles.append(QPoint(x, y));
+            }
+            if (tiles.size() > 64)
+                break;
+        }
+        tiles = tiles.mid(0, 64);
+        double seconds = bestSeconds([&]() {
+            for (const QPoint &tile : std::as_const(tiles))
+                TileRenderer::render(dataset, bounds, z, tile.x(), tile.y(), stretch);
+        });
+        double pixels = double(tiles.size()) * TileRenderer::s_tileSize * TileRenderer::s_tileSize;
+        std::printf("  tiles  z%-2d %3lld tiles  %8.1f MPix/s  %8.1f tiles/s\n", z, qlonglong(tiles.size()),
+                    pixels / seconds / 1e6, tiles.size() / seconds);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    GDALAllRegister();
+    CPLSetConfigOption("GDAL_PAM_ENABLED", "NO");
+
+    QTemporaryDir temporaryDir;
+    QString workDir = argc > 1 ? QString::fromLocal8Bit(argv[1]) : temporaryDir.path();
+    QDir().mkpath(workDir);
+
+    bool ok = true;
+    for (const Case &c : s_cases) {
+        QString name = caseName(c);
+        QString filePath = QDir(workDir).filePath(QString(name).replace(' ', '_') + ".tif");
+        std::printf("%s\n", name.toUtf8().constData());
+        if (!generate(c, filePath)) {
+            std::printf("  failed to generate %s: %s\n", filePath.toUtf8().constData(), CPLGetLastErrorMsg());
+            ok = false;
+            continue;
+        }
+
+        std::unique_ptr<GDALDataset> dataset(GDALDataset::Open(filePath.toUtf8().constData(), GDAL_OF_RASTER | GDAL_OF_READONLY));
+        if (!dataset) {
+            ok = false;
+            continue;
+        }
+        QList<ChannelStretch> stretch;
+        if (RasterReader::needsStretch(dataset.get()))
+            stretch = RasterReader::computeStretch(dataset.get(), RasterReader::PercentileStretch);
+
+        benchRead(dataset.get(), stretch);
+        benchMapped(dataset.get());
+        benchWarp(dataset.get());
+        benchTiles(dataset.get(), stretch);
+        std::printf("  peak RSS %.1f MiB\n", peakRssMiB());
+    }
+    return ok ? 0 : 1;
+}
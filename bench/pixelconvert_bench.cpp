@@ -0,0 +1,139 @@
+// Compares the vectorized PixelConvert kernels with the scalar reference loop for each supported
+// sample type and channel layout, for palette expansion and for applying masks as alpha, and checks that
+// both give identical bytes.
+
+#include "pixelconvert.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <random>
+#include <vector>
+
+static constexpr size_t s_pixelCount = 4096 * 4096;
+static constexpr int s_repetitions = 5;
+
+template <typename Function>
+static double bestSeconds(Function function)
+{
+    double best = 1e30;
+    for (int i = 0; i < s_repetitions; ++i) {
+        auto start = std::chrono::steady_clock::now();
+        function();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        best = std::min(best, elapsed.count());
+    }
+    return best;
+}
+
+template <typename T>
+static bool run(const char *typeName, double min, double max, int channels)
+{
+    std::mt19937 random(42);
+    std::uniform_real_distribution<double> distribution(min - (max - min) * 0.1, max + (max - min) * 0.1);
+    std::vector<T> src(s_pixelCount * channels);
+    // Out of range values are part of the test, but only those the type can hold
+    for (T &value : src)
+        value = T(std::clamp(distribution(random), double(std::numeric_limits<T>::lowest()),
+                             double(std::numeric_limits<T>::max())));
+
+    std::vector<ChannelStretch> stretch(channels, ChannelStretch::fromRange(min, max));
+    stretch[0].hasNoData = true;
+    stretch[0].noData = float(src[0]);
+    if (channels == 4)
+        stretch[3] = ChannelStretch::constant(255);
+
+    std::vector<uint8_t> scalarOut(src.size());
+    std::vector<uint8_t> simdOut(src.size());
+    double scalarSeconds = bestSeconds([&]() {
+        PixelConvert::toByteScalar(src.data(), scalarOut.data(), s_pixelCount, channels, stretch.data());
+    });
+    double simdSeconds = bestSeconds([&]() {
+        PixelConvert::toByte(src.data(), simdOut.data(), s_pixelCount, channels, stretch.data());
+    });
+
+    bool identical = std::memcmp(scalarOut.data(), simdOut.data(), scalarOut.size()) == 0;
+    std::printf("%-8s %d ch  scalar %8.1f MPix/s  %-6s %8.1f MPix/s  x%5.2f  %s\n",
+                typeName, channels,
+                s_pixelCount / scalarSeconds / 1e6,
+                PixelConvert::simdLevel(), s_pixelCount / simdSeconds / 1e6,
+                scalarSeconds / simdSeconds,
+                identical ? "ok" : "MISMATCH");
+    return identical;
+}
+
+static bool runPalette()
+{
+    std::mt19937 random(42);
+    std::uniform_int_distribution<int> distribution(0, 255);
+    std::vector<uint8_t> src(s_pixelCount);
+    for (uint8_t &value : src)
+        value = uint8_t(distribution(random));
+    uint32_t lut[256];
+    for (uint32_t &entry : lut)
+        entry = uint32_t(random());
+
+    std::vector<uint32_t> scalarOut(s_pixelCount);
+    std::vector<uint32_t> simdOut(s_pixelCount);
+    double scalarSeconds = bestSeconds([&]() {
+        PixelConvert::expandPaletteScalar(src.data(), scalarOut.data(), s_pixelCount, lut);
+    });
+    double simdSeconds = bestSeconds([&]() {
+        PixelConvert::expandPalette(src.data(), simdOut.data(), s_pixelCount, lut);
+    });
+
+    bool identical = scalarOut == simdOut;
+    std::printf("%-8s      scalar %8.1f MPix/s  %-6s %8.1f MPix/s  x%5.2f  %s\n",
+                "Palette",
+                s_pixelCount / scalarSeconds / 1e6,
+                PixelConvert::simdLevel(), s_pixelCount / simdSeconds / 1e6,
+                scalarSeconds / simdSeconds,
+                identical ? "ok" : "MISMATCH");
+    return identical;
+}
+
+static bool runMask()
+{
+    std::mt19937 random(42);
+    std::uniform_int_distribution<int> distribution(0, 255);
+    std::vector<uint8_t> rgba(s_pixelCount * 4);
+    for (uint8_t &value : rgba)
+        value = uint8_t(distribution(random));
+    std::vector<uint8_t> mask(s_pixelCount);
+    for (uint8_t &value : mask)
+        value = uint8_t(distribution(random));
+
+    std::vector<uint8_t> scalarOut = rgba;
+    std::vector<uint8_t> simdOut = rgba;
+    double scalarSeconds = bestSeconds([&]() {
+        PixelConvert::applyMaskScalar(scalarOut.data(), mask.data(), s_pixelCount);
+    });
+    double simdSeconds = bestSeconds([&]() {
+        PixelConvert::applyMask(simdOut.data(), mask.data(), s_pixelCount);
+    });
+
+    bool identical = scalarOut == simdOut;
+    std::printf("%-8s      scalar %8.1f MPix/s  %-6s %8.1f MPix/s  x%5.2f  %s\n",
+                "Mask",
+                s_pixelCount / scalarSeconds / 1e6,
+                PixelConvert::simdLevel(), s_pixelCount / simdSeconds / 1e6,
+                scalarSeconds / simdSeconds,
+                identical ? "ok" : "MISMATCH");
+    return identical;
+}
+
+int main()
+{
+    bool ok = true;
+    for (int channels : { 1, 4 }) {
+        ok &= run<uint16_t>("UInt16", 200, 4000, channels);
+        ok &= run<int16_t>("Int16", -500, 3000, channels);
+        ok &= run<uint32_t>("UInt32", 1000, 3000000000.0, channels);
+        ok &= run<float>("Float32", -10.5, 2500.25, channels);
+    }
+    ok &= runPalette();
+    ok &= runMask();
+    return ok ? 0 : 1;
+}
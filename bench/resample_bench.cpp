@@ -0,0 +1,91 @@
+// Compares the Resampler filters, on one thread and on all cores, with scaling by QPainter::drawImage
+// (how the overlay scaled its image before it was tiled) and QImage::scaled, on synthetic images.
+
+#include "resampler.h"
+
+#include <QImage>
+#include <QPainter>
+#include <QThreadPool>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <utility>
+
+static constexpr int s_sourceSize = 4096;
+static constexpr int s_repetitions = 3;
+static constexpr double s_scales[] = { 0.5, 0.3, 0.125, 1.7 };
+
+template <typename Function>
+static double bestSeconds(Function function)
+{
+    double best = 1e30;
+    for (int i = 0; i < s_repetitions; ++i) {
+        auto start = std::chrono::steady_clock::now();
+        function();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        best = std::min(best, elapsed.count());
+    }
+    return best;
+}
+
+// Smooth gradients with some noise, like a scanned map.
+static QImage generate(QImage::Format format)
+{
+    QImage image(s_sourceSize, s_sourceSize, format);
+    std::mt19937 random(42);
+    std::uniform_int_distribution<int> noise(-12, 12);
+    int channels = image.depth() / 8;
+    for (int y = 0; y < image.height(); ++y) {
+        uchar *line = image.scanLine(y);
+        for (int x = 0; x < image.width(); ++x) {
+            for (int c = 0; c < channels; ++c) {
+                double value = 128 + 100 * std::sin((x + c * 300) * 0.004) * std::cos(y * 0.006);
+                line[x * channels + c] = uchar(std::clamp(int(value) + noise(random), 0, 255));
+            }
+        }
+    }
+    return image;
+}
+
+static void report(const char *name, const QSize &outSize, double seconds)
+{
+    std::printf("  %-26s %8.1f MPix/s\n", name, double(outSize.width()) * outSize.height() / seconds / 1e6);
+}
+
+int main()
+{
+    std::printf("%d threads\n", QThreadPool::globalInstance()->maxThreadCount());
+    for (QImage::Format format : { QImage::Format_RGBA8888, QImage::Format_Grayscale8 }) {
+        QImage source = generate(format);
+        for (double scale : s_scales) {
+            QSize outSize(int(s_sourceSize * scale), int(s_sourceSize * scale));
+            std::printf("%s %d -> %d\n", format == QImage::Format_Grayscale8 ? "Grayscale8" : "RGBA8888",
+                        s_sourceSize, outSize.width());
+
+            report("qpainter drawImage smooth", outSize, bestSeconds([&]() {
+                QImage out(outSize, format == QImage::Format_Grayscale8 ? format : QImage::Format_RGBA8888_Premultiplied);
+                out.fill(Qt::transparent);
+                QPainter painter(&out);
+                painter.setRenderHint(QPainter::SmoothPixmapTransform);
+                painter.drawImage(QRect(QPoint(0, 0), outSize), source);
+            }));
+            report("qimage scaled smooth", outSize, bestSeconds([&]() {
+                source.scaled(outSize, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+            }));
+
+            const std::pair<const char *, Resampler::Filter> filters[] = {
+                { "nearest", Resampler::Nearest }, { "bilinear", Resampler::Bilinear }, { "area", Resampler::Area }
+            };
+            for (const auto &[name, filter] : filters) {
+                QByteArray single = QByteArray("resampler ") + name + " 1 thread";
+                report(single.constData(), outSize, bestSeconds([&]() { Resampler::resample(source, outSize, filter, nullptr); }));
+                QByteArray parallel = QByteArray("resampler ") + name + " parallel";
+                report(parallel.constData(), outSize, bestSeconds([&]() { Resampler::resample(source, outSize, filter); }));
+            }
+        }
+    }
+    return 0;
+}
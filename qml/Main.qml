@@ -22,7 +22,7 @@ ApplicationWindow {
         // tiffImgMQI.coordinate = QtPositioning.coordinate(GeoTiffHandler.boundsMaxY, GeoTiffHandler.boundsMinX)
         // imgZoomLevelChoice.value = 140;
         var jsurl = new URL(url)
-        geotiffoverlay.source = jsurl.pathname
+        geotiffoverlay.source = jsurl.protocol === "file:" ? jsurl.pathname : url.toString()
     }
 
     Component.onCompleted: loadTiff("file:///home/kyzik/Build/l3h-insight/austro-hungarian-maps/sheets_geo/2868_000_geo.tif")
@@ -53,6 +53,20 @@ ApplicationWindow {
                     onClicked: fileDialog.open()
                 }
 
+                Button {
+                    text: "Open URL"
+                    hoverEnabled: true
+                    ToolTip.text: "Open a cloud optimized GeoTIFF over http(s), reading only the parts in view"
+                    ToolTip.visible: hovered
+                    ToolTip.delay: Application.styleHints.mousePressAndHoldInterval
+                    onClicked: urlDialog.open()
+                }
+
+                Button {
+                    text: "Open sheet directory"
+                    onClicked: folderDialog.open()
+                }
+
                 SpinBox {
                     id: mapChoice
                     from: 0
@@ -92,6 +106,16 @@ ApplicationWindow {
                     ToolTip.delay: Application.styleHints.mousePressAndHoldInterval
                 }
 
+                CheckBox {
+                    id: tiledLayerChoice
+                    text: "Tiled"
+                    enabled: AppConfig.geoTiffTileLayerAddress !== ""
+                    hoverEnabled: true
+                    ToolTip.text: "Show the GeoTIFF as a tiled map layer served by the local tile server"
+                    ToolTip.visible: hovered
+                    ToolTip.delay: Application.styleHints.mousePressAndHoldInterval
+                }
+
                 Label {
                     Layout.fillWidth: true
                     text: GeoTiffHandler.currentFile || "No file loaded"
@@ -172,6 +196,30 @@ ApplicationWindow {
                         onActivated: mapBase.zoomLevel = mapBase.zoomLevel - 0.05 //Math.round(mapBase.zoomLevel - 1)
                     }
                 }
+                // The plugin of a Map can only be set once, so the map is recreated for every layer address
+                Loader {
+                    id: tiledLayer
+                    anchors.fill: mapBase
+                    z: mapBase.z + 1
+                    active: tiledLayerChoice.checked && AppConfig.geoTiffTileLayerAddress !== ""
+                    sourceComponent: Map {
+                        plugin: Plugin {
+                            name: "osm"
+                            PluginParameter { name: "osm.mapping.custom.host"; value: AppConfig.geoTiffTileLayerAddress }
+                            PluginParameter { name: "osm.mapping.providersrepository.disabled"; value: true }
+                        }
+                        activeMapType: supportedMapTypes[supportedMapTypes.length - 1]
+                        center: mapBase.center
+                        color: 'transparent'
+                        minimumZoomLevel: mapBase.minimumZoomLevel
+                        maximumZoomLevel: mapBase.maximumZoomLevel
+                        zoomLevel: mapBase.zoomLevel
+                        tilt: mapBase.tilt
+                        bearing: mapBase.bearing
+                        fieldOfView: mapBase.fieldOfView
+                        opacity: (imgOpacityChoice.value*1.0)/100
+                    }
+                }
                 Map {
                     id: mapOverlay
                     anchors.fill: mapBase
@@ -203,6 +251,13 @@ ApplicationWindow {
                         // visible: false
                         id: geotiffoverlay
                         opacity: (imgOpacityChoice.value*1.0)/100
+                        autoBuildOverviews: true
+                        refineDelay: 150
+                    }
+
+                    GeoTiffMosaicItem {
+                        id: mosaicoverlay
+                        opacity: (imgOpacityChoice.value*1.0)/100
                     }
                 }
             }
@@ -324,6 +379,32 @@ ApplicationWindow {
                             }
                         }
                     }
+
+                    GroupBox {
+                        Layout.fillWidth: true
+                        title: "Band Statistics"
+
+                        ColumnLayout {
+                            anchors.fill: parent
+
+                            Repeater {
+                                model: GeoTiffHandler.bandStatistics
+                                delegate: Label {
+                                    Layout.fillWidth: true
+                                    wrapMode: Text.WordWrap
+                                    text: "<b>Band " + modelData.band + (modelData.approximate ? " (approx.)" : "") + ":</b> "
+                                          + "min " + modelData.min.toPrecision(6) + ", max " + modelData.max.toPrecision(6)
+                                          + ", mean " + modelData.mean.toPrecision(6) + ", std. dev. " + modelData.stdDev.toPrecision(6)
+                                }
+                            }
+
+                            Button {
+                                text: "Compute exact statistics"
+                                enabled: GeoTiffHandler.currentFile !== "" && !GeoTiffHandler.computingStatistics
+                                onClicked: GeoTiffHandler.computeStatistics(false)
+                            }
+                        }
+                    }
                 }
             }
         }
@@ -337,6 +418,86 @@ ApplicationWindow {
                 text: GeoTiffHandler.statusMessage || "Ready"
                 elide: Text.ElideRight
             }
+
+            ProgressBar {
+                visible: GeoTiffHandler.loadingMetadata
+                value: GeoTiffHandler.metadataProgress
+            }
+            Button {
+                visible: GeoTiffHandler.loadingMetadata
+                text: "Cancel"
+                onClicked: GeoTiffHandler.cancelMetadata()
+            }
+
+            Label {
+                visible: geotiffoverlay.buildingOverviews
+                text: "Building overviews"
+            }
+            ProgressBar {
+                visible: geotiffoverlay.buildingOverviews
+                value: geotiffoverlay.overviewBuildProgress
+            }
+            Button {
+                visible: geotiffoverlay.buildingOverviews
+                text: "Cancel"
+                onClicked: geotiffoverlay.cancelOverviewBuild()
+            }
+
+            Label {
+                visible: mosaicoverlay.sheetCount > 0 || mosaicoverlay.indexing
+                text: mosaicoverlay.indexing ? "Indexing sheets..."
+                                             : mosaicoverlay.openSheetCount + " of " + mosaicoverlay.sheetCount + " sheets open"
+            }
+
+            Label {
+                visible: GeoTiffHandler.computingStatistics
+                text: "Computing statistics"
+            }
+            ProgressBar {
+                visible: GeoTiffHandler.computingStatistics
+                value: GeoTiffHandler.statisticsProgress
+            }
+            Button {
+                visible: GeoTiffHandler.computingStatistics
+                text: "Cancel"
+                onClicked: GeoTiffHandler.cancelStatistics()
+            }
+
+            Label {
+                visible: perfChoice.checked
+                font.family: "monospace"
+                text: "frame " + PerfCounters.frameMs.toFixed(2) + " ms @ " + PerfCounters.framesPerSecond.toFixed(0) + " fps"
+                      + " | view " + PerfCounters.visibleUpdateMs.toFixed(2) + " ms"
+                      + " | read " + PerfCounters.readMs.toFixed(2) + " ms, " + PerfCounters.tilesReadPerSecond.toFixed(0) + " tiles/s, "
+                      + (PerfCounters.bytesReadPerSecond / 1048576).toFixed(1) + " MiB/s"
+                      + " | convert " + PerfCounters.conversionMs.toFixed(2) + " ms"
+                      + " | scale " + PerfCounters.scalingMs.toFixed(2) + " ms"
+                      + " | upload " + PerfCounters.uploadMs.toFixed(2) + " ms"
+                      + " | cache " + (PerfCounters.tileCacheHitRate * 100).toFixed(0) + "%"
+            }
+            CheckBox {
+                id: perfChoice
+                text: "Perf"
+                hoverEnabled: true
+                ToolTip.text: "Show render and I/O timings, averaged over the last second"
+                ToolTip.visible: hovered
+                ToolTip.delay: Application.styleHints.mousePressAndHoldInterval
+            }
+            Button {
+                text: PerfCounters.tracing ? "Stop trace" : "Trace"
+                onClicked: PerfCounters.tracing ? PerfCounters.stopTrace() : traceDialog.open()
+            }
+        }
+    }
+
+    FileDialog {
+        id: traceDialog
+        title: "Save a Chrome trace of render and I/O timings"
+        fileMode: FileDialog.SaveFile
+        nameFilters: ["Trace files (*.json)"]
+
+        onAccepted: {
+            PerfCounters.startTrace(new URL(traceDialog.selectedFile).pathname)
         }
     }
 
@@ -350,4 +511,33 @@ ApplicationWindow {
             loadTiff(fileDialog.selectedFile);
         }
     }
+
+    Dialog {
+        id: urlDialog
+        title: "Open a GeoTIFF URL"
+        anchors.centerIn: Overlay.overlay
+        modal: true
+        standardButtons: Dialog.Open | Dialog.Cancel
+
+        TextField {
+            id: urlField
+            width: 480
+            placeholderText: "https://example.com/image.tif"
+        }
+
+        onAccepted: {
+            if (urlField.text !== "")
+                loadTiff(urlField.text)
+        }
+    }
+
+    FolderDialog {
+        id: folderDialog
+        title: "Please choose a directory of GeoTIFF sheets"
+        currentFolder: StandardPaths.standardLocations(StandardPaths.PicturesLocation)[0]
+
+        onAccepted: {
+            mosaicoverlay.directory = new URL(folderDialog.selectedFolder).pathname
+        }
+    }
 }
@@ -17,16 +17,55 @@ AppConfig::AppConfig(QObject *parent)
     : QObject{parent}
 {
     // I do know that QCoreApplication is around, as this is a QML singleton created by the qml
-    // engine, which requires that the application be created before it is instantiated.
+    // engine, which requires that the application be created before it is instantiated. When seeding,
+    // main() creates it before any engine.
     qApp->arguments();
 
     QCommandLineParser parser;
     QCommandLineOption apiKeyOption(QStringList({"k", "apiKey"}), "Thunderforest map API key", "api-key");
     parser.addOption(apiKeyOption);
+    QCommandLineOption seedOption(QStringList({"s", "seed"}),
+                                  "Render the Web Mercator tiles of the GeoTIFFs given as arguments into an .mbtiles file or a {z}/{x}/{y} directory and exit",
+                                  "output");
+    parser.addOption(seedOption);
+    QCommandLineOption zoomOption(QStringList({"z", "zoom"}), "Zoom levels to seed, e.g. 8-14 (default: 4 levels up to native resolution)", "min-max");
+    parser.addOption(zoomOption);
+    QCommandLineOption traceOption(QStringList({"t", "trace"}), "Record render and I/O timings to a Chrome trace-event JSON file, written on exit", "file");
+    parser.addOption(traceOption);
+    QCommandLineOption memoryBudgetOption(QStringList({"m", "memory-budget"}), "Memory for decoded tiles across all layers, in MiB (default: 1024)", "mib");
+    parser.addOption(memoryBudgetOption);
+    QCommandLineOption rangeCacheOption(QStringList({"c", "range-cache"}), "Disk space for data cached from remote (http/https) GeoTIFFs, in MiB (default: 1024)", "mib");
+    parser.addOption(rangeCacheOption);
+    parser.addPositionalArgument("geotiffs", "GeoTIFF files to seed tiles from", "[geotiffs...]");
     if(!parser.parse(qApp->arguments())) {
         qFatal() << "Failed to read command line arguments. aborting";
     }
 
+    m_traceFile = parser.value(traceOption);
+    if (parser.isSet(memoryBudgetOption)) {
+        bool ok = false;
+        m_memoryBudgetMiB = parser.value(memoryBudgetOption).toLongLong(&ok);
+        if (!ok || m_memoryBudgetMiB <= 0)
+            qFatal() << "Memory budget given is not a positive number of MiB";
+    }
+    if (parser.isSet(rangeCacheOption)) {
+        bool ok = false;
+        m_rangeCacheMiB = parser.value(rangeCacheOption).toLongLong(&ok);
+        if (!ok || m_rangeCacheMiB < 0)
+            qFatal() << "Range cache size given is not a number of MiB";
+    }
+    m_seedOutput = parser.value(seedOption);
+    m_seedFiles = parser.positionalArguments();
+    QString zoom = parser.value(zoomOption);
+    if (!zoom.isEmpty()) {
+        QStringList range = zoom.split('-');
+        bool minOk = false, maxOk = false;
+        m_seedMinZoom = range.first().toInt(&minOk);
+        m_seedMaxZoom = range.last().toInt(&maxOk);
+        if (range.size() > 2 || !minOk || !maxOk || m_seedMinZoom < 0 || m_seedMaxZoom > 30 || m_seedMinZoom > m_seedMaxZoom)
+            qFatal() << "Zoom range given is not valid, expected <min>-<max> between 0 and 30";
+    }
+
     QString apiKey = parser.value(apiKeyOption);
     if (!apiKey.isEmpty()) {
         if (!isValidKeyFormat(apiKey))
@@ -79,3 +118,16 @@ void AppConfig::setOsmMappingProvidersRepositoryAddress(const QString &osmMappin
         emit osmMappingProvidersRepositoryAddressChanged();
     }
 }
+
+QString AppConfig::geoTiffTileLayerAddress() const
+{
+    return m_geoTiffTileLayerAddress;
+}
+
+void AppConfig::setGeoTiffTileLayerAddress(const QString &geoTiffTileLayerAddress)
+{
+    if (m_geoTiffTileLayerAddress != geoTiffTileLayerAddress) {
+        m_geoTiffTileLayerAddress = geoTiffTileLayerAddress;
+        emit geoTiffTileLayerAddressChanged();
+    }
+}
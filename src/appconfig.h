@@ -11,6 +11,7 @@ class AppConfig : public QObject
 
     Q_PROPERTY(QString thunderforestApiKey READ thunderforestApiKey WRITE setThunderforestApiKey NOTIFY thunderforestApiKeyChanged)
     Q_PROPERTY(QString osmMappingProvidersRepositoryAddress READ osmMappingProvidersRepositoryAddress NOTIFY osmMappingProvidersRepositoryAddressChanged)
+    Q_PROPERTY(QString geoTiffTileLayerAddress READ geoTiffTileLayerAddress NOTIFY geoTiffTileLayerAddressChanged)
 
 public:
     explicit AppConfig(QObject *parent);
@@ -25,13 +26,41 @@ public:
     QString osmMappingProvidersRepositoryAddress() const;
     void setOsmMappingProvidersRepositoryAddress(const QString &osmMappingProvidersRepositoryAddress);
 
+    // Tile server address of the GeoTIFF loaded in GeoTiffHandler, empty when it can't be served as tiles.
+    QString geoTiffTileLayerAddress() const;
+    void setGeoTiffTileLayerAddress(const QString &geoTiffTileLayerAddress);
+
+    // Budget for decoded tiles from --memory-budget, or -1 to keep MemoryBudget's default.
+    inline qint64 memoryBudgetMiB() const { return m_memoryBudgetMiB; }
+    // Disk space for RangeCache from --range-cache, or -1 to keep its default.
+    inline qint64 rangeCacheMiB() const { return m_rangeCacheMiB; }
+
+    // Chrome trace file to record PerfCounters to (--trace), empty when not tracing.
+    inline QString traceFile() const { return m_traceFile; }
+
+    // Headless tile seeding (--seed), see TileSeeder. seedOutput() is empty when not seeding. The zoom
+    // levels are -1 when not given on the command line.
+    inline QString seedOutput() const { return m_seedOutput; }
+    inline QStringList seedFiles() const { return m_seedFiles; }
+    inline int seedMinZoom() const { return m_seedMinZoom; }
+    inline int seedMaxZoom() const { return m_seedMaxZoom; }
+
 signals:
     void thunderforestApiKeyChanged();
     void osmMappingProvidersRepositoryAddressChanged();
+    void geoTiffTileLayerAddressChanged();
 
 private:
     QString m_thunderforestApiKey;
     QString m_osmMappingProvidersRepositoryAddress;
+    QString m_geoTiffTileLayerAddress;
+    qint64 m_memoryBudgetMiB = -1;
+    qint64 m_rangeCacheMiB = -1;
+    QString m_traceFile;
+    QString m_seedOutput;
+    QStringList m_seedFiles;
+    int m_seedMinZoom = -1;
+    int m_seedMaxZoom = -1;
 
     inline static AppConfig * s_singletonInstance = nullptr;
     inline static QJSEngine *s_engine = nullptr;
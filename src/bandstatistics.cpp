@@ -0,0 +1,141 @@
+#include "bandstatistics.h"
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QSaveFile>
+#include <QStandardPaths>
+#include <QDebug>
+#include <algorithm>
+
+// Bump when the layout of the cache files or the way statistics are computed changes.
+static constexpr int s_cacheVersion = 1;
+
+double BandStatistics::percentile(double fraction) const
+{
+    if (histogram.isEmpty() || validCount == 0)
+        return fraction < 0.5 ? min : max;
+
+    double bucketWidth = (histogramMax - histogramMin) / histogram.size();
+    double target = fraction * validCount;
+    double cumulative = 0;
+    for (int i = 0; i < histogram.size(); ++i) {
+        double next = cumulative + histogram[i];
+        if (next >= target && histogram[i] > 0) {
+            double value = histogramMin + (i + (target - cumulative) / histogram[i]) * bucketWidth;
+            return std::clamp(value, min, max);
+        }
+        cumulative = next;
+    }
+    return max;
+}
+
+QVariantMap BandStatistics::toVariantMap() const
+{
+    QVariantList buckets;
+    buckets.reserve(histogram.size());
+    for (qint64 count : histogram)
+        buckets.append(count);
+
+    return QVariantMap {
+        { "band", band },
+        { "validCount", validCount },
+        { "min", min },
+        { "max", max },
+        { "mean", mean },
+        { "stdDev", stdDev },
+        { "histogramMin", histogramMin },
+        { "histogramMax", histogramMax },
+        { "histogram", buckets },
+        { "approximate", approximate }
+    };
+}
+
+QString StatisticsCache::cacheFilePath(const QString &filePath)
+{
+    QByteArray key = QCryptographicHash::hash(QFileInfo(filePath).absoluteFilePath().toUtf8(),
+                                              QCryptographicHash::Sha1).toHex();
+    return QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + "/statistics/" + key + ".json";
+}
+
+QList<BandStatistics> StatisticsCache::load(const QString &filePath, bool exactOnly)
+{
+    QFile file(cacheFilePath(filePath));
+    if (!file.open(QIODevice::ReadOnly))
+        return {};
+
+    QJsonObject root = QJsonDocument::fromJson(file.readAll()).object();
+    QFileInfo info(filePath);
+    if (root["version"].toInt() != s_cacheVersion
+        || root["path"].toString() != info.absoluteFilePath()
+        || root["size"].toInteger() != info.size()
+        || root["modified"].toInteger() != info.lastModified().toMSecsSinceEpoch()) {
+        return {};
+    }
+
+    QList<BandStatistics> statistics;
+    for (const QJsonValue &value : root["bands"].toArray()) {
+        QJsonObject object = value.toObject();
+        BandStatistics band;
+        band.band = object["band"].toInt();
+        band.validCount = object["validCount"].toInteger();
+        band.min = object["min"].toDouble();
+        band.max = object["max"].toDouble();
+        band.mean = object["mean"].toDouble();
+        band.stdDev = object["stdDev"].toDouble();
+        band.histogramMin = object["histogramMin"].toDouble();
+        band.histogramMax = object["histogramMax"].toDouble();
+        for (const QJsonValue &count : object["histogram"].toArray())
+            band.histogram.append(count.toInteger());
+        band.approximate = object["approximate"].toBool();
+        if (exactOnly && band.approximate)
+            return {};
+        statistics.append(band);
+    }
+    return statistics;
+}
+
+bool StatisticsCache::store(const QString &filePath, const QList<BandStatistics> &statistics)
+{
+    QJsonArray bands;
+    for (const BandStatistics &band : statistics) {
+        QJsonArray histogram;
+        for (qint64 count : band.histogram)
+            histogram.append(count);
+        bands.append(QJsonObject {
+            { "band", band.band },
+            { "validCount", band.validCount },
+            { "min", band.min },
+            { "max", band.max },
+            { "mean", band.mean },
+            { "stdDev", band.stdDev },
+            { "histogramMin", band.histogramMin },
+            { "histogramMax", band.histogramMax },
+            { "histogram", histogram },
+            { "approximate", band.approximate }
+        });
+    }
+
+    QFileInfo info(filePath);
+    QJsonObject root {
+        { "version", s_cacheVersion },
+        { "path", info.absoluteFilePath() },
+        { "size", info.size() },
+        { "modified", info.lastModified().toMSecsSinceEpoch() },
+        { "bands", bands }
+    };
+
+    QString cachePath = cacheFilePath(filePath);
+    QDir().mkpath(QFileInfo(cachePath).absolutePath());
+    QSaveFile file(cachePath);
+    if (!file.open(QIODevice::WriteOnly)) {
+        qWarning() << "Failed to write statistics cache" << cachePath << ":" << file.errorString();
+        return false;
+    }
+    file.write(QJsonDocument(root).toJson(QJsonDocument::Compact));
+    return file.commit();
+}
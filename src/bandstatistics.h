@@ -0,0 +1,43 @@
+#ifndef BANDSTATISTICS_H
+#define BANDSTATISTICS_H
+
+#include <QList>
+#include <QString>
+#include <QVariantMap>
+
+// Statistics of the valid (not nodata, not NaN) samples of one raster band.
+struct BandStatistics
+{
+    int band = 0;
+    qint64 validCount = 0;
+    double min = 0;
+    double max = 0;
+    double mean = 0;
+    double stdDev = 0;
+    // histogram[i] counts the samples in [histogramMin + i * w, histogramMin + (i + 1) * w), with w the
+    // bucket width. Samples outside the range are counted in the first or last bucket.
+    double histogramMin = 0;
+    double histogramMax = 0;
+    QList<qint64> histogram;
+    // Computed from an overview rather than the full resolution raster.
+    bool approximate = false;
+
+    // Value below which the given fraction (0 to 1) of the samples fall, interpolated within a bucket.
+    double percentile(double fraction) const;
+    QVariantMap toVariantMap() const;
+};
+
+// Persists statistics as one JSON file per raster in the cache directory. Entries are keyed by the
+// absolute file path and only returned while the file's size and modification time still match.
+class StatisticsCache
+{
+public:
+    // Returns an empty list when nothing (or, with exactOnly, nothing exact) is cached for the file.
+    static QList<BandStatistics> load(const QString &filePath, bool exactOnly = false);
+    static bool store(const QString &filePath, const QList<BandStatistics> &statistics);
+
+private:
+    static QString cacheFilePath(const QString &filePath);
+};
+
+#endif // BANDSTATISTICS_H
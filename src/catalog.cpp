@@ -0,0 +1,376 @@
+#include "catalog.h"
+#include <QtConcurrent>
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QDir>
+#include <QDirIterator>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QStandardPaths>
+#include <QThreadPool>
+#include <QDebug>
+#include <gdal_priv.h>
+#include <ogr_spatialref.h>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <vector>
+
+// Points per sheet edge that are projected for the footprint. Projected edges aren't straight lines
+// in longitude/latitude, so the corners alone could miss part of the sheet.
+static constexpr int s_footprintEdgePoints = 8;
+// Headers are mostly waiting on (network) file system I/O, so scan with more threads than cores.
+static constexpr int s_minScanThreads = 8;
+
+static constexpr char s_magic[8] = { 'G', 'T', 'V', 'C', 'A', 'T', '\0', '\0' };
+static constexpr quint32 s_version = 1;
+
+struct Catalog::Header
+{
+    char magic[8];
+    quint32 version;
+    quint32 entryCount;
+    quint64 blobOffset;
+    quint64 blobSize;
+};
+
+struct Catalog::Record
+{
+    qint64 fileSize;
+    qint64 modified;
+    double footprint[4];        // minX, minY, maxX, maxY, all NaN when not georeferenced
+    qint32 width;
+    qint32 height;
+    qint32 blockXSize;
+    qint32 blockYSize;
+    quint32 pathOffset;
+    quint32 pathLength;         // UTF-8
+    quint32 srsOffset;
+    quint32 srsLength;          // UTF-8
+    quint32 bandsOffset;
+    quint32 bandCount;          // Two bytes per band: GDALDataType, GDALColorInterp
+    quint32 overviewsOffset;
+    quint32 overviewCount;      // quint16 factor per overview
+};
+
+Catalog::~Catalog()
+{
+    close();
+}
+
+QString Catalog::indexFilePath(const QString &directory)
+{
+    QByteArray key = QCryptographicHash::hash(QDir(directory).absolutePath().toUtf8(), QCryptographicHash::Sha1).toHex();
+    return QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + "/catalogs/" + key + ".idx";
+}
+
+bool Catalog::open(const QString &directory)
+{
+    static_assert(sizeof(Header) % 8 == 0 && sizeof(Record) % 8 == 0,
+                  "Records must stay 8 byte aligned in the mapped file");
+
+    close();
+    m_file.setFileName(indexFilePath(directory));
+    if (!m_file.open(QIODevice::ReadOnly))
+        return false;
+
+    m_size = m_file.size();
+    m_data = m_file.map(0, m_size);
+    if (!m_data || m_size < qint64(sizeof(Header))) {
+        close();
+        return false;
+    }
+
+    const Header *header = reinterpret_cast<const Header*>(m_data);
+    if (std::memcmp(header->magic, s_magic, sizeof(s_magic)) != 0 || header->version != s_version
+        || sizeof(Header) + quint64(header->entryCount) * sizeof(Record) > quint64(m_size)
+        || header->blobOffset + header->blobSize > quint64(m_size)) {
+        qWarning() << "Ignoring invalid catalog index" << m_file.fileName();
+        close();
+        return false;
+    }
+    m_header = header;
+    return true;
+}
+
+void Catalog::close()
+{
+    if (m_data)
+        m_file.unmap(const_cast<uchar*>(m_data));
+    m_file.close();
+    m_data = nullptr;
+    m_size = 0;
+    m_header = nullptr;
+}
+
+int Catalog::count() const
+{
+    return m_header ? int(m_header->entryCount) : 0;
+}
+
+const Catalog::Record *Catalog::record(int index) const
+{
+    return reinterpret_cast<const Record*>(m_data + sizeof(Header)) + index;
+}
+
+QByteArrayView Catalog::blob(quint32 offset, quint32 length) const
+{
+    if (quint64(offset) + length > m_header->blobSize)
+        return QByteArrayView();
+    return QByteArrayView(m_data + m_header->blobOffset + offset, length);
+}
+
+QString Catalog::filePath(int index) const
+{
+    const Record *r = record(index);
+    return QString::fromUtf8(blob(r->pathOffset, r->pathLength));
+}
+
+QRectF Catalog::footprint(int index) const
+{
+    const Record *r = record(index);
+    if (std::isnan(r->footprint[0]))
+        return QRectF();
+    return QRectF(QPointF(r->footprint[0], r->footprint[1]), QPointF(r->footprint[2], r->footprint[3]));
+}
+
+CatalogEntry Catalog::entry(int index) const
+{
+    const Record *r = record(index);
+    CatalogEntry entry;
+    entry.filePath = filePath(index);
+    entry.fileSize = r->fileSize;
+    entry.modified = r->modified;
+    entry.footprint = footprint(index);
+    entry.size = QSize(r->width, r->height);
+    entry.blockSize = QSize(r->blockXSize, r->blockYSize);
+    entry.srs = QString::fromUtf8(blob(r->srsOffset, r->srsLength));
+
+    QByteArrayView bands = blob(r->bandsOffset, r->bandCount * 2);
+    for (qsizetype i = 0; i + 1 < bands.size(); i += 2)
+        entry.bands.append({ GDALDataType(quint8(bands[i])), GDALColorInterp(quint8(bands[i + 1])) });
+
+    QByteArrayView overviews = blob(r->overviewsOffset, r->overviewCount * sizeof(quint16));
+    for (qsizetype i = 0; i + qsizetype(sizeof(quint16)) <= overviews.size(); i += sizeof(quint16)) {
+        quint16 factor;
+        std::memcpy(&factor, overviews.data() + i, sizeof(factor));
+        entry.overviewFactors.append(factor);
+    }
+    return entry;
+}
+
+int Catalog::find(const QString &filePath) const
+{
+    // Records are sorted by path
+    QByteArray key = filePath.toUtf8();
+    int low = 0;
+    int high = count();
+    while (low < high) {
+        int middle = (low + high) / 2;
+        const Record *r = record(middle);
+        int order = blob(r->pathOffset, r->pathLength).compare(key);
+        if (order == 0)
+            return middle;
+        if (order < 0)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return -1;
+}
+
+CatalogEntry Catalog::scanFile(const QString &filePath)
+{
+    CatalogEntry entry;
+    entry.filePath = filePath;
+    QFileInfo info(filePath);
+    entry.fileSize = info.size();
+    entry.modified = info.lastModified().toMSecsSinceEpoch();
+
+    GDALDataset *dataset = static_cast<GDALDataset*>(GDALOpen(filePath.toUtf8().constData(), GA_ReadOnly));
+    if (!dataset) {
+        qWarning() << "Failed to open" << filePath << "for the catalog";
+        return entry;
+    }
+
+    entry.size = QSize(dataset->GetRasterXSize(), dataset->GetRasterYSize());
+    for (int i = 1; i <= dataset->GetRasterCount(); ++i) {
+        GDALRasterBand *band = dataset->GetRasterBand(i);
+        entry.bands.append({ band->GetRasterDataType(), band->GetColorInterpretation() });
+        if (i == 1) {
+            int blockXSize = 0;
+            int blockYSize = 0;
+            band->GetBlockSize(&blockXSize, &blockYSize);
+            entry.blockSize = QSize(blockXSize, blockYSize);
+            for (int j = 0; j < band->GetOverviewCount(); ++j) {
+                if (GDALRasterBand *overview = band->GetOverview(j))
+                    entry.overviewFactors.append(qRound(double(entry.size.width()) / overview->GetXSize()));
+            }
+        }
+    }
+
+    double geoTransform[6];
+    bool georeferenced = dataset->GetGeoTransform(geoTransform) == CE_None;
+    std::unique_ptr<OGRCoordinateTransformation> transform;
+    const char *projWkt = dataset->GetProjectionRef();
+    if (projWkt && strlen(projWkt) > 0) {
+        OGRSpatialReference srcSRS;
+        srcSRS.importFromWkt(projWkt);
+        srcSRS.SetAxisMappingStrategy(OAMS_TRADITIONAL_GIS_ORDER);
+        const char *authority = srcSRS.GetAuthorityName(nullptr);
+        const char *code = srcSRS.GetAuthorityCode(nullptr);
+        entry.srs = authority && code ? QString("%1:%2").arg(authority, code) : QString(projWkt);
+
+        OGRSpatialReference dstSRS;
+        dstSRS.importFromEPSG(4326);
+        dstSRS.SetAxisMappingStrategy(OAMS_TRADITIONAL_GIS_ORDER);
+        if (!(srcSRS.IsGeographic() && srcSRS.IsSame(&dstSRS)))
+            transform.reset(OGRCreateCoordinateTransformation(&srcSRS, &dstSRS));
+    }
+    GDALClose(dataset);
+
+    if (!georeferenced) {
+        qWarning() << "No geotransform in" << filePath;
+        return entry;
+    }
+
+    std::vector<double> x;
+    std::vector<double> y;
+    int width = entry.size.width();
+    int height = entry.size.height();
+    for (int i = 0; i < s_footprintEdgePoints; ++i) {
+        double t = double(i) / s_footprintEdgePoints;
+        double columns[] = { t * width, double(width), (1 - t) * width, 0 };
+        double rows[] = { 0, t * height, double(height), (1 - t) * height };
+        for (int edge = 0; edge < 4; ++edge) {
+            x.push_back(geoTransform[0] + columns[edge] * geoTransform[1] + rows[edge] * geoTransform[2]);
+            y.push_back(geoTransform[3] + columns[edge] * geoTransform[4] + rows[edge] * geoTransform[5]);
+        }
+    }
+    if (transform && !transform->Transform(x.size(), x.data(), y.data())) {
+        qWarning() << "Failed to transform the footprint of" << filePath;
+        return entry;
+    }
+
+    auto [minX, maxX] = std::minmax_element(x.cbegin(), x.cend());
+    auto [minY, maxY] = std::minmax_element(y.cbegin(), y.cend());
+    entry.footprint = QRectF(QPointF(*minX, *minY), QPointF(*maxX, *maxY));
+    return entry;
+}
+
+bool Catalog::update(const QString &directory, const std::atomic<bool> *cancel)
+{
+    QStringList files;
+    QDirIterator it(QDir(directory).absolutePath(), { "*.tif", "*.tiff" }, QDir::Files, QDirIterator::Subdirectories);
+    while (it.hasNext())
+        files.append(it.next());
+    // Same order as the records, which find() relies on
+    std::sort(files.begin(), files.end(), [](const QString &a, const QString &b) { return a.toUtf8() < b.toUtf8(); });
+
+    Catalog previous;
+    previous.open(directory);
+
+    // Only stat() the files whose record can be reused, headers are read for new and changed ones
+    QList<CatalogEntry> entries(files.size());
+    QList<int> changed;
+    for (int i = 0; i < files.size(); ++i) {
+        QFileInfo info(files[i]);
+        int index = previous.find(files[i]);
+        if (index >= 0 && previous.record(index)->fileSize == info.size()
+            && previous.record(index)->modified == info.lastModified().toMSecsSinceEpoch()) {
+            entries[i] = previous.entry(index);
+        } else {
+            changed.append(i);
+        }
+    }
+    if (changed.isEmpty() && files.size() == previous.count())
+        return false;
+
+    QThreadPool pool;
+    pool.setMaxThreadCount(std::max(s_minScanThreads, QThread::idealThreadCount()));
+    CatalogEntry *scanned = entries.data();
+    QtConcurrent::blockingMap(&pool, changed, [scanned, &files, cancel](int &i) {
+        if (!cancel || !*cancel)
+            scanned[i] = scanFile(files[i]);
+    });
+    if (cancel && *cancel)
+        return false;
+
+    qDebug() << "Catalog of" << directory << ":" << changed.size() << "of" << files.size() << "files rescanned";
+    previous.close();
+    return write(directory, entries);
+}
+
+bool Catalog::write(const QString &directory, const QList<CatalogEntry> &entries)
+{
+    QByteArray blobs;
+    auto appendBlob = [&blobs](const QByteArray &data, quint32 &offset) {
+        offset = quint32(blobs.size());
+        blobs.append(data);
+    };
+
+    std::vector<Record> records(entries.size());
+    for (int i = 0; i < entries.size(); ++i) {
+        const CatalogEntry &entry = entries[i];
+        Record &r = records[i];
+        std::memset(&r, 0, sizeof(r));
+        r.fileSize = entry.fileSize;
+        r.modified = entry.modified;
+        if (entry.isValid()) {
+            r.footprint[0] = entry.footprint.left();
+            r.footprint[1] = entry.footprint.top();
+            r.footprint[2] = entry.footprint.right();
+            r.footprint[3] = entry.footprint.bottom();
+        } else {
+            std::fill(std::begin(r.footprint), std::end(r.footprint), std::numeric_limits<double>::quiet_NaN());
+        }
+        r.width = entry.size.width();
+        r.height = entry.size.height();
+        r.blockXSize = entry.blockSize.width();
+        r.blockYSize = entry.blockSize.height();
+
+        QByteArray path = entry.filePath.toUtf8();
+        appendBlob(path, r.pathOffset);
+        r.pathLength = path.size();
+        QByteArray srs = entry.srs.toUtf8();
+        appendBlob(srs, r.srsOffset);
+        r.srsLength = srs.size();
+
+        QByteArray bands;
+        for (const CatalogEntry::Band &band : entry.bands) {
+            bands.append(char(band.dataType));
+            bands.append(char(band.colorInterp));
+        }
+        appendBlob(bands, r.bandsOffset);
+        r.bandCount = entry.bands.size();
+
+        QByteArray overviews;
+        for (int factor : entry.overviewFactors) {
+            quint16 value = quint16(std::min(factor, 0xffff));
+            overviews.append(reinterpret_cast<const char*>(&value), sizeof(value));
+        }
+        appendBlob(overviews, r.overviewsOffset);
+        r.overviewCount = entry.overviewFactors.size();
+    }
+
+    Header header;
+    std::memcpy(header.magic, s_magic, sizeof(s_magic));
+    header.version = s_version;
+    header.entryCount = quint32(records.size());
+    header.blobOffset = sizeof(Header) + records.size() * sizeof(Record);
+    header.blobSize = blobs.size();
+
+    QString path = indexFilePath(directory);
+    QDir().mkpath(QFileInfo(path).absolutePath());
+    QSaveFile file(path);
+    if (!file.open(QIODevice::WriteOnly)) {
+        qWarning() << "Failed to write catalog index" << path << ":" << file.errorString();
+        return false;
+    }
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(records.data()), qint64(records.size() * sizeof(Record)));
+    file.write(blobs);
+    return file.commit();
+}
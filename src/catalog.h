@@ -0,0 +1,81 @@
+#ifndef CATALOG_H
+#define CATALOG_H
+
+#include <QFile>
+#include <QList>
+#include <QRectF>
+#include <QSize>
+#include <QString>
+#include <atomic>
+#include <gdal.h>
+
+// What the catalog knows about one GeoTIFF without opening it.
+struct CatalogEntry
+{
+    struct Band
+    {
+        GDALDataType dataType = GDT_Unknown;
+        GDALColorInterp colorInterp = GCI_Undefined;
+    };
+
+    QString filePath;
+    qint64 fileSize = -1;
+    qint64 modified = 0;        // ms since epoch
+    QRectF footprint;           // WGS84 bounds, x longitude and y latitude. Null if not georeferenced.
+    QSize size;
+    QSize blockSize;
+    QString srs;                // Authority code such as "EPSG:31467", or WKT when there is none
+    QList<Band> bands;
+    QList<int> overviewFactors;
+
+    inline bool isValid() const { return footprint.isValid(); }
+};
+
+// Index of the GeoTIFFs in a directory tree, stored in the cache directory in a compact binary file:
+// a header, one fixed size record per file sorted by path, and a blob area with the variable length
+// parts (paths, SRS, band layout, overview factors). The file is memory mapped when opened, so the
+// file list and footprints of thousands of sheets are available without reading any TIFF header.
+//
+// update() brings the index up to date on a worker thread: files whose size and modification time
+// still match their record are taken over as they are, only new or changed ones are opened (in
+// parallel) with GDAL.
+class Catalog
+{
+public:
+    Catalog() = default;
+    ~Catalog();
+    Q_DISABLE_COPY(Catalog)
+
+    bool open(const QString &directory);
+    void close();
+    inline bool isOpen() const { return m_header != nullptr; }
+
+    int count() const;
+    CatalogEntry entry(int index) const;
+    QString filePath(int index) const;
+    QRectF footprint(int index) const;
+    // Index of the record for filePath (absolute), or -1.
+    int find(const QString &filePath) const;
+
+    // Reads the catalog entry of a single file with GDAL.
+    static CatalogEntry scanFile(const QString &filePath);
+    // Rescans directory and rewrites its index if anything changed. Returns whether it did.
+    static bool update(const QString &directory, const std::atomic<bool> *cancel = nullptr);
+    static QString indexFilePath(const QString &directory);
+
+private:
+    struct Header;
+    struct Record;
+
+    const Record *record(int index) const;
+    QByteArrayView blob(quint32 offset, quint32 length) const;
+    static bool write(const QString &directory, const QList<CatalogEntry> &entries);
+
+private:
+    QFile m_file;
+    const uchar *m_data = nullptr;
+    qint64 m_size = 0;
+    const Header *m_header = nullptr;
+};
+
+#endif // CATALOG_H
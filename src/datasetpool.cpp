@@ -0,0 +1,179 @@
+#include "datasetpool.h"
+#include "rangecache.h"
+#include <QCoreApplication>
+#include <QMutexLocker>
+#include <QThread>
+#include <QDebug>
+#include <algorithm>
+#include <cpl_conv.h>
+
+static constexpr int s_defaultMaxOpen = 128;
+static constexpr int s_defaultIdleTimeout = 30000;
+static constexpr int s_idleCheckInterval = 1000;
+// Lower bound for GDAL's block cache unless GDAL_CACHEMAX is set. The cache is shared by every pooled
+// handle, and each of them keeps its own copy of the blocks it decoded.
+static constexpr GIntBig s_minBlockCacheBytes = 256 * 1024 * 1024;
+
+DatasetPool::DatasetPool(QObject *parent)
+    : QObject{parent}
+    , m_maxOpen(s_defaultMaxOpen)
+    , m_idleTimeout(s_defaultIdleTimeout)
+{
+    GDALAllRegister();
+    if (CPLGetConfigOption("GDAL_CACHEMAX", nullptr) == nullptr && GDALGetCacheMax64() < s_minBlockCacheBytes)
+        GDALSetCacheMax64(s_minBlockCacheBytes);
+    // Installs the filesystem handler remote files are opened through
+    RangeCache::instance();
+
+    m_idleTimer.setInterval(s_idleCheckInterval);
+    connect(&m_idleTimer, &QTimer::timeout, this, &DatasetPool::closeIdle);
+    m_idleTimer.start();
+}
+
+DatasetPool::~DatasetPool()
+{
+    QMutexLocker locker(&m_mutex);
+    for (const Entry &entry : m_entries) {
+        if (entry.refCount > 0)
+            qWarning() << "Closing dataset" << entry.filePath << "that is still in use";
+        GDALClose(entry.dataset);
+    }
+    m_entries.clear();
+    s_instance = nullptr;
+}
+
+DatasetPool *DatasetPool::instance()
+{
+    // Create it from the main thread (see main.cpp) before any worker asks for it, the idle timer
+    // runs on the thread the pool was created in.
+    if (s_instance == nullptr)
+        s_instance = new DatasetPool(qApp);
+    return s_instance;
+}
+
+DatasetPool::Handle DatasetPool::acquire(const QString &filePath)
+{
+    Qt::HANDLE thread = QThread::currentThreadId();
+    {
+        QMutexLocker locker(&m_mutex);
+        for (Entry &entry : m_entries) {
+            if (!entry.stale && entry.thread == thread && entry.filePath == filePath) {
+                ++entry.refCount;
+                return Handle(&entry);
+            }
+        }
+    }
+
+    // Opening reads the header, keep the other threads going meanwhile
+    GDALDataset *dataset = static_cast<GDALDataset*>(GDALOpen(RangeCache::gdalPath(filePath).toUtf8().constData(), GA_ReadOnly));
+    if (!dataset) {
+        qWarning() << "Failed to open GeoTIFF file:" << filePath << ":" << CPLGetLastErrorMsg();
+        return Handle();
+    }
+
+    QMutexLocker locker(&m_mutex);
+    Entry &entry = m_entries.emplace_back();
+    entry.filePath = filePath;
+    entry.thread = thread;
+    entry.dataset = dataset;
+    entry.refCount = 1;
+    entry.lastUsed.start();
+    trimLocked();
+    return Handle(&entry);
+}
+
+void DatasetPool::release(Entry *entry)
+{
+    QMutexLocker locker(&m_mutex);
+    --entry->refCount;
+    entry->lastUsed.start();
+    if (entry->refCount == 0) {
+        if (entry->stale) {
+            auto it = std::find_if(m_entries.begin(), m_entries.end(), [entry](const Entry &e) { return &e == entry; });
+            closeLocked(it);
+        } else {
+            trimLocked();
+        }
+    }
+}
+
+void DatasetPool::invalidate(const QString &filePath)
+{
+    QMutexLocker locker(&m_mutex);
+    for (auto it = m_entries.begin(); it != m_entries.end();) {
+        auto next = std::next(it);
+        if (it->filePath == filePath) {
+            if (it->refCount == 0)
+                closeLocked(it);
+            else
+                it->stale = true;
+        }
+        it = next;
+    }
+}
+
+void DatasetPool::closeIdle()
+{
+    QMutexLocker locker(&m_mutex);
+    for (auto it = m_entries.begin(); it != m_entries.end();) {
+        auto next = std::next(it);
+        if (it->refCount == 0 && it->lastUsed.hasExpired(m_idleTimeout))
+            closeLocked(it);
+        it = next;
+    }
+}
+
+void DatasetPool::trimLocked()
+{
+    // Close the least recently used idle handles. Handles in use are never closed, so the pool can
+    // temporarily hold more than maxOpen when that many are leased at once.
+    while (int(m_entries.size()) > m_maxOpen) {
+        auto oldest = m_entries.end();
+        for (auto it = m_entries.begin(); it != m_entries.end(); ++it) {
+            if (it->refCount == 0 && (oldest == m_entries.end() || it->lastUsed.elapsed() > oldest->lastUsed.elapsed()))
+                oldest = it;
+        }
+        if (oldest == m_entries.end())
+            break;
+        closeLocked(oldest);
+    }
+}
+
+void DatasetPool::closeLocked(std::list<Entry>::iterator it)
+{
+    if (it == m_entries.end())
+        return;
+    GDALClose(it->dataset);
+    m_entries.erase(it);
+}
+
+int DatasetPool::maxOpen() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_maxOpen;
+}
+
+void DatasetPool::setMaxOpen(int maxOpen)
+{
+    QMutexLocker locker(&m_mutex);
+    m_maxOpen = std::max(1, maxOpen);
+    trimLocked();
+}
+
+int DatasetPool::idleTimeout() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_idleTimeout;
+}
+
+void DatasetPool::setIdleTimeout(int timeout)
+{
+    QMutexLocker locker(&m_mutex);
+    m_idleTimeout = timeout;
+}
+
+int DatasetPool::openCount() const
+{
+    QMutexLocker locker(&m_mutex);
+    return int(m_entries.size());
+}
@@ -0,0 +1,103 @@
+#ifndef DATASETPOOL_H
+#define DATASETPOOL_H
+
+#include <QObject>
+#include <QMutex>
+#include <QElapsedTimer>
+#include <QTimer>
+#include <list>
+#include <utility>
+#include <gdal_priv.h>
+
+// Process wide pool of read-only GDAL dataset handles, keyed by file path (or http(s) URL, see
+// RangeCache) and thread. A GDAL dataset
+// must not be used from two threads at once, so every thread gets a handle of its own; repeated
+// acquire() calls on the same thread share it and are reference counted. Handles nobody holds stay open
+// for idleTimeout ms so that the next tile, statistics run or metadata read doesn't parse the header
+// again, and the least recently used idle ones are closed when more than maxOpen are open.
+class DatasetPool : public QObject
+{
+    Q_OBJECT
+
+public:
+    class Handle;
+
+    static DatasetPool *instance();
+    ~DatasetPool();
+
+    // Returns an empty handle when the file can't be opened.
+    Handle acquire(const QString &filePath);
+    // Closes the idle handles of filePath, and those in use once released, so that the file is opened
+    // again on the next acquire(). Call after the file or its overviews changed.
+    void invalidate(const QString &filePath);
+
+    int maxOpen() const;
+    void setMaxOpen(int maxOpen);
+    int idleTimeout() const;
+    void setIdleTimeout(int timeout);
+    int openCount() const;
+
+private:
+    struct Entry
+    {
+        QString filePath;
+        Qt::HANDLE thread = nullptr;
+        GDALDataset *dataset = nullptr;
+        int refCount = 0;
+        bool stale = false;
+        QElapsedTimer lastUsed;
+    };
+
+    explicit DatasetPool(QObject *parent);
+    void release(Entry *entry);
+    void closeIdle();
+    void trimLocked();
+    void closeLocked(std::list<Entry>::iterator it);
+
+private:
+    mutable QMutex m_mutex;
+    std::list<Entry> m_entries;     // Stable addresses, handles point into it
+    int m_maxOpen;
+    int m_idleTimeout;
+    QTimer m_idleTimer;
+
+    inline static DatasetPool *s_instance = nullptr;
+};
+
+// Lease of a pooled dataset, released when destroyed. Only use it on the thread that acquired it.
+class DatasetPool::Handle
+{
+public:
+    Handle() = default;
+    Handle(Handle &&other) noexcept : m_entry(std::exchange(other.m_entry, nullptr)) {}
+    Handle &operator=(Handle &&other) noexcept
+    {
+        if (this != &other) {
+            reset();
+            m_entry = std::exchange(other.m_entry, nullptr);
+        }
+        return *this;
+    }
+    ~Handle() { reset(); }
+    Q_DISABLE_COPY(Handle)
+
+    inline GDALDataset *get() const { return m_entry ? m_entry->dataset : nullptr; }
+    inline GDALDataset *operator->() const { return get(); }
+    inline explicit operator bool() const { return m_entry != nullptr; }
+
+    void reset()
+    {
+        // The pool closes all its datasets when destroyed, handles outliving it have nothing to release
+        if (m_entry && DatasetPool::s_instance)
+            DatasetPool::s_instance->release(m_entry);
+        m_entry = nullptr;
+    }
+
+private:
+    friend class DatasetPool;
+    explicit Handle(Entry *entry) : m_entry(entry) {}
+
+    Entry *m_entry = nullptr;
+};
+
+#endif // DATASETPOOL_H
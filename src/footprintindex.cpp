@@ -0,0 +1,90 @@
+#include "footprintindex.h"
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+
+static constexpr int s_nodeCapacity = 16;
+
+template <typename Item, typename BoundsOf>
+void FootprintIndex::sortTileRecursive(QList<Item> &items, BoundsOf boundsOf)
+{
+    qsizetype nodeCount = (items.size() + s_nodeCapacity - 1) / s_nodeCapacity;
+    qsizetype sliceCount = qsizetype(std::ceil(std::sqrt(double(nodeCount))));
+    qsizetype sliceSize = sliceCount * s_nodeCapacity;
+
+    std::sort(items.begin(), items.end(), [&boundsOf](const Item &a, const Item &b) {
+        return boundsOf(a).center().x() < boundsOf(b).center().x();
+    });
+    for (qsizetype start = 0; start < items.size(); start += sliceSize) {
+        auto end = items.begin() + std::min(start + sliceSize, items.size());
+        std::sort(items.begin() + start, end, [&boundsOf](const Item &a, const Item &b) {
+            return boundsOf(a).center().y() < boundsOf(b).center().y();
+        });
+    }
+}
+
+void FootprintIndex::clear()
+{
+    m_footprints.clear();
+    m_entries.clear();
+    m_nodes.clear();
+}
+
+void FootprintIndex::build(const QList<QRectF> &footprints)
+{
+    clear();
+    m_footprints = footprints;
+    if (footprints.isEmpty())
+        return;
+
+    m_entries.resize(footprints.size());
+    std::iota(m_entries.begin(), m_entries.end(), 0);
+    sortTileRecursive(m_entries, [this](int entry) { return m_footprints[entry]; });
+
+    QList<Node> level;
+    for (qsizetype i = 0; i < m_entries.size(); i += s_nodeCapacity) {
+        Node node { QRectF(), int(i), int(std::min<qsizetype>(s_nodeCapacity, m_entries.size() - i)), true };
+        for (int j = node.first; j < node.first + node.count; ++j)
+            node.bounds |= m_footprints[m_entries[j]];
+        level.append(node);
+    }
+
+    // Pack each level into parents until only the root is left. Children of a node are contiguous
+    // in m_nodes because a level is appended in the order its parents were packed.
+    while (level.size() > 1) {
+        sortTileRecursive(level, [](const Node &node) { return node.bounds; });
+        int base = m_nodes.size();
+        m_nodes.append(level);
+
+        QList<Node> parents;
+        for (qsizetype i = 0; i < level.size(); i += s_nodeCapacity) {
+            Node node { QRectF(), int(base + i), int(std::min<qsizetype>(s_nodeCapacity, level.size() - i)), false };
+            for (int j = node.first; j < node.first + node.count; ++j)
+                node.bounds |= m_nodes[j].bounds;
+            parents.append(node);
+        }
+        level = parents;
+    }
+    m_nodes.append(level.first());
+}
+
+QList<int> FootprintIndex::query(const QRectF &area) const
+{
+    QList<int> result;
+    if (m_nodes.isEmpty())
+        return result;
+
+    QList<int> stack { int(m_nodes.size() - 1) };
+    while (!stack.isEmpty()) {
+        const Node &node = m_nodes[stack.takeLast()];
+        if (!node.bounds.intersects(area))
+            continue;
+        for (int i = node.first; i < node.first + node.count; ++i) {
+            if (!node.leaf)
+                stack.append(i);
+            else if (m_footprints[m_entries[i]].intersects(area))
+                result.append(m_entries[i]);
+        }
+    }
+    return result;
+}
@@ -0,0 +1,39 @@
+#ifndef FOOTPRINTINDEX_H
+#define FOOTPRINTINDEX_H
+
+#include <QList>
+#include <QRectF>
+
+// Static R-tree over rectangles, bulk loaded with the Sort-Tile-Recursive algorithm: entries are
+// sorted into vertical slices by x, each slice by y, and runs of s_nodeCapacity entries become the
+// leaves. The same packing is repeated on the nodes of each level until a single root remains.
+// Rebuild it when the set of rectangles changes.
+class FootprintIndex
+{
+public:
+    void build(const QList<QRectF> &footprints);
+    void clear();
+
+    // Indices (into the list given to build()) of the footprints that intersect area.
+    QList<int> query(const QRectF &area) const;
+    inline int size() const { return m_footprints.size(); }
+
+private:
+    struct Node
+    {
+        QRectF bounds;
+        int first = 0;      // First child node, or for leaves the first position in m_entries
+        int count = 0;
+        bool leaf = true;
+    };
+
+    template <typename Item, typename BoundsOf>
+    static void sortTileRecursive(QList<Item> &items, BoundsOf boundsOf);
+
+private:
+    QList<QRectF> m_footprints;
+    QList<int> m_entries;   // Footprint indices in leaf order
+    QList<Node> m_nodes;    // All levels, leaves first and the root last
+};
+
+#endif // FOOTPRINTINDEX_H
@@ -1,10 +1,12 @@
 #include "geotiffhandler.h"
+#include "perfcounters.h"
 #include <QCoreApplication>
 #include <QFileInfo>
 #include <QDir>
 #include <QStandardPaths>
 #include <QImage>
 #include <QDebug>
+#include <QtConcurrent>
 
 // Public GDAL headers
 #include <gdal.h>
@@ -18,11 +20,21 @@ GeoTiffHandler::GeoTiffHandler(QObject *parent)
     , m_statusMessage{"Ready"}
 {
     GDALAllRegister();
+
+    connect(&m_statisticsEngine, &StatisticsEngine::runningChanged, this, &GeoTiffHandler::computingStatisticsChanged);
+    connect(&m_statisticsEngine, &StatisticsEngine::progressChanged, this, &GeoTiffHandler::statisticsProgressChanged);
+    connect(&m_statisticsEngine, &StatisticsEngine::finished, this, &GeoTiffHandler::onStatisticsFinished);
+    connect(&m_metadataWatcher, &QFutureWatcher<Metadata>::finished, this, &GeoTiffHandler::onMetadataFinished);
+    connect(&m_metadataWatcher, &QFutureWatcher<Metadata>::progressValueChanged, this, [this](int value) {
+        m_metadataProgress = value / 100.0;
+        emit metadataProgressChanged();
+    });
 }
 
 GeoTiffHandler::~GeoTiffHandler()
 {
-    closeDataset();
+    m_metadataWatcher.cancel();
+    m_metadataWatcher.waitForFinished();
 }
 
 GeoTiffHandler *GeoTiffHandler::instance() {
@@ -44,133 +56,115 @@ GeoTiffHandler *GeoTiffHandler::create(QQmlEngine *, QJSEngine *engine)
     return s_singletonInstance;
 }
 
-QImage GeoTiffHandler::loadGeoTiffImage(const QUrl &fileUrl)
-{
-    closeDataset();
-    m_dataset = openGeoTiff(fileUrl);
-    QImage image(exportToQImage(m_dataset));
-    m_statusMessage = image.isNull() ? "Failed to load GeoTiff into QImage" : "GeoTiff loaded into QImage successfully";
-    emit statusMessageChanged();
-    return image;
-}
-
 void GeoTiffHandler::loadMetadata(const QUrl &fileUrl)
 {
-    if(fileUrl.toLocalFile() != m_currentFile) {
-        closeDataset();
-        m_dataset = openGeoTiff(fileUrl);
-        if (m_dataset == nullptr)
-            return;
-    }
-
-    // Extract metadata
-    extractMetadata();
-
-    m_statusMessage = "GeoTiff metadata loaded successfully.";
-    emit statusMessageChanged();
-}
-
-GDALDataset *GeoTiffHandler::openGeoTiff(const QUrl &fileUrl)
-{
-    // Convert QUrl to local file path
-    QString filePath = fileUrl.toLocalFile();
-
-    // Set current file information
-    m_currentFile = filePath;
-    m_fileName = QFileInfo(filePath).fileName();
+    // A load still running for the previous file has its result dropped; GDAL can't be interrupted while
+    // opening, so it only stops once the open returns.
+    if (m_metadataWatcher.isRunning())
+        m_metadataWatcher.cancel();
+
+    // Remote files are kept as their URL, DatasetPool opens them through the RangeCache
+    m_currentFile = fileUrl.isLocalFile() ? fileUrl.toLocalFile() : fileUrl.toString();
+    m_fileName = QFileInfo(fileUrl.path()).fileName();
     emit currentFileChanged();
     emit fileNameChanged();
 
-    // Update status
+    // Nothing of the previous file stays on show under the new name, also if this load fails or is cancelled
+    applyMetadata(Metadata());
+    if (!m_bandStatistics.isEmpty()) {
+        m_bandStatistics.clear();
+        emit bandStatisticsChanged();
+    }
+
     m_statusMessage = "Loading " + m_fileName + "...";
     emit statusMessageChanged();
+    m_metadataProgress = 0;
+    emit metadataProgressChanged();
 
-    // Open GeoTIFF file with GDAL public API
-    CPLSetConfigOption("GDAL_PAM_ENABLED", "NO");
-    GDALDataset *dataset = static_cast<GDALDataset*>(GDALOpen(filePath.toUtf8().constData(), GA_ReadOnly));
-
-    if (!dataset) {
-        m_statusMessage = "Failed to open GeoTIFF file";
-        emit statusMessageChanged();
-        return nullptr;
-    }
-
-    return dataset;
+    m_metadataWatcher.setFuture(QtConcurrent::run(&GeoTiffHandler::readMetadata, m_currentFile));
+    emit loadingMetadataChanged();
 }
 
-void GeoTiffHandler::closeDataset()
+void GeoTiffHandler::cancelMetadata()
 {
-    if (m_dataset) {
-        GDALClose(m_dataset);
-        m_dataset = nullptr;
-    }
+    if (!m_metadataWatcher.isRunning())
+        return;
+    m_metadataWatcher.cancel();
+    m_statusMessage = "Loading " + m_fileName + " cancelled";
+    emit statusMessageChanged();
 }
 
-void GeoTiffHandler::extractMetadata()
+void GeoTiffHandler::readMetadata(QPromise<Metadata> &promise, const QString &filePath)
 {
-    if (!m_dataset)
+    PerfCounters::Scope scope(PerfCounters::Metadata);
+    promise.setProgressRange(0, 100);
+
+    // Open GeoTIFF file through the pool, later reads on this thread reuse the handle
+    DatasetPool::Handle handle = DatasetPool::instance()->acquire(filePath);
+    if (!handle || promise.isCanceled())
         return;
+    promise.setProgressValue(10);
+
+    GDALDatasetH dataset = GDALDataset::ToHandle(handle.get());
+    Metadata metadata;
 
     // Get image dimensions
-    int width = GDALGetRasterXSize(m_dataset);
-    int height = GDALGetRasterYSize(m_dataset);
-    m_dimensions = QString("%1 × %2").arg(width).arg(height);
-    emit dimensionsChanged();
+    int width = GDALGetRasterXSize(dataset);
+    int height = GDALGetRasterYSize(dataset);
+    metadata.dimensions = QString("%1 × %2").arg(width).arg(height);
 
     // Get coordinate system
-    const char* projWkt = GDALGetProjectionRef(m_dataset);
+    const char* projWkt = GDALGetProjectionRef(dataset);
     if (projWkt && strlen(projWkt) > 0) {
         OGRSpatialReferenceH srs = OSRNewSpatialReference(projWkt);
 
         // Extract projection info
         const char* projName = OSRGetAttrValue(srs, "PROJECTION", 0);
-        m_projection = projName ? QString(projName) : "Unknown";
-        emit projectionChanged();
+        metadata.projection = projName ? QString(projName) : "Unknown";
 
         // Get coordinate system name
         char *pszPrettyWkt = nullptr;
         OSRExportToPrettyWkt(srs, &pszPrettyWkt, 0);
         if (pszPrettyWkt) {
-            m_coordinateSystem = QString(pszPrettyWkt);
+            metadata.coordinateSystem = QString(pszPrettyWkt);
             CPLFree(pszPrettyWkt);
         } else {
-            m_coordinateSystem = QString(projWkt);
+            metadata.coordinateSystem = QString(projWkt);
         }
         OSRDestroySpatialReference(srs);
-        emit coordinateSystemChanged();
     } else {
-        m_projection = "None";
-        m_coordinateSystem = "None";
-        emit projectionChanged();
-        emit coordinateSystemChanged();
+        metadata.projection = "None";
+        metadata.coordinateSystem = "None";
     }
+    if (promise.isCanceled())
+        return;
+    promise.setProgressValue(20);
 
     // Get geospatial bounds
     double geoTransform[6];
-    if (GDALGetGeoTransform(m_dataset, geoTransform) == CE_None) {
+    if (GDALGetGeoTransform(dataset, geoTransform) == CE_None) {
         double minX = geoTransform[0];
         double maxY = geoTransform[3];
         double maxX = minX + geoTransform[1] * width;
         double minY = maxY + geoTransform[5] * height;
 
-        m_boundsMinX = QString::number(minX, 'f', 6);
-        m_boundsMinY = QString::number(minY, 'f', 6);
-        m_boundsMaxX = QString::number(maxX, 'f', 6);
-        m_boundsMaxY = QString::number(maxY, 'f', 6);
-        emit boundsChanged();
+        metadata.boundsMinX = QString::number(minX, 'f', 6);
+        metadata.boundsMinY = QString::number(minY, 'f', 6);
+        metadata.boundsMaxX = QString::number(maxX, 'f', 6);
+        metadata.boundsMaxY = QString::number(maxY, 'f', 6);
     } else {
-        m_boundsMinX = "Unknown";
-        m_boundsMinY = "Unknown";
-        m_boundsMaxX = "Unknown";
-        m_boundsMaxY = "Unknown";
-        emit boundsChanged();
+        metadata.boundsMinX = "Unknown";
+        metadata.boundsMinY = "Unknown";
+        metadata.boundsMaxX = "Unknown";
+        metadata.boundsMaxY = "Unknown";
     }
 
     // Get band information
-    m_bandsModel.clear();
-    int bandCount = GDALGetRasterCount(m_dataset);
+    int bandCount = GDALGetRasterCount(dataset);
     for (int i = 1; i <= bandCount; i++) {
-        GDALRasterBandH band = GDALGetRasterBand(m_dataset, i);
+        if (promise.isCanceled())
+            return;
+        GDALRasterBandH band = GDALGetRasterBand(dataset, i);
         if (band) {
             QString bandInfo = QString("Band %1: ").arg(i);
 
@@ -188,84 +182,100 @@ void GeoTiffHandler::extractMetadata()
             bandInfo += QString("Block: %1x%2").arg(blockXSize).arg(blockYSize);
 
             // Add to model
-            m_bandsModel.append(bandInfo);
+            metadata.bandsModel.append(bandInfo);
         }
+        promise.setProgressValue(20 + 80 * i / bandCount);
     }
+
+    promise.addResult(metadata);
+}
+
+void GeoTiffHandler::onMetadataFinished()
+{
+    emit loadingMetadataChanged();
+    if (m_metadataWatcher.isCanceled())
+        return;
+    if (m_metadataWatcher.future().resultCount() == 0) {
+        m_statusMessage = "Failed to open GeoTIFF file";
+        emit statusMessageChanged();
+        return;
+    }
+
+    applyMetadata(m_metadataWatcher.result());
+    loadStatistics();
+
+    m_statusMessage = "GeoTiff metadata loaded successfully.";
+    emit statusMessageChanged();
+}
+
+void GeoTiffHandler::applyMetadata(const Metadata &metadata)
+{
+    m_dimensions = metadata.dimensions;
+    m_projection = metadata.projection;
+    m_coordinateSystem = metadata.coordinateSystem;
+    m_boundsMinX = metadata.boundsMinX;
+    m_boundsMinY = metadata.boundsMinY;
+    m_boundsMaxX = metadata.boundsMaxX;
+    m_boundsMaxY = metadata.boundsMaxY;
+    m_bandsModel = metadata.bandsModel;
+    emit dimensionsChanged();
+    emit projectionChanged();
+    emit coordinateSystemChanged();
+    emit boundsChanged();
     emit bandsModelChanged();
 }
 
-QImage GeoTiffHandler::exportToQImage(GDALDatasetH dataset)
+QVariantList GeoTiffHandler::bandStatistics() const
 {
-    if (!dataset)
-        return QImage();
+    QVariantList list;
+    for (const BandStatistics &statistics : m_bandStatistics)
+        list.append(statistics.toVariantMap());
+    return list;
+}
 
-    int width = GDALGetRasterXSize(dataset);
-    int height = GDALGetRasterYSize(dataset);
-    int bandCount = GDALGetRasterCount(dataset);
+void GeoTiffHandler::loadStatistics()
+{
+    // Statistics computed in an earlier session are reused as long as the file hasn't changed.
+    m_bandStatistics = StatisticsCache::load(m_currentFile);
+    emit bandStatisticsChanged();
+    if (m_bandStatistics.isEmpty())
+        computeStatistics(true);
+}
 
-    QImage image;
-    // For simplicity, we will assume 3 bands (RGB) or convert to RGB
-    if (bandCount >= 3) {
-        GDALRasterBandH redBand = GDALGetRasterBand(dataset, 1);
-        GDALRasterBandH greenBand = GDALGetRasterBand(dataset, 2);
-        GDALRasterBandH blueBand = GDALGetRasterBand(dataset, 3);
+bool GeoTiffHandler::computeStatistics(bool approximate)
+{
+    if (m_currentFile.isEmpty())
+        return false;
+
+    if (m_statisticsEngine.running()) {
+        if (m_statisticsEngine.filePath() == m_currentFile)
+            return false;
+        // A previous file is still being processed. Its result is dropped and this run started once it
+        // has stopped, in onStatisticsFinished().
+        m_statisticsEngine.cancel();
+        m_statisticsPending = true;
+        m_pendingApproximate = approximate;
+        return true;
+    }
 
-        // Check if bands are valid
-        if (!redBand || !greenBand || !blueBand) {
-            return QImage();
-        }
+    return m_statisticsEngine.start(m_currentFile, approximate);
+}
 
-        // Allocate mem for band data
-        std::vector<uint8_t> redData(width*height);
-        std::vector<uint8_t> greenData(width*height);
-        std::vector<uint8_t> blueData(width*height);
-
-        CPLErr err = GDALRasterIO(redBand, GF_Read, 0, 0, width, height, redData.data(), width, height, GDT_Byte, 0, 0);
-        if (err > CPLErr::CE_Warning)
-            return QImage();
-        err = GDALRasterIO(greenBand, GF_Read, 0, 0, width, height, greenData.data(), width, height, GDT_Byte, 0, 0);
-        if (err > CPLErr::CE_Warning)
-            return QImage();
-        err = GDALRasterIO(blueBand, GF_Read, 0, 0, width, height, blueData.data(), width, height, GDT_Byte, 0, 0);
-        if (err > CPLErr::CE_Warning)
-            return QImage();
-
-        image = QImage(width, height, QImage::Format_RGB32);
-        for (auto y = 0; y < height; y++) {
-            QRgb* scanLine = reinterpret_cast<QRgb*>(image.scanLine(y));
-            for (auto x = 0; x < width; x++) {
-                int index = y * width + x;
-                scanLine[x] = qRgb(redData[index], greenData[index], blueData[index]);
-            }
-        }
-    } else if (bandCount == 1) {
-        // Single band - grayscale
-        GDALRasterBandH band = GDALGetRasterBand(dataset, 1);
-        if (!band) {
-            return QImage();
-        }
+void GeoTiffHandler::cancelStatistics()
+{
+    m_statisticsEngine.cancel();
+}
 
-        // Allocate memory for band data
-        std::vector<uint8_t> data(width*height);
-
-        // Read band data
-        CPLErr err = GDALRasterIO(band, GF_Read, 0, 0, width, height, data.data(), width, height, GDT_Byte, 0, 0);
-        if (err > CPLErr::CE_Warning)
-            return QImage();
-
-        image = QImage(width, height, QImage::Format_RGB32);
-        for (auto y = 0; y < height; y++) {
-            QRgb* scanLine = reinterpret_cast<QRgb*>(image.scanLine(y));
-            for (auto x = 0; x < width; x++) {
-                int index = y * width + x;
-                uint8_t value = data[index];
-                scanLine[x] = qRgb(value, value, value);
-            }
-        }
-    } else {
-        // Unsupported band count
-        return QImage();
+void GeoTiffHandler::onStatisticsFinished(bool success)
+{
+    if (m_statisticsPending) {
+        m_statisticsPending = false;
+        m_statisticsEngine.start(m_currentFile, m_pendingApproximate);
+        return;
     }
+    if (!success || m_statisticsEngine.filePath() != m_currentFile)
+        return;
 
-    return image;
+    m_bandStatistics = m_statisticsEngine.result();
+    emit bandStatisticsChanged();
 }
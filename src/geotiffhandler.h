@@ -7,8 +7,12 @@
 #include <QImage>
 #include <QUrl>
 #include <QStringList>
+#include <QFutureWatcher>
+#include <QPromise>
 #include <gdal_priv.h>
 #include <gdal.h>
+#include "datasetpool.h"
+#include "statisticsengine.h"
 
 class GeoTiffHandler : public QObject
 {
@@ -27,6 +31,11 @@ class GeoTiffHandler : public QObject
     Q_PROPERTY(QString boundsMaxY READ boundsMaxY NOTIFY boundsChanged FINAL)
     Q_PROPERTY(QStringList bandsModel READ bandsModel NOTIFY bandsModelChanged FINAL)
     Q_PROPERTY(QString statusMessage READ statusMessage NOTIFY statusMessageChanged FINAL)
+    Q_PROPERTY(QVariantList bandStatistics READ bandStatistics NOTIFY bandStatisticsChanged FINAL)
+    Q_PROPERTY(bool computingStatistics READ computingStatistics NOTIFY computingStatisticsChanged FINAL)
+    Q_PROPERTY(qreal statisticsProgress READ statisticsProgress NOTIFY statisticsProgressChanged FINAL)
+    Q_PROPERTY(bool loadingMetadata READ loadingMetadata NOTIFY loadingMetadataChanged FINAL)
+    Q_PROPERTY(qreal metadataProgress READ metadataProgress NOTIFY metadataProgressChanged FINAL)
 
 public:
     explicit GeoTiffHandler(QObject *parent);
@@ -35,8 +44,13 @@ public:
     static GeoTiffHandler *create(QQmlEngine *, QJSEngine *engine);
     static GeoTiffHandler *instance();
 
-    QImage loadGeoTiffImage(const QUrl &fileUrl);
+    // Opens the file and reads its metadata on a worker thread, the properties are updated once it's
+    // done. Loading another file cancels the load still running for the previous one.
     Q_INVOKABLE void loadMetadata(const QUrl &fileUrl);
+    Q_INVOKABLE void cancelMetadata();
+    // Approximate statistics are computed automatically when a file is loaded, exact ones on request.
+    Q_INVOKABLE bool computeStatistics(bool approximate);
+    Q_INVOKABLE void cancelStatistics();
 
     inline QString currentFile() const { return m_currentFile; }
     inline QString fileName() const { return m_fileName; }
@@ -49,6 +63,11 @@ public:
     inline QString boundsMaxY() const { return m_boundsMaxY; }
     inline QStringList bandsModel() const { return m_bandsModel; }
     inline QString statusMessage() const { return m_statusMessage; }
+    QVariantList bandStatistics() const;
+    inline bool computingStatistics() const { return m_statisticsEngine.running(); }
+    inline qreal statisticsProgress() const { return m_statisticsEngine.progress(); }
+    inline bool loadingMetadata() const { return m_metadataWatcher.isRunning(); }
+    inline qreal metadataProgress() const { return m_metadataProgress; }
 
 signals:
     void currentFileChanged();
@@ -59,15 +78,36 @@ signals:
     void boundsChanged();
     void bandsModelChanged();
     void statusMessageChanged();
+    void bandStatisticsChanged();
+    void computingStatisticsChanged();
+    void statisticsProgressChanged();
+    void loadingMetadataChanged();
+    void metadataProgressChanged();
 
 private:
-    GDALDataset* openGeoTiff(const QUrl &fileUrl);
-    void closeDataset();
-    void extractMetadata();
-    QImage exportToQImage(GDALDatasetH dataset);
+    struct Metadata
+    {
+        QString dimensions;
+        QString coordinateSystem;
+        QString projection;
+        QString boundsMinX;
+        QString boundsMinY;
+        QString boundsMaxX;
+        QString boundsMaxY;
+        QStringList bandsModel;
+    };
+
+    static void readMetadata(QPromise<Metadata> &promise, const QString &filePath);
+    void applyMetadata(const Metadata &metadata);
+    void loadStatistics();
+
+private slots:
+    void onMetadataFinished();
+    void onStatisticsFinished(bool success);
 
 private:
-    GDALDataset *m_dataset = nullptr;
+    QFutureWatcher<Metadata> m_metadataWatcher;
+    qreal m_metadataProgress = 0;
     QString m_currentFile;
     QString m_fileName;
     QString m_dimensions;
@@ -79,6 +119,10 @@ private:
     QString m_boundsMaxY;
     QStringList m_bandsModel;
     QString m_statusMessage;
+    StatisticsEngine m_statisticsEngine;
+    QList<BandStatistics> m_bandStatistics;
+    bool m_statisticsPending = false;       // Start another run for m_currentFile once the engine is idle
+    bool m_pendingApproximate = true;
 
     inline static GeoTiffHandler * s_singletonInstance = nullptr;
     inline static QJSEngine *s_engine = nullptr;
@@ -1,15 +1,159 @@
 #include "geotiffimageprovider.h"
+#include "datasetpool.h"
+#include "memorybudget.h"
+#include "rasterreader.h"
+#include <QThread>
+#include <QRunnable>
+#include <QUrl>
+#include <QUrlQuery>
+#include <QDebug>
+#include <algorithm>
+#include <atomic>
+#include <climits>
+
+static constexpr int s_tileSize = 256;
+static constexpr int s_maxLevel = 22;
+
+namespace {
+
+class GeoTiffImageResponse : public QQuickImageResponse, public QRunnable
+{
+public:
+    GeoTiffImageResponse(const QString &id, const QSize &requestedSize)
+        : m_id(id)
+        , m_requestedSize(requestedSize)
+    {
+        // The pool must not delete the response, QML does once it received finished()
+        setAutoDelete(false);
+    }
+
+    ~GeoTiffImageResponse() override
+    {
+        MemoryBudget::instance()->release(m_image.sizeInBytes());
+    }
+
+    QQuickTextureFactory *textureFactory() const override
+    {
+        return QQuickTextureFactory::textureFactoryForImage(m_image);
+    }
+
+    QString errorString() const override { return m_error; }
+
+    void cancel() override { m_cancelled = true; }
+
+    void run() override
+    {
+        if (!m_cancelled)
+            decode();
+        emit finished();
+    }
+
+private:
+    void decode();
+
+    QString m_id;
+    QSize m_requestedSize;
+    QImage m_image;
+    QString m_error;
+    std::atomic<bool> m_cancelled = false;
+};
+
+// Parses "l,t,r,b" into a rectangle, returns an invalid one when malformed.
+QRect parseBox(const QString &value)
+{
+    QStringList parts = value.split(',');
+    if (parts.size() != 4)
+        return QRect();
+    int coords[4];
+    for (int i = 0; i < 4; ++i) {
+        bool ok = false;
+        coords[i] = parts[i].trimmed().toInt(&ok);
+        if (!ok)
+            return QRect();
+    }
+    return QRect(QPoint(coords[0], coords[1]), QPoint(coords[2] - 1, coords[3] - 1));
+}
+
+void GeoTiffImageResponse::decode()
+{
+    QUrl url(m_id);
+    QUrlQuery query(url);
+    // Remote sources keep their scheme and host so that RangeCache::gdalPath() recognises them
+    QString filePath = url.isLocalFile() ? url.toLocalFile() : url.adjusted(QUrl::RemoveQuery).toString();
+
+    DatasetPool::Handle dataset = DatasetPool::instance()->acquire(filePath);
+    if (!dataset) {
+        m_error = QString("Failed to open %1").arg(filePath);
+        return;
+    }
+    QRect rasterRect(0, 0, dataset->GetRasterXSize(), dataset->GetRasterYSize());
+
+    QRect window = rasterRect;
+    QSize outSize;
+    if (query.hasQueryItem("z")) {
+        // 256 << 22 is the largest power of two span that fits an int
+        int level = std::clamp(query.queryItemValue("z").toInt(), 0, s_maxLevel);
+        int span = s_tileSize << level;
+        int factor = 1 << level;
+        qint64 left = qint64(query.queryItemValue("x").toInt()) * span;
+        qint64 top = qint64(query.queryItemValue("y").toInt()) * span;
+        if (left < 0 || top < 0 || left >= rasterRect.width() || top >= rasterRect.height()) {
+            m_error = QString("Requested tile of %1 is outside the raster").arg(filePath);
+            return;
+        }
+        window = QRect(int(left), int(top), int(qMin<qint64>(span, rasterRect.width() - left)),
+                       int(qMin<qint64>(span, rasterRect.height() - top)));
+        outSize = QSize((window.width() + factor - 1) / factor, (window.height() + factor - 1) / factor);
+    } else if (query.hasQueryItem("bbox")) {
+        window = parseBox(query.queryItemValue("bbox")).intersected(rasterRect);
+    }
+    if (window.isEmpty()) {
+        m_error = QString("Requested window of %1 is outside the raster").arg(filePath);
+        return;
+    }
+
+    int width = query.queryItemValue("w").toInt();
+    int height = query.queryItemValue("h").toInt();
+    if (width > 0 || height > 0) {
+        outSize = QSize(width > 0 ? width : qMax(1, qRound(double(height) * window.width() / window.height())),
+                        height > 0 ? height : qMax(1, qRound(double(width) * window.height() / window.width())));
+    } else if (outSize.isEmpty()) {
+        outSize = window.size();
+    }
+    if (m_requestedSize.width() > 0 || m_requestedSize.height() > 0) {
+        QSize bound(m_requestedSize.width() > 0 ? m_requestedSize.width() : INT_MAX,
+                    m_requestedSize.height() > 0 ? m_requestedSize.height() : INT_MAX);
+        outSize = window.size().scaled(bound, Qt::KeepAspectRatio).expandedTo(QSize(1, 1));
+    }
+
+    if (m_cancelled)
+        return;
+    int overviewLevel = RasterReader::selectOverview(dataset.get(), window, outSize);
+    m_image = RasterReader::read(dataset.get(), window, outSize, overviewLevel, GRIORA_Average);
+    if (m_image.isNull())
+        m_error = QString("Failed to read %1").arg(filePath);
+    else
+        MemoryBudget::instance()->charge(m_image.sizeInBytes());
+}
+
+} // namespace
 
 GeoTiffImageProvider::GeoTiffImageProvider()
-    : QQuickImageProvider(QQuickImageProvider::Image)
 {
-    m_geoTiffHandler = GeoTiffHandler::instance();
+    // Every worker thread keeps its own dataset handles in the DatasetPool, so the pool is kept small
+    m_pool.setMaxThreadCount(qBound(1, QThread::idealThreadCount() / 2, 4));
+}
+
+GeoTiffImageProvider::~GeoTiffImageProvider()
+{
+    m_pool.clear();
+    m_pool.waitForDone();
 }
 
-QImage GeoTiffImageProvider::requestImage(const QString &id, QSize *size, const QSize &requestedSize)
+QQuickImageResponse *GeoTiffImageProvider::requestImageResponse(const QString &id, const QSize &requestedSize)
 {
-    qDebug() << "Tiff image" << id << "requested";
-    QImage image = m_geoTiffHandler->loadGeoTiffImage(id);
-    *size = image.size();
-    return requestedSize.isValid() ? image.copy(QRect(QPoint(0,0), requestedSize)) : image;
+    qDebug() << "Tiff image" << id << "requested at" << requestedSize;
+    GeoTiffImageResponse *response = new GeoTiffImageResponse(id, requestedSize);
+    m_pool.start(response);
+    return response;
 }
@@ -1,20 +1,31 @@
 #ifndef GEOTIFFIMAGEPROVIDER_H
 #define GEOTIFFIMAGEPROVIDER_H
 
-#include <QQuickImageProvider>
-#include "geotiffhandler.h"
+#include <QQuickAsyncImageProvider>
+#include <QThreadPool>
 
-class GeoTiffImageProvider : public QQuickImageProvider
+// Serves "image://geotiff/<file url>[?query]" from a pool of worker threads, decoding only the requested
+// window of the raster at the requested size. The query selects the window and output size:
+//
+//   z=<level>&x=<column>&y=<row>       Tile of the same pyramid GeoTiffQuickItem uses: it spans 256 << z
+//                                      raster pixels and is decoded at 1/2^z of full resolution.
+//   bbox=<left>,<top>,<right>,<bottom> Window in raster pixels, by default the whole raster.
+//   w=<width>&h=<height>               Output size. Either may be left out to keep the aspect ratio.
+//
+// A sourceSize set on the Image (requestedSize) overrides the output size and is fitted to the window's
+// aspect ratio, so thumbnails are scaled rather than cropped.
+class GeoTiffImageProvider : public QQuickAsyncImageProvider
 {
 public:
     GeoTiffImageProvider();
+    ~GeoTiffImageProvider();
 
-    // QQuickImageProvider interface
+    // QQuickAsyncImageProvider interface
 public:
-    QImage requestImage(const QString &id, QSize *size, const QSize &requestedSize);
+    QQuickImageResponse *requestImageResponse(const QString &id, const QSize &requestedSize) override;
 
 private:
-    GeoTiffHandler *m_geoTiffHandler;
+    QThreadPool m_pool;
 };
 
 #endif // GEOTIFFIMAGEPROVIDER_H
@@ -0,0 +1,343 @@
+#include "geotiffmosaicitem.h"
+#include "geotiffquickitem.h"
+#include "catalog.h"
+#include <QtConcurrent>
+#include <QGeoRectangle>
+#include <QDebug>
+#include <algorithm>
+#include <cmath>
+#include <gdal_priv.h>
+
+#include <6.9.0/QtLocation/private/qdeclarativegeomap_p.h>
+
+static constexpr int s_defaultIdleTimeout = 10000;
+static constexpr int s_idleCheckInterval = 1000;
+static constexpr int s_defaultMaxOpenSheets = 64;
+// Sheets smaller than this many pixels across on screen are left out when zoomed out.
+static constexpr double s_minSheetPixels = 4;
+
+GeoTiffMosaicItem::GeoTiffMosaicItem(QQuickItem *parent)
+    : QQuickItem(parent)
+    , m_idleTimeout(s_defaultIdleTimeout)
+    , m_maxOpenSheets(s_defaultMaxOpenSheets)
+{
+    GDALAllRegister();
+
+    connect(&m_indexWatcher, &QFutureWatcher<Sheet>::finished, this, &GeoTiffMosaicItem::onIndexingFinished);
+    connect(&m_catalogWatcher, &QFutureWatcher<bool>::finished, this, &GeoTiffMosaicItem::onCatalogUpdated);
+
+    m_idleTimer.setInterval(s_idleCheckInterval);
+    connect(&m_idleTimer, &QTimer::timeout, this, &GeoTiffMosaicItem::closeIdleSheets);
+}
+
+GeoTiffMosaicItem::~GeoTiffMosaicItem()
+{
+    m_indexWatcher.cancel();
+    m_cancelCatalogUpdate = true;
+    m_indexWatcher.waitForFinished();
+    m_catalogWatcher.waitForFinished();
+    // The sheets, including closed ones awaiting deleteLater(), decode on m_decodePool and must go first
+    qDeleteAll(findChildren<GeoTiffQuickItem *>(Qt::FindDirectChildrenOnly));
+}
+
+void GeoTiffMosaicItem::setDirectory(const QString &directory)
+{
+    if (m_directory == directory)
+        return;
+
+    m_directory = directory;
+    emit directoryChanged();
+
+    stopIndexing();
+    resetSheets();
+    if (directory.isEmpty())
+        return;
+
+    // Show what the catalog of the previous run knows right away, then bring it up to date
+    loadCatalog();
+    m_cancelCatalogUpdate = false;
+    m_catalogWatcher.setFuture(QtConcurrent::run([directory, this]() {
+        return Catalog::update(directory, &m_cancelCatalogUpdate);
+    }));
+    emit indexingChanged();
+}
+
+void GeoTiffMosaicItem::setSources(const QStringList &sources)
+{
+    if (m_sources == sources)
+        return;
+
+    // An explicit list of files replaces the directory
+    if (!m_directory.isEmpty()) {
+        m_directory.clear();
+        emit directoryChanged();
+    }
+    m_sources = sources;
+    emit sourcesChanged();
+
+    stopIndexing();
+    resetSheets();
+    if (m_sources.isEmpty())
+        return;
+
+    // Every sheet is opened just long enough to read its georeferencing, in parallel
+    m_indexWatcher.setFuture(QtConcurrent::mapped(m_sources, [](const QString &filePath) {
+        return Sheet { filePath, Catalog::scanFile(filePath).footprint };
+    }));
+    emit indexingChanged();
+}
+
+void GeoTiffMosaicItem::setIdleTimeout(int timeout)
+{
+    if (m_idleTimeout == timeout)
+        return;
+
+    m_idleTimeout = timeout;
+    emit idleTimeoutChanged();
+    closeIdleSheets();
+}
+
+void GeoTiffMosaicItem::setMaxOpenSheets(int maxOpenSheets)
+{
+    if (m_maxOpenSheets == maxOpenSheets)
+        return;
+
+    m_maxOpenSheets = maxOpenSheets;
+    emit maxOpenSheetsChanged();
+    updateVisibleSheets();
+}
+
+void GeoTiffMosaicItem::componentComplete()
+{
+    QQuickItem::componentComplete();
+    attachToMap();
+}
+
+void GeoTiffMosaicItem::itemChange(ItemChange change, const ItemChangeData &value)
+{
+    QQuickItem::itemChange(change, value);
+    if (change == ItemParentHasChanged)
+        attachToMap();
+    else if (change == ItemVisibleHasChanged)
+        updateVisibleSheets();
+}
+
+void GeoTiffMosaicItem::attachToMap()
+{
+    m_map = GeoTiffQuickItem::findMap(this);
+    if (!m_map)
+        return;
+
+    connect(m_map, &QDeclarativeGeoMap::visibleRegionChanged, this, &GeoTiffMosaicItem::updateVisibleSheets, Qt::UniqueConnection);
+    connect(m_map, &QQuickItem::widthChanged, this, &GeoTiffMosaicItem::updateVisibleSheets, Qt::UniqueConnection);
+    connect(m_map, &QQuickItem::heightChanged, this, &GeoTiffMosaicItem::updateVisibleSheets, Qt::UniqueConnection);
+    updateVisibleSheets();
+}
+
+void GeoTiffMosaicItem::stopIndexing()
+{
+    m_indexWatcher.cancel();
+    m_cancelCatalogUpdate = true;
+    m_indexWatcher.waitForFinished();
+    m_catalogWatcher.waitForFinished();
+}
+
+void GeoTiffMosaicItem::resetSheets()
+{
+    for (const OpenSheet &sheet : std::as_const(m_openSheets)) {
+        sheet.item->setParentItem(nullptr);
+        sheet.item->deleteLater();
+    }
+    m_openSheets.clear();
+    m_sheets.clear();
+    m_index.clear();
+    m_idleTimer.stop();
+    emit openSheetCountChanged();
+    emit sheetCountChanged();
+}
+
+void GeoTiffMosaicItem::setSheets(const QList<Sheet> &sheets)
+{
+    QList<QRectF> footprints;
+    for (const Sheet &sheet : sheets) {
+        if (sheet.footprint.isValid()) {
+            m_sheets.append(sheet);
+            footprints.append(sheet.footprint);
+        }
+    }
+    m_index.build(footprints);
+    emit sheetCountChanged();
+
+    updateVisibleSheets();
+}
+
+void GeoTiffMosaicItem::loadCatalog()
+{
+    // Memory mapped, so this only touches the index file and none of the sheets
+    Catalog catalog;
+    if (!catalog.open(m_directory))
+        return;
+
+    QStringList sources;
+    QList<Sheet> sheets;
+    for (int i = 0; i < catalog.count(); ++i) {
+        sources.append(catalog.filePath(i));
+        sheets.append(Sheet { sources.last(), catalog.footprint(i) });
+    }
+    if (m_sources != sources) {
+        m_sources = sources;
+        emit sourcesChanged();
+    }
+    setSheets(sheets);
+    qDebug() << "Loaded" << m_sheets.size() << "mosaic sheets from the catalog of" << m_directory;
+}
+
+void GeoTiffMosaicItem::onCatalogUpdated()
+{
+    emit indexingChanged();
+    if (m_cancelCatalogUpdate || !m_catalogWatcher.result())
+        return;
+
+    // Files were added, removed or changed since the catalog was written
+    resetSheets();
+    loadCatalog();
+}
+
+void GeoTiffMosaicItem::onIndexingFinished()
+{
+    emit indexingChanged();
+    if (m_indexWatcher.isCanceled())
+        return;
+
+    setSheets(m_indexWatcher.future().results());
+    qDebug() << "Indexed" << m_sheets.size() << "of" << m_sources.size() << "mosaic sheets";
+}
+
+void GeoTiffMosaicItem::updateVisibleSheets()
+{
+    if (!m_map || m_index.size() == 0)
+        return;
+
+    // Cover the map, so that the sheets can position themselves in map coordinates
+    setPosition(QPointF(0, 0));
+    setSize(QSizeF(m_map->width(), m_map->height()));
+
+    QList<int> wanted;
+    if (isVisible() && m_map->width() > 0 && m_map->height() > 0) {
+        QGeoShape region = m_map->property("visibleRegion").value<QGeoShape>();
+        QGeoRectangle bounds = region.boundingGeoRectangle();
+        // A view across the antimeridian has its west edge east of its east edge. Its width is counted
+        // across the antimeridian and the index, which only knows -180 to 180, is queried for both sides.
+        double west = bounds.topLeft().longitude();
+        double east = bounds.bottomRight().longitude();
+        double south = bounds.bottomRight().latitude();
+        double north = bounds.topLeft().latitude();
+        double viewWidth = east >= west ? east - west : east - west + 360;
+        QRectF view(west, south, viewWidth, north - south);
+        if (east >= west) {
+            wanted = m_index.query(view);
+        } else {
+            wanted = m_index.query(QRectF(QPointF(west, south), QPointF(180, north)));
+            QSet<int> western(wanted.cbegin(), wanted.cend());
+            for (int sheet : m_index.query(QRectF(QPointF(-180, south), QPointF(east, north)))) {
+                if (!western.contains(sheet))
+                    wanted.append(sheet);
+            }
+        }
+
+        // Zoomed out, sheets that would only cover a few pixels aren't worth opening
+        double xScale = m_map->width() / view.width();
+        double yScale = m_map->height() / view.height();
+        wanted.removeIf([&](int sheet) {
+            const QRectF &footprint = m_sheets[sheet].footprint;
+            return std::max(footprint.width() * xScale, footprint.height() * yScale) < s_minSheetPixels;
+        });
+
+        // Beyond maxOpenSheets, those nearest to the centre of the view are shown
+        if (wanted.size() > m_maxOpenSheets) {
+            QPointF centre = view.center();
+            auto distance = [&](int sheet) {
+                QPointF offset = m_sheets[sheet].footprint.center() - centre;
+                offset.setX(std::remainder(offset.x(), 360.0));
+                return QPointF::dotProduct(offset, offset);
+            };
+            std::partial_sort(wanted.begin(), wanted.begin() + m_maxOpenSheets, wanted.end(),
+                              [&](int a, int b) { return distance(a) < distance(b); });
+            wanted.resize(m_maxOpenSheets);
+        }
+    }
+
+    // Sheets that left the view are hidden first and only closed in closeIdleSheets(), so panning
+    // back and forth doesn't reopen them every time.
+    QSet<int> wantedSet(wanted.cbegin(), wanted.cend());
+    for (auto it = m_openSheets.begin(); it != m_openSheets.end(); ++it) {
+        if (!wantedSet.contains(it.key()) && !it->hiddenFor.isValid()) {
+            it->item->setVisible(false);
+            it->hiddenFor.start();
+            m_idleTimer.start();
+        }
+    }
+
+    bool opened = false;
+    for (int sheet : std::as_const(wanted)) {
+        auto it = m_openSheets.find(sheet);
+        if (it == m_openSheets.end()) {
+            // Sheets that are out of view make room first
+            if (m_openSheets.size() >= m_maxOpenSheets && !closeOldestHiddenSheet())
+                break;
+            GeoTiffQuickItem *item = new GeoTiffQuickItem(this);
+            item->setDecodePool(&m_decodePool);
+            item->setSource(m_sheets[sheet].filePath);
+            m_openSheets.insert(sheet, OpenSheet { item, QElapsedTimer() });
+            opened = true;
+        } else if (it->hiddenFor.isValid()) {
+            it->hiddenFor.invalidate();
+            it->item->setVisible(true);
+        }
+    }
+
+    if (opened)
+        emit openSheetCountChanged();
+}
+
+void GeoTiffMosaicItem::closeIdleSheets()
+{
+    bool closed = false;
+    bool anyHidden = false;
+    for (auto it = m_openSheets.begin(); it != m_openSheets.end();) {
+        if (it->hiddenFor.isValid() && it->hiddenFor.hasExpired(m_idleTimeout)) {
+            it = closeSheet(it);
+            closed = true;
+        } else {
+            anyHidden = anyHidden || it->hiddenFor.isValid();
+            ++it;
+        }
+    }
+
+    if (!anyHidden)
+        m_idleTimer.stop();
+    if (closed)
+        emit openSheetCountChanged();
+}
+
+QHash<int, GeoTiffMosaicItem::OpenSheet>::iterator GeoTiffMosaicItem::closeSheet(QHash<int, OpenSheet>::iterator it)
+{
+    // Deleting the item closes its dataset and drops its tile cache
+    it->item->setParentItem(nullptr);
+    it->item->deleteLater();
+    return m_openSheets.erase(it);
+}
+
+bool GeoTiffMosaicItem::closeOldestHiddenSheet()
+{
+    auto oldest = m_openSheets.end();
+    for (auto it = m_openSheets.begin(); it != m_openSheets.end(); ++it) {
+        if (it->hiddenFor.isValid() && (oldest == m_openSheets.end() || it->hiddenFor.elapsed() > oldest->hiddenFor.elapsed()))
+            oldest = it;
+    }
+    if (oldest == m_openSheets.end())
+        return false;
+    closeSheet(oldest);
+    emit openSheetCountChanged();
+    return true;
+}
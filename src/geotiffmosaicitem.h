@@ -0,0 +1,114 @@
+#ifndef GEOTIFFMOSAICITEM_H
+#define GEOTIFFMOSAICITEM_H
+
+#include <QQmlEngine>
+#include <QQuickItem>
+#include <QFutureWatcher>
+#include <QElapsedTimer>
+#include <QTimer>
+#include <QThreadPool>
+#include <atomic>
+#include "footprintindex.h"
+
+class QDeclarativeGeoMap;
+class GeoTiffQuickItem;
+
+// Shows a set of adjacent GeoTIFF sheets, given as a directory tree or a list of files, as one layer of
+// a Qt Location Map. The WGS84 footprint of every sheet is kept in an R-tree. For a directory the
+// footprints come from its Catalog, which is brought up to date in the background; for a list of
+// files they are read once, in parallel on worker threads. Only the sheets whose footprint intersects
+// the visible region of the map, and covers more than a few pixels of it, get a GeoTiffQuickItem (and
+// with it an open dataset and tile cache), at most maxOpenSheets of them, nearest to the centre first.
+// The items open their files on worker threads and all decode on one shared thread pool. Sheets that
+// leave the view are hidden and closed once they have been out of view for idleTimeout ms, or sooner
+// to make room for new ones, so panning across hundreds of sheets costs about the same as looking at
+// the handful on screen.
+class GeoTiffMosaicItem : public QQuickItem
+{
+    Q_OBJECT
+    QML_ELEMENT
+    Q_PROPERTY(QString directory READ directory WRITE setDirectory NOTIFY directoryChanged)
+    Q_PROPERTY(QStringList sources READ sources WRITE setSources NOTIFY sourcesChanged)
+    Q_PROPERTY(bool indexing READ indexing NOTIFY indexingChanged)
+    Q_PROPERTY(int sheetCount READ sheetCount NOTIFY sheetCountChanged)
+    Q_PROPERTY(int openSheetCount READ openSheetCount NOTIFY openSheetCountChanged)
+    Q_PROPERTY(int idleTimeout READ idleTimeout WRITE setIdleTimeout NOTIFY idleTimeoutChanged)
+    Q_PROPERTY(int maxOpenSheets READ maxOpenSheets WRITE setMaxOpenSheets NOTIFY maxOpenSheetsChanged)
+
+public:
+    GeoTiffMosaicItem(QQuickItem *parent = nullptr);
+    ~GeoTiffMosaicItem();
+
+    // Setting a directory replaces sources with the GeoTIFF files found in it and its subdirectories.
+    inline QString directory() const { return m_directory; }
+    void setDirectory(const QString &directory);
+
+    inline QStringList sources() const { return m_sources; }
+    void setSources(const QStringList &sources);
+
+    inline bool indexing() const { return m_indexWatcher.isRunning() || m_catalogWatcher.isRunning(); }
+    inline int sheetCount() const { return m_sheets.size(); }
+    inline int openSheetCount() const { return m_openSheets.size(); }
+
+    inline int idleTimeout() const { return m_idleTimeout; }
+    void setIdleTimeout(int timeout);
+
+    inline int maxOpenSheets() const { return m_maxOpenSheets; }
+    void setMaxOpenSheets(int maxOpenSheets);
+
+signals:
+    void directoryChanged();
+    void sourcesChanged();
+    void indexingChanged();
+    void sheetCountChanged();
+    void openSheetCountChanged();
+    void idleTimeoutChanged();
+    void maxOpenSheetsChanged();
+
+protected:
+    void componentComplete() override;
+    void itemChange(ItemChange change, const ItemChangeData &value) override;
+
+private:
+    struct Sheet
+    {
+        QString filePath;
+        QRectF footprint;   // WGS84 bounds, x longitude and y latitude
+    };
+    struct OpenSheet
+    {
+        GeoTiffQuickItem *item = nullptr;
+        QElapsedTimer hiddenFor;    // Invalid while the sheet is in view
+    };
+
+    void attachToMap();
+    void stopIndexing();
+    void resetSheets();
+    void setSheets(const QList<Sheet> &sheets);
+    void loadCatalog();
+    QHash<int, OpenSheet>::iterator closeSheet(QHash<int, OpenSheet>::iterator it);
+    bool closeOldestHiddenSheet();
+
+private slots:
+    void onIndexingFinished();
+    void onCatalogUpdated();
+    void updateVisibleSheets();
+    void closeIdleSheets();
+
+private:
+    QDeclarativeGeoMap *m_map = nullptr;
+    QString m_directory;
+    QStringList m_sources;
+    QList<Sheet> m_sheets;
+    FootprintIndex m_index;
+    QFutureWatcher<Sheet> m_indexWatcher;
+    QFutureWatcher<bool> m_catalogWatcher;
+    std::atomic<bool> m_cancelCatalogUpdate = false;
+    QHash<int, OpenSheet> m_openSheets;     // Keyed by index into m_sheets
+    int m_idleTimeout;
+    int m_maxOpenSheets;
+    QTimer m_idleTimer;
+    QThreadPool m_decodePool;               // Shared by the tile decoders of all sheets
+};
+
+#endif // GEOTIFFMOSAICITEM_H
@@ -1,136 +1,456 @@
 #include "geotiffquickitem.h"
-#include <QPainter>
+#include "rasterreader.h"
+#include "geotiffhandler.h"
+#include "datasetpool.h"
+#include "perfcounters.h"
+#include "memorybudget.h"
+#include "rangecache.h"
+#include <QQuickWindow>
+#include <QtConcurrent>
 #include <QSGTransformNode>
 #include <QSGSimpleTextureNode>
+#include <QMatrix4x4>
 #include <QGeoRectangle>
 #include <QGeoPolygon>
+#include <algorithm>
+#include <cmath>
+#include <limits>
 
 #include <QImageWriter>
 
 #include <6.9.0/QtLocation/private/qdeclarativegeomap_p.h>
 
-GeoTiffQuickItem::GeoTiffQuickItem(QQuickItem *parent) : QQuickItem(parent)
+// Upper bound for the decoded tiles kept around per item.
+static constexpr qint64 s_tileCacheBytes = 256 * 1024 * 1024;
+static constexpr int s_defaultRefineDelay = 150;
+// Most tiles across or down decoded by one read, bounds the size of a batch with strips or huge blocks.
+static constexpr int s_maxBatchTiles = 8;
+// Tiles are prefetched where the pan velocity puts the view this many ms from now, below all visible ones.
+static constexpr int s_prefetchLookahead = 400;
+static constexpr int s_prefetchPriority = -100000;
+// Updates further apart than this (in ms) don't count as one pan gesture.
+static constexpr int s_panIdleTime = 300;
+
+GeoTiffQuickItem::GeoTiffQuickItem(QQuickItem *parent)
+    : QQuickItem(parent)
+    , m_tileCache(s_tileCacheBytes)
 {
     // Register GDAL drivers
     GDALAllRegister();
+
+    connect(&m_overviewBuilder, &OverviewBuilder::runningChanged, this, &GeoTiffQuickItem::buildingOverviewsChanged);
+    connect(&m_overviewBuilder, &OverviewBuilder::progressChanged, this, &GeoTiffQuickItem::overviewBuildProgressChanged);
+    connect(&m_overviewBuilder, &OverviewBuilder::finished, this, &GeoTiffQuickItem::onOverviewBuildFinished);
+    connect(&m_tileDecoder, &TileDecoder::tileDecoded, this, &GeoTiffQuickItem::onTileDecoded);
+    connect(&m_placementWatcher, &QFutureWatcher<Placement>::finished, this, &GeoTiffQuickItem::onPlacementFinished);
+    connect(GeoTiffHandler::instance(), &GeoTiffHandler::bandStatisticsChanged, this, &GeoTiffQuickItem::onBandStatisticsChanged);
+
+    m_refineTimer.setSingleShot(true);
+    m_refineTimer.setInterval(s_defaultRefineDelay);
+    connect(&m_refineTimer, &QTimer::timeout, this, &GeoTiffQuickItem::refine);
+    connect(this, &QQuickItem::visibleChanged, this, &GeoTiffQuickItem::updateTransform);
 }
 
 GeoTiffQuickItem::~GeoTiffQuickItem()
 {}
 
+QDeclarativeGeoMap *GeoTiffQuickItem::findMap(QQuickItem *item)
+{
+    // Either directly in the Map, or in an item that fills it, such as a GeoTiffMosaicItem
+    for (QQuickItem *parent = item->parentItem(); parent; parent = parent->parentItem()) {
+        if (QDeclarativeGeoMap *map = qobject_cast<QDeclarativeGeoMap *>(parent))
+            return map;
+    }
+    return nullptr;
+}
+
 void GeoTiffQuickItem::setSource(const QString &source)
 {
-    QQuickItem *p = parentItem();
-    m_map = qobject_cast<QDeclarativeGeoMap *>(p);
+    m_map = findMap(this);
     if (m_map == nullptr)
-        qWarning() << "Parent of GeoTiffQuickItem must be a Qt Location `Map` item.";
+        qWarning() << "GeoTiffQuickItem must be placed inside a Qt Location `Map` item.";
     else {
         // Enable item to receive paint events if there is a map parent.
         setFlag(QQuickItem::ItemHasContents, true);
 
-        connect(m_map, &QDeclarativeGeoMap::visibleRegionChanged, this, &GeoTiffQuickItem::updateTransform);
-        connect(m_map, &QDeclarativeGeoMap::zoomLevelChanged, this, [this](){
-            m_dirty = true;
-            updateTransform();
-        });
+        connect(m_map, &QDeclarativeGeoMap::visibleRegionChanged, this, &GeoTiffQuickItem::updateTransform, Qt::UniqueConnection);
+        connect(m_map, &QDeclarativeGeoMap::zoomLevelChanged, this, &GeoTiffQuickItem::updateTransform, Qt::UniqueConnection);
+        connect(m_map, &QDeclarativeGeoMap::bearingChanged, this, &GeoTiffQuickItem::updateTransform, Qt::UniqueConnection);
+        connect(m_map, &QDeclarativeGeoMap::tiltChanged, this, &GeoTiffQuickItem::updateTransform, Qt::UniqueConnection);
     }
 
     if (m_map && m_source != source) {
         m_source = source;
-        m_dirty = true;
         loadSource();
         emit sourceChanged();
         update();
     }
 }
 
-QSGNode *GeoTiffQuickItem::updatePaintNode(QSGNode *oldNode, UpdatePaintNodeData *data)
+void GeoTiffQuickItem::setResampling(Resampling resampling)
 {
-    if (!m_map || !m_dataset || m_geoTransform.empty() || m_transformedImage.isNull())
-        return nullptr;
+    if (m_resampling == resampling)
+        return;
 
-    // Cast the oldNode to a QSGTransformNode, or create a new one if it doesn't exist
-    QSGTransformNode* rootNode = static_cast<QSGTransformNode*>(oldNode);
+    m_resampling = resampling;
+    resetTiles();
+    emit resamplingChanged();
+    updateTransform();
+}
 
-    if (!rootNode) {
-        rootNode = new QSGTransformNode();
+void GeoTiffQuickItem::setContrastStretch(ContrastStretch contrastStretch)
+{
+    if (m_contrastStretch == contrastStretch)
+        return;
+
+    m_contrastStretch = contrastStretch;
+    resetTiles();
+    emit contrastStretchChanged();
+    updateTransform();
+}
+
+void GeoTiffQuickItem::setRefineDelay(int delay)
+{
+    if (m_refineTimer.interval() == delay)
+        return;
+
+    m_refineTimer.setInterval(delay);
+    emit refineDelayChanged();
+}
+
+int GeoTiffQuickItem::overviewCount() const
+{
+    if (!m_dataset || m_dataset->GetRasterCount() == 0)
+        return 0;
+    return m_dataset->GetRasterBand(1)->GetOverviewCount();
+}
+
+void GeoTiffQuickItem::setAutoBuildOverviews(bool autoBuild)
+{
+    if (m_autoBuildOverviews == autoBuild)
+        return;
+
+    m_autoBuildOverviews = autoBuild;
+    emit autoBuildOverviewsChanged();
+    maybeAutoBuildOverviews();
+}
+
+void GeoTiffQuickItem::maybeAutoBuildOverviews()
+{
+    // Only try once per source, so a file that needs no levels (or can't get them) isn't rebuilt forever.
+    if (!m_autoBuildOverviews || !m_dataset || overviewCount() > 0 || m_overviewBuilder.filePath() == m_source)
+        return;
+
+    // A build still running for a previous source is cancelled; its finished handler comes back here.
+    if (m_overviewBuilder.running())
+        m_overviewBuilder.cancel();
+    else
+        buildOverviews();
+}
+
+bool GeoTiffQuickItem::buildOverviews()
+{
+    // There's nowhere to write the .ovr of a remote file, COGs carry their own overviews
+    if (!m_dataset || RangeCache::isRemote(m_source))
+        return false;
+    return m_overviewBuilder.start(m_source);
+}
+
+void GeoTiffQuickItem::cancelOverviewBuild()
+{
+    m_overviewBuilder.cancel();
+}
+
+void GeoTiffQuickItem::onOverviewBuildFinished(bool success)
+{
+    if (m_overviewBuilder.filePath() != m_source) {
+        // Finished (or was cancelled) for a previous source.
+        maybeAutoBuildOverviews();
+        return;
     }
 
-    // Find the texture node if it exists, otherwise create a new one
-    QSGSimpleTextureNode* textureNode = nullptr;
-    if (rootNode->childCount() > 0) {
-        textureNode = static_cast<QSGSimpleTextureNode*>(rootNode->firstChild());
-    } else {
-        textureNode = new QSGSimpleTextureNode();
-        rootNode->appendChildNode(textureNode);
+    // Reopen the dataset so that GDAL finds the new .ovr file.
+    if (success) {
+        m_dataset.reset();
+        DatasetPool::instance()->invalidate(m_source);
+        loadSource();
     }
+}
 
-    // Create or update the texture from our transformed image
-    QSGTexture* texture = window()->createTextureFromImage(
-        m_transformedImage,
-        QQuickWindow::TextureHasAlphaChannel
-        );
+static GDALRIOResampleAlg toGdalResampleAlg(GeoTiffQuickItem::Resampling resampling)
+{
+    switch (resampling) {
+    case GeoTiffQuickItem::Nearest:
+        return GRIORA_NearestNeighbour;
+    case GeoTiffQuickItem::Bilinear:
+        return GRIORA_Bilinear;
+    case GeoTiffQuickItem::Cubic:
+        return GRIORA_Cubic;
+    case GeoTiffQuickItem::CubicSpline:
+        return GRIORA_CubicSpline;
+    case GeoTiffQuickItem::Lanczos:
+        return GRIORA_Lanczos;
+    case GeoTiffQuickItem::Average:
+        return GRIORA_Average;
+    case GeoTiffQuickItem::Mode:
+        return GRIORA_Mode;
+    }
+    return GRIORA_NearestNeighbour;
+}
+
+void GeoTiffQuickItem::onBandStatisticsChanged()
+{
+    // Non-Byte tiles are contrast stretched with the cached statistics, so redecode them with the new ones.
+    if (!m_dataset || !RasterReader::needsStretch(m_dataset.get()) || GeoTiffHandler::instance()->currentFile() != m_source)
+        return;
+
+    resetTiles();
+    updateTransform();
+}
+
+void GeoTiffQuickItem::resetTiles()
+{
+    m_refineTimer.stop();
+    m_tileDecoder.reset(m_source, toGdalResampleAlg(m_resampling),
+                        m_contrastStretch == MinMaxStretch ? RasterReader::MinMaxStretch : RasterReader::PercentileStretch);
+    m_tileCache.clear();
+    m_tileLevel = -1;
+    m_wantedTiles.clear();
+    m_visibleTiles.clear();
+    m_resetTileNodes = true;
+}
 
-    if (!texture) {
-        qWarning() << "Failed to create texture from GeoTIFF image";
-        delete rootNode; // Clean up
+// Raster positions from 'from' to 'to' at which a tile is split: its own edges and every warp grid
+// line that crosses it.
+static QList<double> meshBreaks(double from, double to, int cells, int rasterSize)
+{
+    QList<double> breaks { from };
+    for (int i = int(std::floor(from * cells / rasterSize)) + 1; i < cells; ++i) {
+        double position = double(rasterSize) * i / cells;
+        if (position >= to)
+            break;
+        if (position > from)
+            breaks.append(position);
+    }
+    breaks.append(to);
+    return breaks;
+}
+
+// A tile placed in warp space. Every part of it that lies within one warp grid cell is drawn with the
+// projective transform that maps its corners onto the warped ones. Neighbouring parts share their
+// corners and the edges between them are straight, so they join without gaps. Unlike a custom
+// geometry mesh, this also renders with the software scene graph backend.
+class TileNode : public QSGNode
+{
+public:
+    TileNode(QSGTexture *texture, const QRect &rasterRect, const WarpGrid &grid)
+    {
+        QList<double> xs = meshBreaks(rasterRect.left(), rasterRect.left() + rasterRect.width(),
+                                      grid.columns(), grid.rasterSize().width());
+        QList<double> ys = meshBreaks(rasterRect.top(), rasterRect.top() + rasterRect.height(),
+                                      grid.rows(), grid.rasterSize().height());
+        QSizeF textureScale(texture->textureSize().width() / double(rasterRect.width()),
+                            texture->textureSize().height() / double(rasterRect.height()));
+
+        for (int row = 0; row + 1 < ys.size(); ++row) {
+            for (int column = 0; column + 1 < xs.size(); ++column) {
+                QRectF part(QPointF(xs[column], ys[row]), QPointF(xs[column + 1], ys[row + 1]));
+                QPolygonF rasterQuad({ part.topLeft(), part.topRight(), part.bottomRight(), part.bottomLeft() });
+                QPolygonF warpQuad;
+                for (const QPointF &corner : std::as_const(rasterQuad))
+                    warpQuad.append(grid.map(corner));
+                QTransform transform;
+                if (!QTransform::quadToQuad(rasterQuad, warpQuad, transform))
+                    continue;
+
+                QSGSimpleTextureNode *textureNode = new QSGSimpleTextureNode();
+                textureNode->setTexture(texture);
+                // All parts share the texture, the first one deletes it
+                textureNode->setOwnsTexture(childCount() == 0);
+                textureNode->setFiltering(QSGTexture::Linear);
+                textureNode->setRect(part);
+                textureNode->setSourceRect(QRectF((part.left() - rasterRect.left()) * textureScale.width(),
+                                                  (part.top() - rasterRect.top()) * textureScale.height(),
+                                                  part.width() * textureScale.width(),
+                                                  part.height() * textureScale.height()));
+
+                QSGTransformNode *transformNode = new QSGTransformNode();
+                transformNode->setMatrix(QMatrix4x4(transform));
+                transformNode->appendChildNode(textureNode);
+                appendChildNode(transformNode);
+            }
+        }
+        if (childCount() == 0)
+            delete texture;
+    }
+};
+
+QSGNode *GeoTiffQuickItem::updatePaintNode(QSGNode *oldNode, UpdatePaintNodeData *data)
+{
+    PerfCounters::Scope scope(PerfCounters::Frame);
+
+    // Cast the oldNode to a QSGTransformNode, or create a new one if it doesn't exist
+    QSGTransformNode* rootNode = static_cast<QSGTransformNode*>(oldNode);
+
+    if (!m_map || !m_dataset || !m_warpGrid.isValid() || m_visibleTiles.isEmpty()) {
+        delete rootNode; // Also deletes the tile nodes and their textures
+        m_tileNodes.clear();
+        m_resetTileNodes = false;
         return nullptr;
     }
 
-    // Set the texture on the node
-    textureNode->setTexture(texture);
-    textureNode->setOwnsTexture(true); // The node will take ownership of the texture
+    if (!rootNode) {
+        rootNode = new QSGTransformNode();
+        m_tileNodes.clear();
+    } else if (m_resetTileNodes) {
+        rootNode->removeAllChildNodes();
+        qDeleteAll(m_tileNodes);
+        m_tileNodes.clear();
+    }
+    m_resetTileNodes = false;
+
+    // Drop the nodes of tiles that went out of view
+    for (auto it = m_tileNodes.begin(); it != m_tileNodes.end();) {
+        if (!m_visibleTiles.contains(it.key())) {
+            delete it.value(); // Removes itself from rootNode
+            it = m_tileNodes.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    // Tiles are placed in warp space and the root transform maps that onto the map. While panning and
+    // zooming, that matrix is all that changes from frame to frame: the tiles already on screen are
+    // stretched to follow the map until sharper ones have been decoded.
+    rootNode->setMatrix(QMatrix4x4(m_warpToItem));
+
+    bool uploaded = false;
+    for (auto it = m_visibleTiles.cbegin(); it != m_visibleTiles.cend(); ++it) {
+        // Nothing to draw where the raster has no valid pixels, the map shows through
+        if (TileCache::isEmptyTile(it.value()))
+            continue;
+        TileNode* tileNode = m_tileNodes.value(it.key());
+        if (!tileNode) {
+            // Only tiles that just came into view are uploaded, the rest keep their texture
+            QImage image = it.value();
+            QSGTexture* texture = nullptr;
+            {
+                PerfCounters::Scope scope(PerfCounters::Upload);
+                // Paletted tiles are cached as Indexed8 and only expanded for their texture
+                if (image.format() == QImage::Format_Indexed8)
+                    image = RasterReader::expandPalette(image);
+                texture = window()->createTextureFromImage(
+                    image,
+                    image.hasAlphaChannel() ? QQuickWindow::TextureHasAlphaChannel : QQuickWindow::CreateTextureOptions()
+                    );
+            }
 
-    // Set the rect to cover the entire item
-    textureNode->setRect(0, 0, width(), height());
+            if (!texture) {
+                qWarning() << "Failed to create texture from GeoTIFF tile";
+                continue;
+            }
 
-    // Set texture filtering mode if needed
-    texture->setFiltering(QSGTexture::Linear);
+            tileNode = new TileNode(texture, tileRasterRect(it.key()), m_warpGrid);
+            // Tiles of the previous level are only placeholders, keep them underneath the current ones
+            if (it.key().level == m_tileLevel)
+                rootNode->appendChildNode(tileNode);
+            else
+                rootNode->prependChildNode(tileNode);
+            m_tileNodes.insert(it.key(), tileNode);
+            ++m_tileUploads;
+            uploaded = true;
+        }
+    }
 
-    // // Set blending mode for transparency handling
-    // textureNode->setBlending(QSGTexture::BlendTranslucent);
+    if (uploaded)
+        QMetaObject::invokeMethod(this, &GeoTiffQuickItem::tileStatsChanged, Qt::QueuedConnection);
 
     return rootNode;
 }
 
 void GeoTiffQuickItem::loadSource()
 {
-    // Close old dataset (on destruction) and Open GeoTIFF file
-    m_dataset.reset(static_cast<GDALDataset*>(GDALOpen(m_source.toUtf8().constData(), GA_ReadOnly)));
-    if (!m_dataset) {
-        qWarning() << "Failed to open GeoTIFF file:" << m_source;
-        return;
+    resetTiles();
+    m_dataset.reset();
+    m_geoTransform.clear();
+    m_warpGrid.clear();
+
+    // Opening the file, setting up its projection and building the warp grid happens on a worker, so a
+    // large header, a remote file or many mosaic sheets coming into view at once don't block the GUI.
+    m_placementWatcher.setFuture(QtConcurrent::run(&GeoTiffQuickItem::place, m_source));
+}
+
+GeoTiffQuickItem::Placement GeoTiffQuickItem::place(const QString &source)
+{
+    Placement placement { source, {}, {} };
+    DatasetPool::Handle dataset = DatasetPool::instance()->acquire(source);
+    if (!dataset) {
+        qWarning() << "Failed to open GeoTIFF file:" << source;
+        return placement;
     }
 
     // Get geotransform information
-    m_geoTransform.resize(6);
-    if (m_dataset->GetGeoTransform(m_geoTransform.data()) != CE_None) {
+    std::vector<double> geoTransform(6);
+    if (dataset->GetGeoTransform(geoTransform.data()) != CE_None) {
         qWarning() << "Failed to get geotransform from GeoTIFF";
-        m_dataset.reset();
-        return;
+        return placement;
     }
 
     // Get projection information
-    const char* projWkt = m_dataset->GetProjectionRef();
+    std::unique_ptr<OGRCoordinateTransformation> coordTransform;
+    const char* projWkt = dataset->GetProjectionRef();
     if (projWkt && strlen(projWkt) > 0) {
         OGRSpatialReference srcSRS;
         srcSRS.importFromWkt(projWkt);
+        srcSRS.SetAxisMappingStrategy(OAMS_TRADITIONAL_GIS_ORDER);
         qDebug() << "srcSRS:" << srcSRS.GetName() << (srcSRS.IsGeographic() ? "Geographic" : srcSRS.IsProjected() ? "Projected" : "");
 
-        // Create destination SRS (EPSG:3857 - WGS84/Pseudo-Mercator, which Qt Location uses)
+        // The warp grid goes through WGS84 longitude/latitude, which Qt Location takes coordinates in
         OGRSpatialReference dstSRS;
         dstSRS.importFromEPSG(4326);
-        qDebug() << "dstSRS:" << dstSRS.GetName() << (dstSRS.IsGeographic() ? "Geographic" : dstSRS.IsProjected() ? "Projected" : "");
+        dstSRS.SetAxisMappingStrategy(OAMS_TRADITIONAL_GIS_ORDER);
 
-        // Create transform between the two SRS
-        m_coordTransform.reset(OGRCreateCoordinateTransformation(&srcSRS, &dstSRS));
-        if (!m_coordTransform) {
-            qWarning() << "Failed to create coordinate transformation";
+        // Fast path: rasters in WGS84 longitude/latitude need no transformation at all
+        if (!(srcSRS.IsGeographic() && srcSRS.IsSame(&dstSRS))) {
+            coordTransform.reset(OGRCreateCoordinateTransformation(&srcSRS, &dstSRS));
+            if (!coordTransform) {
+                qWarning() << "Failed to create coordinate transformation";
+            }
         }
     } else {
         qWarning() << "GeoTIFF has no projection information";
     }
 
+    QSize rasterSize(dataset->GetRasterXSize(), dataset->GetRasterYSize());
+    if (!placement.warpGrid.build(geoTransform.data(), rasterSize, coordTransform.get())) {
+        qWarning() << "Failed to place GeoTIFF on the map:" << source;
+        return placement;
+    }
+    qDebug() << "Warp grid:" << placement.warpGrid.columns() << "x" << placement.warpGrid.rows() << "cells";
+    placement.geoTransform = geoTransform;
+    return placement;
+}
+
+void GeoTiffQuickItem::onPlacementFinished()
+{
+    // Results for a source that has been replaced since are dropped
+    Placement placement = m_placementWatcher.result();
+    if (placement.source != m_source || placement.geoTransform.empty())
+        return;
+
+    // The GUI thread's own handle, shared with GeoTiffHandler when both show the same file. The header
+    // was just read by the worker, so this open comes from the page (or range) cache.
+    m_dataset = DatasetPool::instance()->acquire(m_source);
+    if (!m_dataset) {
+        qWarning() << "Failed to open GeoTIFF file:" << m_source;
+        return;
+    }
+    m_geoTransform = placement.geoTransform;
+    m_warpGrid = placement.warpGrid;
+
+    emit overviewCountChanged();
+    maybeAutoBuildOverviews();
+
     updateTransform();
 }
 
@@ -154,35 +474,11 @@ QString geoRectToDMSString(const QGeoRectangle &gRect) {
     return str;
 }
 
-void reportCplErrWarning(CPLErr errType, const QString& msg)
-{
-    QString errTypeStr;
-    switch(errType) {
-    case CPLErr::CE_Debug:
-        errTypeStr = "debug";
-        break;
-    case CPLErr::CE_Failure:
-        errTypeStr = "failure";
-        break;
-    case CPLErr::CE_Fatal:
-        errTypeStr = "fatal";
-        break;
-    case CPLErr::CE_Warning:
-        errTypeStr = "warning";
-        break;
-    case CPLErr::CE_None:
-        errTypeStr = "none";
-        break;
-    default:
-        errTypeStr = "unknown";
-    }
-    qWarning() << msg << errTypeStr << ": " << CPLGetLastErrorMsg();
-}
-
 void GeoTiffQuickItem::updateTransform()
 {
     if (!m_map || !m_dataset || m_geoTransform.empty())
         return;
+    PerfCounters::Scope scope(PerfCounters::VisibleUpdate);
 
     double mapWidth = m_map->width();
     double mapHeight = m_map->height();
@@ -218,177 +514,330 @@ void GeoTiffQuickItem::updateTransform()
         bottomRight = boundingGRect.bottomRight();
     }
 
-    // Calculate the bounds of our GeoTIFF in lat/lon coordinates
-    double minX = m_geoTransform[0];
-    double maxY = m_geoTransform[3];
-    double maxX = minX + m_geoTransform[1] * m_dataset->GetRasterXSize();
-    double minY = maxY + m_geoTransform[5] * m_dataset->GetRasterYSize();
-
-    // Transform these coordinates if needed
-    if (m_coordTransform) {
-        double pointsX1[] = {
-            minX, maxX,
-            maxX, minX,
-        };
-        double pointsX[] = {
-            minX, maxX,
-            maxX, minX,
-        };
-        double pointsY1[] = {
-            minY, minY,
-            maxY, maxY
-        };
-        double pointsY[] = {
-            minY, minY,
-            maxY, maxY
-        };
-
-        // Transform all corners. For the austro-hungarian empire geotiffs, this results in no change,
-        // after the call. I believe this is because both the source and destination SRS are the same.
-        if (!m_coordTransform->Transform(4, pointsX, pointsY, nullptr, nullptr)) {
-            qWarning() << "Coordinate transformation failed";
-            return;
-        }
+    if (!m_warpGrid.isValid())
+        return;
 
-        // Update min/max values
-        minX = std::min({pointsX[0], pointsX[1], pointsX[2], pointsX[3]});
-        maxX = std::max({pointsX[0], pointsX[1], pointsX[2], pointsX[3]});
-        minY = std::min({pointsY[0], pointsY[1], pointsY[2], pointsY[3]});
-        maxY = std::max({pointsY[0], pointsY[1], pointsY[2], pointsY[3]});
+    // Warp space is Web Mercator up to an offset and a scale, so the map projects it onto the screen
+    // with a homography (an affine transform unless the map is tilted). Four points determine it.
+    QRectF bounds = m_warpGrid.bounds();
+    QPolygonF warpQuad({ bounds.topLeft(), bounds.topRight(), bounds.bottomRight(), bounds.bottomLeft() });
+    QPolygonF itemQuad;
+    for (const QPointF &corner : std::as_const(warpQuad))
+        itemQuad.append(geoToPixel(m_warpGrid.toCoordinate(corner)));
+    if (!QTransform::quadToQuad(warpQuad, itemQuad, m_warpToItem)) {
+        qWarning() << "Failed to map the GeoTIFF onto the map";
+        return;
+    }
 
-        qDebug() << "maxX-minX:" << maxX-minX << "maxY-minY:" << maxY-minY;
+    // The item covers the map, the warp positions the tiles within it
+    setPosition(QPointF(0, 0));
+    setSize(QSizeF(mapWidth, mapHeight));
+
+    // Window of raster pixels that lies within the map viewport, and the finest raster-to-item scale in it
+    int rasterWidth = m_dataset->GetRasterXSize();
+    int rasterHeight = m_dataset->GetRasterYSize();
+    QRect visibleWindow;
+    double rasterPxPerItemPx = std::numeric_limits<double>::infinity();
+    if (isVisible()) {
+        findVisibleWindow(QRect(0, 0, rasterWidth, rasterHeight), QRectF(0, 0, mapWidth, mapHeight),
+                          visibleWindow, rasterPxPerItemPx);
+    }
+    if (visibleWindow.isEmpty()) {
+        // Image is offscreen or hidden. Drop the tiles from the scene graph, they stay in the cache.
+        m_wantedTiles.clear();
+        m_tileDecoder.setWanted(m_wantedTiles);
+        if (!m_visibleTiles.isEmpty()) {
+            m_visibleTiles.clear();
+            update();
+        }
+        return;
     }
 
-    // Calculate the pixel coordinates of the GeoTIFF corners
-    QPointF topLeftGTPx = geoToPixel(QGeoCoordinate(maxY, minX));
-    QPointF bottomRightGTPx = geoToPixel(QGeoCoordinate(minY, maxX));
+    qreal dpr = window() ? window()->effectiveDevicePixelRatio() : 1.0;
+    int level = budgetedTileLevel(visibleWindow, tileLevelFor(rasterPxPerItemPx / dpr));
+    if (level == m_tileLevel || m_tileLevel < 0 || m_refineTimer.interval() <= 0) {
+        // Panning, or zooming within the same level: cached tiles are shown at once, others are queued.
+        m_refineTimer.stop();
+        updateVisibleTiles(visibleWindow, level);
+    } else {
+        // The resolution changed. Keep scaling what is on screen and only refine once the gesture
+        // has paused for refineDelay, so wheel and pinch zooming never wait for I/O.
+        m_refineWindow = visibleWindow;
+        m_refineLevel = level;
+        m_refineTimer.start();
+    }
+    update();
+}
 
-    QRectF targetRect(topLeftGTPx, bottomRightGTPx);
-    setImplicitSize(targetRect.width(), targetRect.height());
-    setPosition(targetRect.topLeft());
+void GeoTiffQuickItem::refine()
+{
+    if (m_dataset)
+        updateVisibleTiles(m_refineWindow, m_refineLevel);
+}
 
-    if((targetRect.top() + targetRect.height() <= 0) || (targetRect.left() + targetRect.width() <= 0) ||
-        (targetRect.top() > targetRect.height()) || (targetRect.left() > targetRect.width())) {
-        // Image is offscreen. No need to continue.
+void GeoTiffQuickItem::findVisibleWindow(const QRect &rasterRect, const QRectF &viewport, QRect &window,
+                                         double &rasterPxPerItemPx) const
+{
+    // Outline of the raster rectangle on the map. The mesh can bulge out between grid points, so
+    // those inside the rectangle count towards its bounds as well.
+    QRectF rect(rasterRect);
+    QPolygonF outline({ m_warpGrid.map(rect.topLeft()), m_warpGrid.map(rect.topRight()),
+                        m_warpGrid.map(rect.bottomRight()), m_warpGrid.map(rect.bottomLeft()) });
+    for (int row = 1; row < m_warpGrid.rows(); ++row) {
+        double y = m_warpGrid.rowPosition(row);
+        if (y <= rect.top() || y >= rect.bottom())
+            continue;
+        for (int column = 1; column < m_warpGrid.columns(); ++column) {
+            double x = m_warpGrid.columnPosition(column);
+            if (x > rect.left() && x < rect.right())
+                outline.append(m_warpGrid.point(column, row));
+        }
+    }
+    outline = m_warpToItem.map(outline);
+    QRectF itemBounds = outline.boundingRect();
+    if (!itemBounds.intersects(viewport))
+        return;
+
+    // Split partly visible rectangles down to about a tile, so zoomed in views only request what is on screen
+    if (!viewport.contains(itemBounds) && std::max(rasterRect.width(), rasterRect.height()) > s_tileSize) {
+        int halfWidth = rasterRect.width() > s_tileSize ? rasterRect.width() / 2 : rasterRect.width();
+        int halfHeight = rasterRect.height() > s_tileSize ? rasterRect.height() / 2 : rasterRect.height();
+        for (int y = rasterRect.top(); y <= rasterRect.bottom(); y += halfHeight) {
+            for (int x = rasterRect.left(); x <= rasterRect.right(); x += halfWidth) {
+                QRect part = QRect(x, y, halfWidth, halfHeight).intersected(rasterRect);
+                findVisibleWindow(part, viewport, window, rasterPxPerItemPx);
+            }
+        }
         return;
     }
 
-    // Handle rotation if needed - depends on the GeoTIFF and its alignment with the map
-    // This example assumes north-up GeoTIFF with no rotation needed - QTransform for that I think?
+    window |= rasterRect;
+    double topLength = QLineF(outline[0], outline[1]).length();
+    double leftLength = QLineF(outline[0], outline[3]).length();
+    if (topLength > 0)
+        rasterPxPerItemPx = std::min(rasterPxPerItemPx, rasterRect.width() / topLength);
+    if (leftLength > 0)
+        rasterPxPerItemPx = std::min(rasterPxPerItemPx, rasterRect.height() / leftLength);
+}
 
-    if(m_dirty)
-        transformImage();
+int GeoTiffQuickItem::tileLevelFor(double rasterPxPerDevicePx) const
+{
+    // Use the coarsest level whose tiles still have at least one pixel per device pixel.
+    int level = rasterPxPerDevicePx > 1.0 ? int(std::floor(std::log2(rasterPxPerDevicePx))) : 0;
+    return std::clamp(level, 0, maxTileLevel());
 }
 
-void GeoTiffQuickItem::transformImage()
+int GeoTiffQuickItem::budgetedTileLevel(const QRect &visibleWindow, int level) const
 {
-    qDebug() << "Transform image";
-    // Create a QImage from the GeoTIFF
-    int widthGTPx = m_dataset->GetRasterXSize();
-    int heightGTPx = m_dataset->GetRasterYSize();
+    // Deep zooms on a large screen could want more tiles than the process wide budget holds, then
+    // they would evict each other (and everyone else's) as fast as they are decoded. Use coarser tiles
+    // until the view fits in half the budget, leaving the rest for the other items and placeholders.
+    qint64 budget = MemoryBudget::instance()->maxBytes() / 2;
+    int bytesPerPixel = QImage(1, 1, RasterReader::imageFormat(m_dataset.get())).depth() / 8;
+    int maxLevel = maxTileLevel();
+    int wantedLevel = level;
+    for (; level < maxLevel; ++level) {
+        int span = s_tileSize << level;
+        qint64 columns = (visibleWindow.right() / span) - (visibleWindow.left() / span) + 1;
+        qint64 rows = (visibleWindow.bottom() / span) - (visibleWindow.top() / span) + 1;
+        if (columns * rows * s_tileSize * s_tileSize * bytesPerPixel <= budget)
+            break;
+    }
+    if (level != wantedLevel)
+        qDebug() << "Memory budget allows tile level" << level << "instead of" << wantedLevel;
+    return level;
+}
 
-    // Read all raster bands
-    int bandCount = m_dataset->GetRasterCount();
+int GeoTiffQuickItem::maxTileLevel() const
+{
+    // The level at which the whole raster fits in a single tile
+    int largestSide = std::max(m_dataset->GetRasterXSize(), m_dataset->GetRasterYSize());
+    int level = 0;
+    while ((s_tileSize << level) < largestSide)
+        ++level;
+    return level;
+}
+
+QRect GeoTiffQuickItem::tileRasterRect(const TileKey &key) const
+{
+    int span = s_tileSize << key.level;
+    return QRect(key.x * span, key.y * span, span, span)
+        .intersected(QRect(0, 0, m_dataset->GetRasterXSize(), m_dataset->GetRasterYSize()));
+}
 
-    QImage image(widthGTPx, heightGTPx, bandCount >= 4 ? QImage::Format_RGBA8888 :
-                                            (bandCount == 3 ? QImage::Format_RGB888 : QImage::Format_Grayscale8));
+void GeoTiffQuickItem::updateVisibleTiles(const QRect &visibleWindow, int level)
+{
+    // Panning only decodes and uploads the tiles that come into view; the rest are found in the cache.
+    int span = s_tileSize << level;
 
-    // Read bands
-    // This is simplified - you might want to handle different band types properly
-    GDALRasterBand* redBand = m_dataset->GetRasterBand(1);
+    int overviewLevel = RasterReader::selectOverview(m_dataset.get(), QRect(0, 0, span, span), QSize(s_tileSize, s_tileSize));
+    if (overviewLevel != m_overviewLevel) {
+        m_overviewLevel = overviewLevel;
+        emit overviewLevelChanged();
+    }
 
-    CPLErr err;
-    if (bandCount == 1) {
-        // Grayscale image
-        std::vector<uint8_t> buffer(widthGTPx * heightGTPx);
-        err = redBand->RasterIO(GF_Read, 0, 0, widthGTPx, heightGTPx, buffer.data(), widthGTPx, heightGTPx, GDT_Byte, 0, 0);
-        if (err)
-            reportCplErrWarning(err, "GDALRasterBand::RasterIO call on redBand failed with ");
+    int firstX = visibleWindow.left() / span;
+    int lastX = visibleWindow.right() / span;
+    int firstY = visibleWindow.top() / span;
+    int lastY = visibleWindow.bottom() / span;
 
-        for (int y = 0; y < heightGTPx; ++y) {
-            memcpy(image.scanLine(y), buffer.data() + y * widthGTPx, widthGTPx);
+    QSet<TileKey> wantedTiles;
+    for (int y = firstY; y <= lastY; ++y) {
+        for (int x = firstX; x <= lastX; ++x)
+            wantedTiles.insert(TileKey{level, x, y});
+    }
+    m_tileLevel = level;
+    m_wantedTiles = wantedTiles;
+    // Tiles the view is heading for are wanted too, so their jobs aren't dropped before they start
+    QSet<TileKey> prefetchTiles = predictTiles(visibleWindow, level);
+    m_tileDecoder.setWanted(m_wantedTiles | prefetchTiles);
+
+    // Show what is cached right away and queue the rest, nearest to the centre of the view first.
+    // Decoding happens on the decoder's worker threads, results arrive in onTileDecoded().
+    QPointF centre((firstX + lastX) / 2.0, (firstY + lastY) / 2.0);
+    QHash<TileKey, QImage> visibleTiles;
+    QSet<TileKey> missingTiles;
+    for (const TileKey &key : std::as_const(m_wantedTiles)) {
+        if (m_tileDecoder.isPending(key))
+            continue;
+
+        QImage tile = m_tileCache.find(key);
+        PerfCounters::instance()->addCacheLookup(!tile.isNull());
+        if (!tile.isNull())
+            visibleTiles.insert(key, tile);
+        else
+            missingTiles.insert(key);
+    }
+    requestTiles(missingTiles, level, centre, 0);
+    requestTiles(prefetchTiles, level, centre, s_prefetchPriority);
+
+    // Until the new level is complete, keep showing the tiles of the previous one that are in view
+    if (visibleTiles.size() < m_wantedTiles.size()) {
+        QRect visibleRect = QRect(firstX * span, firstY * span, (lastX - firstX + 1) * span, (lastY - firstY + 1) * span);
+        for (auto it = m_visibleTiles.cbegin(); it != m_visibleTiles.cend(); ++it) {
+            if (it.key().level != level && tileRasterRect(it.key()).intersects(visibleRect))
+                visibleTiles.insert(it.key(), it.value());
         }
     }
-    else if (bandCount >= 3) {
-        // RGB or RGBA image
-        GDALRasterBand* greenBand = m_dataset->GetRasterBand(2);
-        GDALRasterBand* blueBand = m_dataset->GetRasterBand(3);
-        GDALRasterBand* alphaBand = bandCount >= 4 ? m_dataset->GetRasterBand(4) : nullptr;
-
-        std::vector<uint8_t> redBuffer(widthGTPx * heightGTPx);
-        std::vector<uint8_t> greenBuffer(widthGTPx * heightGTPx);
-        std::vector<uint8_t> blueBuffer(widthGTPx * heightGTPx);
-        // If no alpha channel, fill with 255 (completely opaque)
-        std::vector<uint8_t> alphaBuffer = bandCount > 3 ? std::vector<uint8_t>(widthGTPx*heightGTPx) : std::vector<uint8_t>(widthGTPx*heightGTPx, 255);
-
-        err = redBand->RasterIO(GF_Read, 0, 0, widthGTPx, heightGTPx, redBuffer.data(), widthGTPx, heightGTPx, GDT_Byte, 0, 0);
-        if (err)
-            reportCplErrWarning(err, "GDALRasterBand::RasterIO call on redBand failed with ");
-
-        err = greenBand->RasterIO(GF_Read, 0, 0, widthGTPx, heightGTPx, greenBuffer.data(), widthGTPx, heightGTPx, GDT_Byte, 0, 0);
-        if (err)
-            reportCplErrWarning(err, "GDALRasterBand::RasterIO call on greenBand failed with ");
-
-        err = blueBand->RasterIO(GF_Read, 0, 0, widthGTPx, heightGTPx, blueBuffer.data(), widthGTPx, heightGTPx, GDT_Byte, 0, 0);
-        if (err)
-            reportCplErrWarning(err, "GDALRasterBand::RasterIO call on blueBand failed with ");
-
-        if (alphaBand) {
-            err = alphaBand->RasterIO(GF_Read, 0, 0, widthGTPx, heightGTPx, alphaBuffer.data(), widthGTPx, heightGTPx, GDT_Byte, 0, 0);
-            if (err)
-                reportCplErrWarning(err, "GDALRasterBand::RasterIO call on alphaBand failed with ");
+    m_visibleTiles = visibleTiles;
+
+    emit tileStatsChanged();
+}
+
+void GeoTiffQuickItem::requestTiles(const QSet<TileKey> &keys, int level, const QPointF &centre, int priority)
+{
+    // Tiles within one block cell are read together, see TileDecoder::requestBatch()
+    QSize batch = batchSize(level);
+    QHash<QPoint, QList<TileKey>> cells;
+    for (const TileKey &key : keys)
+        cells[QPoint(key.x / batch.width(), key.y / batch.height())].append(key);
+
+    int factor = 1 << level;
+    auto outSizeOf = [factor](const QRect &window) {
+        return QSize((window.width() + factor - 1) / factor, (window.height() + factor - 1) / factor);
+    };
+    auto distanceOf = [&centre](const TileKey &key) {
+        return qRound(std::abs(key.x - centre.x()) + std::abs(key.y - centre.y()));
+    };
+    for (const QList<TileKey> &cellKeys : std::as_const(cells)) {
+        QRect tileBounds;
+        int distance = std::numeric_limits<int>::max();
+        for (const TileKey &key : cellKeys) {
+            tileBounds |= QRect(key.x, key.y, 1, 1);
+            distance = std::min(distance, distanceOf(key));
         }
 
-        for (int y = 0; y < heightGTPx; ++y) {
-            uint8_t* scanline = image.scanLine(y);
-            for (int x = 0; x < widthGTPx; ++x) {
-                int idx = y * widthGTPx + x;
-                if (bandCount >= 4) {
-                    scanline[x*4] = redBuffer[idx];
-                    scanline[x*4+1] = greenBuffer[idx];
-                    scanline[x*4+2] = blueBuffer[idx];
-                    scanline[x*4+3] = alphaBuffer[idx];
-                }
-                else {
-                    scanline[x*3] = redBuffer[idx];
-                    scanline[x*3+1] = greenBuffer[idx];
-                    scanline[x*3+2] = blueBuffer[idx];
-                }
+        // Only a complete rectangle of missing tiles can be read as one window
+        if (cellKeys.size() > 1 && tileBounds.width() * tileBounds.height() == cellKeys.size()) {
+            QRect window = tileRasterRect(TileKey{level, tileBounds.left(), tileBounds.top()})
+                           | tileRasterRect(TileKey{level, tileBounds.right(), tileBounds.bottom()});
+            QList<QRect> outRects;
+            for (const TileKey &key : cellKeys) {
+                QPoint origin((key.x - tileBounds.left()) * s_tileSize, (key.y - tileBounds.top()) * s_tileSize);
+                outRects.append(QRect(origin, outSizeOf(tileRasterRect(key))));
             }
+            m_tileDecoder.requestBatch(cellKeys, outRects, window, outSizeOf(window), priority - distance);
+        } else {
+            for (const TileKey &key : cellKeys) {
+                QRect window = tileRasterRect(key);
+                m_tileDecoder.request(key, window, outSizeOf(window), priority - distanceOf(key));
+            }
+        }
+    }
+}
+
+QSize GeoTiffQuickItem::batchSize(int level) const
+{
+    // Tiles across and down that fall in one natural block of the band (or overview) the level is read from
+    QRect window = tileRasterRect(TileKey{level, 0, 0});
+    int factor = 1 << level;
+    QSize outSize((window.width() + factor - 1) / factor, (window.height() + factor - 1) / factor);
+    GDALRasterBand *band = m_dataset->GetRasterBand(1);
+    int overviewLevel = RasterReader::selectOverview(m_dataset.get(), window, outSize);
+    if (overviewLevel >= 0 && band->GetOverview(overviewLevel))
+        band = band->GetOverview(overviewLevel);
+    int blockXSize = 0;
+    int blockYSize = 0;
+    band->GetBlockSize(&blockXSize, &blockYSize);
+    double xFactor = double(m_dataset->GetRasterXSize()) / band->GetXSize();
+    double yFactor = double(m_dataset->GetRasterYSize()) / band->GetYSize();
+    int span = s_tileSize << level;
+    return QSize(std::clamp(int(blockXSize * xFactor / span), 1, s_maxBatchTiles),
+                 std::clamp(int(blockYSize * yFactor / span), 1, s_maxBatchTiles));
+}
+
+QSet<TileKey> GeoTiffQuickItem::predictTiles(const QRect &visibleWindow, int level)
+{
+    // Pan velocity in raster pixels per ms, smoothed over the updates of one gesture. It is reset when
+    // the view rests or the level changes.
+    QPointF centre = QRectF(visibleWindow).center();
+    qint64 elapsed = m_panTimer.isValid() ? m_panTimer.restart() : -1;
+    if (elapsed < 0)
+        m_panTimer.start();
+    if (level != m_panLevel || elapsed <= 0 || elapsed > s_panIdleTime)
+        m_panVelocity = QPointF();
+    else
+        m_panVelocity = (m_panVelocity + (centre - m_panCentre) / double(elapsed)) / 2;
+    m_panCentre = centre;
+    m_panLevel = level;
+
+    QSet<TileKey> tiles;
+    QPointF lookahead = m_panVelocity * s_prefetchLookahead;
+    int span = s_tileSize << level;
+    if (std::abs(lookahead.x()) < span / 4 && std::abs(lookahead.y()) < span / 4)
+        return tiles;
+
+    QRect predicted = visibleWindow.translated(lookahead.toPoint())
+                          .intersected(QRect(0, 0, m_dataset->GetRasterXSize(), m_dataset->GetRasterYSize()));
+    if (predicted.isEmpty())
+        return tiles;
+    for (int y = predicted.top() / span; y <= predicted.bottom() / span; ++y) {
+        for (int x = predicted.left() / span; x <= predicted.right() / span; ++x) {
+            TileKey key{level, x, y};
+            if (!m_wantedTiles.contains(key) && !m_tileCache.contains(key) && !m_tileDecoder.isPending(key))
+                tiles.insert(key);
         }
     }
+    return tiles;
+}
 
-    // Now transform the image to match the map
-    QRectF sourceRect(0, 0, widthGTPx, heightGTPx);
-
-    // FIXME: Serious performance issue here when zooming in at high zoom levels.
-    // TODO: transformed image should be sized to just the area to render...
-    // TODO: But if we do that, we need to render it with every viewportRegion change unless it is fully within the bounds of the viewport.
-    // TODO: Still, might not be too expensive.
-    // Create a new image with the correct size for our map view
-    QSize sz = size().toSize();
-    QImage transformedImage(sz, QImage::Format_RGBA8888);
-    // transformedImage.fill(Qt::transparent);
-
-    QPainter painter(&transformedImage);
-
-    // Calculate the mapping from source to target
-    QTransform mapTransform;
-    mapTransform.scale(width() / sourceRect.width(),
-                       height() / sourceRect.height());
-
-    // Draw the image with transformation
-    painter.setTransform(mapTransform);
-    painter.drawImage(sourceRect, image);
-    painter.end();
-
-    m_transformedImage = transformedImage;
-    m_dirty = false;
-    // QImageWriter w("/tmp/img.png");
-    // // w.write(image);
-    // w.setFileName("/tmp/img_xform.png");
-    // w.write(m_transformedImage);
-    update(); // Request a redraw
+void GeoTiffQuickItem::onTileDecoded(const TileKey &key, const QImage &image)
+{
+    m_tileCache.insert(key, image);
+    if (!m_wantedTiles.contains(key))
+        return;
+
+    m_visibleTiles.insert(key, image);
+    bool levelComplete = std::all_of(m_wantedTiles.cbegin(), m_wantedTiles.cend(), [this](const TileKey &wanted) {
+        return m_visibleTiles.contains(wanted);
+    });
+    if (levelComplete) {
+        // The current level is complete, the placeholders from the previous one can go
+        m_visibleTiles.removeIf([this](const QHash<TileKey, QImage>::iterator &it) {
+            return it.key().level != m_tileLevel;
+        });
+    }
+    update();
 }
 
 QPointF GeoTiffQuickItem::geoToPixel(const QGeoCoordinate &coord)
@@ -5,46 +5,178 @@
 #include <QQuickItem>
 #include <QImage>
 #include <QGeoCoordinate>
+#include <QTimer>
+#include <QElapsedTimer>
+#include <QFutureWatcher>
+#include <QTransform>
 #include <memory>
 #include <gdal_priv.h>
+#include "datasetpool.h"
+#include "overviewbuilder.h"
+#include "tilecache.h"
+#include "tiledecoder.h"
+#include "warpgrid.h"
 
 class QDeclarativeGeoMap;
+class TileNode;
 
 class GeoTiffQuickItem : public QQuickItem
 {
     Q_OBJECT
     QML_ELEMENT
     Q_PROPERTY(QString source READ source WRITE setSource NOTIFY sourceChanged)
+    Q_PROPERTY(Resampling resampling READ resampling WRITE setResampling NOTIFY resamplingChanged)
+    Q_PROPERTY(ContrastStretch contrastStretch READ contrastStretch WRITE setContrastStretch NOTIFY contrastStretchChanged)
+    Q_PROPERTY(int overviewCount READ overviewCount NOTIFY overviewCountChanged)
+    Q_PROPERTY(int overviewLevel READ overviewLevel NOTIFY overviewLevelChanged)
+    Q_PROPERTY(bool autoBuildOverviews READ autoBuildOverviews WRITE setAutoBuildOverviews NOTIFY autoBuildOverviewsChanged)
+    Q_PROPERTY(bool buildingOverviews READ buildingOverviews NOTIFY buildingOverviewsChanged)
+    Q_PROPERTY(qreal overviewBuildProgress READ overviewBuildProgress NOTIFY overviewBuildProgressChanged)
+    Q_PROPERTY(int refineDelay READ refineDelay WRITE setRefineDelay NOTIFY refineDelayChanged)
+    Q_PROPERTY(qint64 tileCacheHits READ tileCacheHits NOTIFY tileStatsChanged)
+    Q_PROPERTY(qint64 tileCacheMisses READ tileCacheMisses NOTIFY tileStatsChanged)
+    Q_PROPERTY(qint64 tileUploads READ tileUploads NOTIFY tileStatsChanged)
 
 public:
+    // Mirrors GDALRIOResampleAlg, used when the raster is read at a size other than its native one.
+    enum Resampling {
+        Nearest,
+        Bilinear,
+        Cubic,
+        CubicSpline,
+        Lanczos,
+        Average,
+        Mode
+    };
+    Q_ENUM(Resampling)
+
+    // How non-Byte (e.g. UInt16 or Float32) bands are mapped to the 8 bit display range.
+    enum ContrastStretch {
+        MinMaxStretch,
+        PercentileStretch
+    };
+    Q_ENUM(ContrastStretch)
+
     GeoTiffQuickItem(QQuickItem *parent = nullptr);
     ~GeoTiffQuickItem();
 
+    // Nearest Map among the ancestors of item, or nullptr.
+    static QDeclarativeGeoMap *findMap(QQuickItem *item);
+
     inline QString source() const { return m_source; }
+    // The file is opened, and placed on the map, on a worker thread.
     void setSource(const QString &source);
+    // Decodes tiles on pool instead of the item's own threads, see TileDecoder::setThreadPool().
+    inline void setDecodePool(QThreadPool *pool) { m_tileDecoder.setThreadPool(pool); }
+
+    inline Resampling resampling() const { return m_resampling; }
+    void setResampling(Resampling resampling);
+
+    inline ContrastStretch contrastStretch() const { return m_contrastStretch; }
+    void setContrastStretch(ContrastStretch contrastStretch);
+
+    int overviewCount() const;
+    // Overview the last read came from, or -1 for the full resolution raster.
+    inline int overviewLevel() const { return m_overviewLevel; }
+
+    inline bool autoBuildOverviews() const { return m_autoBuildOverviews; }
+    void setAutoBuildOverviews(bool autoBuild);
+    inline bool buildingOverviews() const { return m_overviewBuilder.running(); }
+    inline qreal overviewBuildProgress() const { return m_overviewBuilder.progress(); }
+
+    Q_INVOKABLE bool buildOverviews();
+    Q_INVOKABLE void cancelOverviewBuild();
+
+    // Idle time in ms after a zoom before tiles are decoded at the new resolution. Until then the
+    // tiles already on screen are scaled to follow the map.
+    inline int refineDelay() const { return m_refineTimer.interval(); }
+    void setRefineDelay(int delay);
+
+    inline qint64 tileCacheHits() const { return m_tileCache.hits(); }
+    inline qint64 tileCacheMisses() const { return m_tileCache.misses(); }
+    inline qint64 tileUploads() const { return m_tileUploads; }
 
 signals:
     void sourceChanged();
+    void resamplingChanged();
+    void contrastStretchChanged();
+    void overviewCountChanged();
+    void overviewLevelChanged();
+    void autoBuildOverviewsChanged();
+    void buildingOverviewsChanged();
+    void overviewBuildProgressChanged();
+    void refineDelayChanged();
+    void tileStatsChanged();
 
 protected:
     QSGNode* updatePaintNode(QSGNode* oldNode, UpdatePaintNodeData* data) override;
 
 private:
+    // Georeferencing of a source, worked out on a worker thread. The geotransform is empty on failure.
+    struct Placement
+    {
+        QString source;
+        std::vector<double> geoTransform;
+        WarpGrid warpGrid;
+    };
+    static Placement place(const QString &source);
+
     void updateTransform();
-    void transformImage();
+    void findVisibleWindow(const QRect &rasterRect, const QRectF &viewport, QRect &window, double &rasterPxPerItemPx) const;
+    int tileLevelFor(double rasterPxPerDevicePx) const;
+    int budgetedTileLevel(const QRect &visibleWindow, int level) const;
+    void updateVisibleTiles(const QRect &visibleWindow, int level);
+    void requestTiles(const QSet<TileKey> &keys, int level, const QPointF &centre, int priority);
+    QSize batchSize(int level) const;
+    QSet<TileKey> predictTiles(const QRect &visibleWindow, int level);
+    QRect tileRasterRect(const TileKey &key) const;
+    int maxTileLevel() const;
+    void resetTiles();
     QPointF geoToPixel(const QGeoCoordinate &coord);
+    void maybeAutoBuildOverviews();
 
 private slots:
     void loadSource();
+    void onPlacementFinished();
+    void onOverviewBuildFinished(bool success);
+    void onTileDecoded(const TileKey &key, const QImage &image);
+    void onBandStatisticsChanged();
+    void refine();
 
 private:
     QDeclarativeGeoMap *m_map = nullptr;
     QString m_source;
-    std::unique_ptr<GDALDataset> m_dataset;
+    DatasetPool::Handle m_dataset;
     std::vector<double> m_geoTransform;
-    std::unique_ptr<OGRCoordinateTransformation> m_coordTransform;
-    bool m_dirty = true;
-    QImage m_transformedImage;
+    QFutureWatcher<Placement> m_placementWatcher;
+    WarpGrid m_warpGrid;
+    QTransform m_warpToItem;                // Homography from warp space to item (and map) coordinates
+    Resampling m_resampling = Average;
+    ContrastStretch m_contrastStretch = PercentileStretch;
+    int m_overviewLevel = -1;
+    bool m_autoBuildOverviews = false;
+    OverviewBuilder m_overviewBuilder;
+
+    // Raster pixels per side of a tile at level 0.
+    static constexpr int s_tileSize = 256;
+    TileCache m_tileCache;
+    TileDecoder m_tileDecoder;
+    int m_tileLevel = -1;                   // Level of the tiles in m_wantedTiles
+    QSet<TileKey> m_wantedTiles;            // Tiles covering the visible window
+    QHash<TileKey, QImage> m_visibleTiles;  // Decoded tiles handed to the scene graph. Until all wanted
+                                            // tiles are decoded, this also holds those of the previous level.
+    QTimer m_refineTimer;
+    QRect m_refineWindow;                   // Visible window and level to refine to when the timer fires
+    int m_refineLevel = 0;
+    bool m_resetTileNodes = false;          // Set when cached tiles no longer match the source or settings
+    QElapsedTimer m_panTimer;               // Since the last visible window update
+    QPointF m_panCentre;                    // Centre of that window, in raster pixels
+    QPointF m_panVelocity;                  // Raster pixels per ms
+    int m_panLevel = -1;
+
+    // Scene graph side, only touched from updatePaintNode() while the GUI thread is blocked.
+    QHash<TileKey, TileNode*> m_tileNodes;
+    qint64 m_tileUploads = 0;
 };
 
 #endif // GEOTIFFQUICKITEM_H
@@ -1,23 +1,69 @@
 #include <QGuiApplication>
 #include <QQmlApplicationEngine>
 #include "appconfig.h"
+#include "datasetpool.h"
+#include "geotiffhandler.h"
+#include "memorybudget.h"
+#include "rangecache.h"
+#include "perfcounters.h"
 #include "thunderforestconfigserver.h"
 #include "geotiffimageprovider.h"
+#include "tileseeder.h"
+
+// Seeding runs without a display, so it only needs a QCoreApplication and no QML engine.
+static bool isSeeding(int argc, char *argv[])
+{
+    for (int i = 1; i < argc; ++i) {
+        if (qstrcmp(argv[i], "-s") == 0 || qstrcmp(argv[i], "--seed") == 0 || qstrncmp(argv[i], "--seed=", 7) == 0)
+            return true;
+    }
+    return false;
+}
 
 int main(int argc, char *argv[])
 {
+    if (isSeeding(argc, argv)) {
+        QCoreApplication app(argc, argv);
+        DatasetPool::instance();
+        AppConfig *appConfig = AppConfig::instance();
+        TileSeeder seeder(appConfig->seedFiles(), appConfig->seedOutput(), appConfig->seedMinZoom(), appConfig->seedMaxZoom());
+        return seeder.run();
+    }
+
     QGuiApplication app(argc, argv);
 
     qputenv("QT_QUICK_BACKEND", "software");
+    // Created here so their timers and queued evictions live on the main thread
+    DatasetPool::instance();
+    MemoryBudget::instance();
+    PerfCounters *perfCounters = PerfCounters::instance();
     QQmlApplicationEngine engine;
 
     AppConfig *appConfig = AppConfig::instance();
+    if (appConfig->memoryBudgetMiB() > 0)
+        MemoryBudget::instance()->setMaxBytes(appConfig->memoryBudgetMiB() * 1024 * 1024);
+    if (appConfig->rangeCacheMiB() >= 0)
+        RangeCache::instance()->setMaxBytes(appConfig->rangeCacheMiB() * 1024 * 1024);
+    if (!appConfig->traceFile().isEmpty() && perfCounters->startTrace(appConfig->traceFile()))
+        QObject::connect(&app, &QCoreApplication::aboutToQuit, perfCounters, &PerfCounters::stopTrace);
 
     ThunderForestConfigServer *mapConfigServer = new ThunderForestConfigServer(appConfig->thunderforestApiKey(), &app);
     mapConfigServer->listen();
-    appConfig->setOsmMappingProvidersRepositoryAddress(QString("http://localhost:%1/").arg(mapConfigServer->serverPort()));
+    appConfig->setOsmMappingProvidersRepositoryAddress(QString("http://127.0.0.1:%1/").arg(mapConfigServer->serverPort()));
     qDebug() << "osmMappingProvidersRepositoryAddress" << appConfig->osmMappingProvidersRepositoryAddress();
 
+    // Publish whichever GeoTIFF is loaded as a tile layer too, once it has been read on a worker. A layer
+    // finishing after the file changed again is served but not shown.
+    GeoTiffHandler *geoTiffHandler = GeoTiffHandler::instance();
+    QObject::connect(geoTiffHandler, &GeoTiffHandler::currentFileChanged, mapConfigServer, [=]() {
+        QString filePath = geoTiffHandler->currentFile();
+        appConfig->setGeoTiffTileLayerAddress(QString());
+        mapConfigServer->publishLayer(filePath).then(mapConfigServer, [=](const QString &layer) {
+            if (geoTiffHandler->currentFile() == filePath && !layer.isEmpty())
+                appConfig->setGeoTiffTileLayerAddress(mapConfigServer->layerAddress(layer));
+        });
+    });
+
     engine.addImageProvider(QLatin1String("geotiff"), new GeoTiffImageProvider);
     QObject::connect(
         &engine,
@@ -0,0 +1,163 @@
+#include "mappedraster.h"
+#include <QDebug>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <cpl_string.h>
+
+std::shared_ptr<const MappedRaster> MappedRaster::map(GDALDataset *dataset)
+{
+    if (!dataset || !dataset->GetDriver() || !EQUAL(dataset->GetDriver()->GetDescription(), "GTiff"))
+        return nullptr;
+    int bands = dataset->GetRasterCount();
+    if (bands < 1)
+        return nullptr;
+    for (int i = 1; i <= bands; ++i) {
+        if (dataset->GetRasterBand(i)->GetRasterDataType() != GDT_Byte)
+            return nullptr;
+    }
+
+    // Only plain 8-bit samples in the file's bytes, all bands of a pixel next to each other
+    GDALRasterBand *band = dataset->GetRasterBand(1);
+    const char *compression = dataset->GetMetadataItem("COMPRESSION", "IMAGE_STRUCTURE");
+    const char *interleave = dataset->GetMetadataItem("INTERLEAVE", "IMAGE_STRUCTURE");
+    const char *nbits = band->GetMetadataItem("NBITS", "IMAGE_STRUCTURE");
+    const char *colorSpace = dataset->GetMetadataItem("SOURCE_COLOR_SPACE", "IMAGE_STRUCTURE");
+    if ((compression && !EQUAL(compression, "NONE")) || (bands > 1 && (!interleave || !EQUAL(interleave, "PIXEL")))
+        || (nbits && atoi(nbits) != 8) || colorSpace)
+        return nullptr;
+
+    QString filePath = QString::fromUtf8(dataset->GetDescription());
+    if (filePath.startsWith("/vsi"))
+        return nullptr;
+    // The alpha would have to come from the mask
+    if (RasterReader::needsMask(dataset))
+        return nullptr;
+
+    std::shared_ptr<MappedRaster> raster(new MappedRaster);
+    raster->m_file.setFileName(filePath);
+    if (!raster->m_file.open(QIODevice::ReadOnly))
+        return nullptr;
+    qint64 fileSize = raster->m_file.size();
+
+    raster->m_width = dataset->GetRasterXSize();
+    raster->m_height = dataset->GetRasterYSize();
+    raster->m_bands = bands;
+    raster->m_colorTable = RasterReader::colorTable(dataset);
+    band->GetBlockSize(&raster->m_blockWidth, &raster->m_blockHeight);
+    if (raster->m_blockWidth < 1 || raster->m_blockHeight < 1)
+        return nullptr;
+    raster->m_blocksAcross = (raster->m_width + raster->m_blockWidth - 1) / raster->m_blockWidth;
+    int blocksDown = (raster->m_height + raster->m_blockHeight - 1) / raster->m_blockHeight;
+
+    // Sparse files (blocks without an offset) and blocks that would run past the end of the file are left
+    // to GDAL. The last strip of a stripped file only holds the remaining rows.
+    raster->m_blockOffsets.reserve(size_t(raster->m_blocksAcross) * blocksDown);
+    for (int y = 0; y < blocksDown; ++y) {
+        for (int x = 0; x < raster->m_blocksAcross; ++x) {
+            const char *offset = band->GetMetadataItem(CPLSPrintf("BLOCK_OFFSET_%d_%d", x, y), "TIFF");
+            qint64 start = offset ? CPLAtoGIntBig(offset) : 0;
+            int rows = std::min(raster->m_blockHeight, raster->m_height - y * raster->m_blockHeight);
+            int columns = std::min(raster->m_blockWidth, raster->m_width - x * raster->m_blockWidth);
+            qint64 length = (qint64(rows - 1) * raster->m_blockWidth + columns) * bands;
+            if (start <= 0 || start + length > fileSize)
+                return nullptr;
+            raster->m_blockOffsets.push_back(start);
+        }
+    }
+
+    raster->m_data = raster->m_file.map(0, fileSize);
+    if (!raster->m_data) {
+        qWarning() << "Failed to map" << filePath << ":" << raster->m_file.errorString();
+        return nullptr;
+    }
+    return raster;
+}
+
+MappedRaster::~MappedRaster()
+{
+    if (m_data)
+        m_file.unmap(const_cast<uchar *>(m_data));
+}
+
+bool MappedRaster::canRead(const QRect &window, const QSize &outSize, int overviewLevel, GDALRIOResampleAlg resampleAlg) const
+{
+    if (overviewLevel >= 0 || window.isEmpty() || outSize.isEmpty() || !QRect(0, 0, m_width, m_height).contains(window))
+        return false;
+    // RasterReader reads paletted rasters by nearest neighbour for everything but mode
+    bool nearest = resampleAlg == GRIORA_NearestNeighbour || (!m_colorTable.isEmpty() && resampleAlg != GRIORA_Mode);
+    return outSize == window.size()
+           || (nearest && outSize.width() <= window.width()
+               && outSize.height() <= window.height());
+}
+
+// The samples from x up to the end of the block row it falls in are contiguous.
+inline const uchar *MappedRaster::row(int x, int y) const
+{
+    int blockX = x / m_blockWidth;
+    int blockY = y / m_blockHeight;
+    qint64 offset = m_blockOffsets[size_t(blockY) * m_blocksAcross + blockX]
+                    + (qint64(y - blockY * m_blockHeight) * m_blockWidth + (x - blockX * m_blockWidth)) * m_bands;
+    return m_data + offset;
+}
+
+QImage MappedRaster::read(const QRect &window, const QSize &outSize, RasterReader::Timings *timings) const
+{
+    QImage image(outSize, m_colorTable.isEmpty() ? RasterReader::imageFormat(m_bands) : QImage::Format_Indexed8);
+    if (image.isNull())
+        return QImage();
+    if (!m_colorTable.isEmpty())
+        image.setColorTable(m_colorTable);
+
+    auto start = std::chrono::steady_clock::now();
+    int channels = image.depth() / 8;
+    int imageBands = std::min(m_bands, channels);
+    bool opaquePadding = image.format() == QImage::Format_RGBX8888;
+
+    if (outSize == window.size()) {
+        // Copy each row block by block, straight through when the pixel layouts match
+        for (int y = 0; y < outSize.height(); ++y) {
+            uchar *line = image.scanLine(y);
+            for (int x = window.left(); x <= window.right();) {
+                int run = std::min(m_blockWidth - x % m_blockWidth, window.right() + 1 - x);
+                const uchar *source = row(x, window.top() + y);
+                uchar *target = line + (x - window.left()) * channels;
+                if (m_bands == channels) {
+                    std::memcpy(target, source, size_t(run) * channels);
+                } else {
+                    for (int i = 0; i < run; ++i, target += channels, source += m_bands) {
+                        for (int c = 0; c < imageBands; ++c)
+                            target[c] = source[c];
+                        if (opaquePadding)
+                            target[3] = 0xff;
+                    }
+                }
+                x += run;
+            }
+        }
+    } else {
+        // Nearest neighbour decimation, sampling pixel centres like GDAL does
+        std::vector<int> columns(outSize.width());
+        for (int x = 0; x < outSize.width(); ++x)
+            columns[x] = window.left() + int((x + 0.5) * window.width() / outSize.width());
+        for (int y = 0; y < outSize.height(); ++y) {
+            int sourceY = window.top() + int((y + 0.5) * window.height() / outSize.height());
+            uchar *target = image.scanLine(y);
+            for (int x = 0; x < outSize.width(); ++x, target += channels) {
+                const uchar *source = row(columns[x], sourceY);
+                for (int c = 0; c < imageBands; ++c)
+                    target[c] = source[c];
+                if (opaquePadding)
+                    target[3] = 0xff;
+            }
+        }
+    }
+
+    if (timings) {
+        timings->readNs = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        timings->conversionNs = 0;
+        timings->scalingNs = 0;
+        timings->bytes = qint64(outSize.width()) * outSize.height() * imageBands;
+    }
+    return image;
+}
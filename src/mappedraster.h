@@ -0,0 +1,50 @@
+#ifndef MAPPEDRASTER_H
+#define MAPPEDRASTER_H
+
+#include <QFile>
+#include <QImage>
+#include <QRect>
+#include <memory>
+#include <vector>
+#include <gdal_priv.h>
+#include "rasterreader.h"
+
+// Reads windows of uncompressed, pixel interleaved 8-bit GeoTIFFs straight from a memory mapping of the
+// file. Tiles are then copied out of the page cache with memcpy, without going through GDAL's block cache
+// (and the copy it keeps of every block) or its per-request overhead.
+//
+// The layout is taken from the TIFF block offsets GDAL reports, and checked against the file size when
+// mapping, so read() never touches memory outside the mapping. Files that don't qualify, including those
+// with nodata or a mask, or reads that need resampling, are left to RasterReader.
+class MappedRaster
+{
+public:
+    // Null when the dataset can't be read through a mapping.
+    static std::shared_ptr<const MappedRaster> map(GDALDataset *dataset);
+    ~MappedRaster();
+
+    // True when read() gives what RasterReader::read() would for the same arguments: full resolution,
+    // and either one output pixel per raster pixel or nearest neighbour decimation.
+    bool canRead(const QRect &window, const QSize &outSize, int overviewLevel, GDALRIOResampleAlg resampleAlg) const;
+    // The window is in raster pixels and must lie within the raster. The image has the format
+    // RasterReader::imageFormat() gives for the band count, or is Indexed8 for paletted rasters.
+    QImage read(const QRect &window, const QSize &outSize, RasterReader::Timings *timings = nullptr) const;
+
+private:
+    MappedRaster() = default;
+    inline const uchar *row(int x, int y) const;
+
+private:
+    QFile m_file;
+    const uchar *m_data = nullptr;
+    int m_width = 0;
+    int m_height = 0;
+    int m_bands = 0;
+    int m_blockWidth = 0;
+    int m_blockHeight = 0;
+    int m_blocksAcross = 0;
+    std::vector<qint64> m_blockOffsets;    // Row major, band interleaved samples of each block
+    QList<QRgb> m_colorTable;               // RasterReader::colorTable(), empty unless paletted
+};
+
+#endif // MAPPEDRASTER_H
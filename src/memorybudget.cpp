@@ -0,0 +1,74 @@
+#include "memorybudget.h"
+#include "tilecache.h"
+#include <QCoreApplication>
+#include <QThread>
+#include <QDebug>
+
+static constexpr qint64 s_defaultMaxBytes = qint64(1024) * 1024 * 1024;
+
+MemoryBudget::Charge::Charge(qint64 bytes)
+    : m_bytes(bytes)
+{
+    MemoryBudget::instance()->charge(m_bytes);
+}
+
+MemoryBudget::Charge::~Charge()
+{
+    MemoryBudget::instance()->release(m_bytes);
+}
+
+MemoryBudget::MemoryBudget(QObject *parent)
+    : QObject{parent}
+    , m_maxBytes(s_defaultMaxBytes)
+{
+}
+
+MemoryBudget *MemoryBudget::instance()
+{
+    if (s_instance == nullptr)
+        s_instance = new MemoryBudget(qApp);
+    return s_instance;
+}
+
+void MemoryBudget::setMaxBytes(qint64 maxBytes)
+{
+    m_maxBytes = maxBytes;
+    evict();
+}
+
+void MemoryBudget::registerCache(TileCache *cache)
+{
+    m_caches.append(cache);
+}
+
+void MemoryBudget::unregisterCache(TileCache *cache)
+{
+    m_caches.removeOne(cache);
+}
+
+void MemoryBudget::charge(qint64 bytes)
+{
+    m_usedBytes += bytes;
+    if (QThread::currentThread() == thread())
+        evict();
+    else if (m_usedBytes > m_maxBytes)
+        QMetaObject::invokeMethod(this, &MemoryBudget::evict, Qt::QueuedConnection);
+}
+
+void MemoryBudget::evict()
+{
+    // The caches are few (one per item), so finding the globally oldest tile is a scan of their LRU
+    // tails. The tile used last is never evicted, even if it alone is over budget.
+    while (m_usedBytes > m_maxBytes) {
+        TileCache *oldest = nullptr;
+        for (TileCache *cache : std::as_const(m_caches)) {
+            if (cache->count() > 0 && cache->oldestUse() < m_lastUse
+                && (!oldest || cache->oldestUse() < oldest->oldestUse())) {
+                oldest = cache;
+            }
+        }
+        if (!oldest)
+            break;
+        oldest->evictOldest();
+    }
+}
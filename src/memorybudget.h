@@ -0,0 +1,65 @@
+#ifndef MEMORYBUDGET_H
+#define MEMORYBUDGET_H
+
+#include <QObject>
+#include <QList>
+#include <atomic>
+
+class TileCache;
+
+// Process wide limit on the bytes held by decoded tiles. Every TileCache registers itself and reports
+// what it adds and drops; when the total goes over maxBytes(), the least recently used tiles across all
+// caches are evicted, whichever item they belong to. Items also ask for coarser tiles when a view would
+// not fit in the budget at full detail, see GeoTiffQuickItem::budgetedTileLevel().
+//
+// Images decoded outside the caches, for the image provider and the tile server, are charged for as
+// long as they are held (see Charge), so they make the caches give up tiles too. charge() and release()
+// may be called from any thread, eviction always runs on the GUI thread like the caches. Create the
+// budget on the GUI thread (see main.cpp).
+class MemoryBudget : public QObject
+{
+    Q_OBJECT
+
+public:
+    // Charges for bytes held by the enclosing scope.
+    class Charge
+    {
+    public:
+        explicit Charge(qint64 bytes);
+        ~Charge();
+        Q_DISABLE_COPY(Charge)
+
+    private:
+        qint64 m_bytes;
+    };
+
+    static MemoryBudget *instance();
+
+    inline qint64 maxBytes() const { return m_maxBytes; }
+    void setMaxBytes(qint64 maxBytes);
+    inline qint64 usedBytes() const { return m_usedBytes; }
+
+    void registerCache(TileCache *cache);
+    void unregisterCache(TileCache *cache);
+
+    // Stamp for a tile that was just used, later uses get higher stamps.
+    inline quint64 touch() { return ++m_lastUse; }
+    // Accounts for bytes taken on, evicting from the caches when over budget.
+    void charge(qint64 bytes);
+    // Accounts for bytes let go of.
+    inline void release(qint64 bytes) { m_usedBytes -= bytes; }
+
+private:
+    explicit MemoryBudget(QObject *parent);
+    void evict();
+
+private:
+    std::atomic<qint64> m_maxBytes;
+    std::atomic<qint64> m_usedBytes = 0;
+    quint64 m_lastUse = 0;
+    QList<TileCache*> m_caches;
+
+    inline static MemoryBudget *s_instance = nullptr;
+};
+
+#endif // MEMORYBUDGET_H
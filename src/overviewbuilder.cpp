@@ -0,0 +1,90 @@
+#include "overviewbuilder.h"
+#include <QtConcurrent>
+#include <QDebug>
+#include <gdal_priv.h>
+#include <cpl_vsi.h>
+
+// Overviews are generated down to the level where the larger side fits in this many pixels.
+static constexpr int s_smallestOverviewSize = 256;
+
+OverviewBuilder::OverviewBuilder(QObject *parent)
+    : QObject{parent}
+{
+    connect(&m_watcher, &QFutureWatcher<bool>::finished, this, [this]() {
+        bool success = m_watcher.result();
+        emit runningChanged();
+        emit finished(success);
+    });
+}
+
+OverviewBuilder::~OverviewBuilder()
+{
+    cancel();
+    m_watcher.waitForFinished();
+}
+
+bool OverviewBuilder::start(const QString &filePath)
+{
+    if (running())
+        return false;
+
+    m_filePath = filePath;
+    m_cancelRequested = false;
+    m_progress = 0;
+    emit progressChanged(0);
+
+    m_watcher.setFuture(QtConcurrent::run(&OverviewBuilder::build, this, filePath));
+    emit runningChanged();
+    return true;
+}
+
+void OverviewBuilder::cancel()
+{
+    m_cancelRequested = true;
+}
+
+bool OverviewBuilder::build(const QString &filePath)
+{
+    QByteArray path = filePath.toUtf8();
+    GDALDataset *dataset = static_cast<GDALDataset*>(GDALOpen(path.constData(), GA_ReadOnly));
+    if (!dataset) {
+        qWarning() << "Failed to open" << filePath << "for building overviews";
+        return false;
+    }
+
+    std::vector<int> levels;
+    int largestSide = std::max(dataset->GetRasterXSize(), dataset->GetRasterYSize());
+    for (int factor = 2; largestSide / (factor / 2) > s_smallestOverviewSize; factor *= 2)
+        levels.push_back(factor);
+
+    CPLErr err = CE_None;
+    if (!levels.empty()) {
+        qDebug() << "Building" << levels.size() << "overview levels for" << filePath;
+        // Opened read-only, so GDAL writes the pyramid to an external .ovr file next to the source.
+        err = dataset->BuildOverviews("AVERAGE", static_cast<int>(levels.size()), levels.data(), 0, nullptr,
+                                      &OverviewBuilder::progressCallback, this);
+    }
+    GDALClose(dataset);
+
+    // A cancel that arrives after the build completed keeps the finished pyramid
+    if (err == CE_None)
+        return true;
+
+    if (m_cancelRequested)
+        qDebug() << "Overview build for" << filePath << "cancelled";
+    else
+        qWarning() << "Failed to build overviews for" << filePath << ":" << CPLGetLastErrorMsg();
+    // Don't leave a half written pyramid behind, GDAL would pick it up next time the file is opened.
+    VSIUnlink((path + ".ovr").constData());
+    return false;
+}
+
+int CPL_STDCALL OverviewBuilder::progressCallback(double complete, const char *, void *userData)
+{
+    OverviewBuilder *builder = static_cast<OverviewBuilder*>(userData);
+    builder->m_progress = complete;
+    emit builder->progressChanged(complete);
+
+    // Returning FALSE makes GDAL abort the build.
+    return builder->m_cancelRequested ? FALSE : TRUE;
+}
@@ -0,0 +1,44 @@
+#ifndef OVERVIEWBUILDER_H
+#define OVERVIEWBUILDER_H
+
+#include <QObject>
+#include <QFutureWatcher>
+#include <atomic>
+#include <cpl_port.h>
+
+// Builds external (.ovr) overview pyramids for a GeoTIFF on a worker thread. GDAL is given its own
+// dataset handle for the build, so the caller can keep reading from its handle in the meantime and
+// reopen the file once finished() has been emitted to pick up the new overviews.
+class OverviewBuilder : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit OverviewBuilder(QObject *parent = nullptr);
+    ~OverviewBuilder();
+
+    bool start(const QString &filePath);
+    void cancel();
+
+    inline bool running() const { return m_watcher.isRunning(); }
+    inline qreal progress() const { return m_progress.load(); }
+    inline QString filePath() const { return m_filePath; }
+
+signals:
+    void runningChanged();
+    // Emitted from the worker thread; use queued (or auto) connections.
+    void progressChanged(qreal progress);
+    void finished(bool success);
+
+private:
+    bool build(const QString &filePath);
+    static int CPL_STDCALL progressCallback(double complete, const char *message, void *userData);
+
+private:
+    QString m_filePath;
+    QFutureWatcher<bool> m_watcher;
+    std::atomic<bool> m_cancelRequested = false;
+    std::atomic<qreal> m_progress = 0;
+};
+
+#endif // OVERVIEWBUILDER_H
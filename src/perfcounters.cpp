@@ -0,0 +1,194 @@
+#include "perfcounters.h"
+#include <QCoreApplication>
+#include <QFile>
+#include <QMutexLocker>
+#include <QThread>
+#include <QDebug>
+#include <algorithm>
+
+static constexpr int s_publishInterval = 1000;
+// Bounds the memory a forgotten trace can take, at about 32 bytes an event.
+static constexpr size_t s_maxTraceEvents = 4 * 1024 * 1024;
+
+static const char *stageName(PerfCounters::Stage stage)
+{
+    switch (stage) {
+    case PerfCounters::VisibleUpdate:
+        return "visible update";
+    case PerfCounters::Read:
+        return "read";
+    case PerfCounters::Conversion:
+        return "conversion";
+    case PerfCounters::Scaling:
+        return "scaling";
+    case PerfCounters::Upload:
+        return "upload";
+    case PerfCounters::Frame:
+        return "frame";
+    case PerfCounters::Warp:
+        return "warp";
+    case PerfCounters::Metadata:
+        return "metadata";
+    default:
+        return "unknown";
+    }
+}
+
+PerfCounters::Scope::Scope(Stage stage)
+    : m_stage(stage)
+    , m_start(PerfCounters::instance()->now())
+{
+}
+
+PerfCounters::Scope::~Scope()
+{
+    PerfCounters *counters = PerfCounters::instance();
+    counters->record(m_stage, m_start, counters->now() - m_start);
+}
+
+PerfCounters::PerfCounters(QObject *parent)
+    : QObject{parent}
+{
+    m_clock.start();
+    m_sincePublish.start();
+    m_publishTimer.setInterval(s_publishInterval);
+    connect(&m_publishTimer, &QTimer::timeout, this, &PerfCounters::publish);
+    m_publishTimer.start();
+}
+
+PerfCounters::~PerfCounters()
+{
+    if (m_tracing)
+        stopTrace();
+    s_singletonInstance = nullptr;
+}
+
+PerfCounters *PerfCounters::instance()
+{
+    if (s_singletonInstance == nullptr)
+        s_singletonInstance = new PerfCounters(qApp);
+    return s_singletonInstance;
+}
+
+PerfCounters *PerfCounters::create(QQmlEngine *, QJSEngine *engine)
+{
+    Q_ASSERT(s_singletonInstance);
+    Q_ASSERT(engine->thread() == s_singletonInstance->thread());
+    if (s_engine)
+        Q_ASSERT(engine == s_engine);
+    else
+        s_engine = engine;
+
+    QJSEngine::setObjectOwnership(s_singletonInstance, QJSEngine::CppOwnership);
+    return s_singletonInstance;
+}
+
+void PerfCounters::record(Stage stage, qint64 start, qint64 duration)
+{
+    m_totalNs[stage] += duration;
+    ++m_count[stage];
+
+    if (!m_tracing)
+        return;
+    QMutexLocker locker(&m_traceMutex);
+    if (m_traceEvents.size() < s_maxTraceEvents)
+        m_traceEvents.push_back({ stage, start, duration, quint64(quintptr(QThread::currentThreadId())) });
+    else
+        m_traceTruncated = true;
+}
+
+void PerfCounters::addBytesRead(qint64 bytes)
+{
+    m_bytesRead += bytes;
+}
+
+void PerfCounters::addCacheLookup(bool hit)
+{
+    ++(hit ? m_cacheHits : m_cacheMisses);
+}
+
+void PerfCounters::publish()
+{
+    // Averages keep their last value through intervals without samples, so rare stages stay readable
+    for (int i = 0; i < StageCount; ++i) {
+        qint64 count = m_count[i].exchange(0);
+        qint64 totalNs = m_totalNs[i].exchange(0);
+        if (count > 0)
+            m_averageMs[i] = totalNs / 1e6 / count;
+        if (i == Frame)
+            m_framesPerSecond = count * 1000.0 / std::max<qint64>(m_sincePublish.elapsed(), 1);
+        else if (i == Read)
+            m_tilesReadPerSecond = count * 1000.0 / std::max<qint64>(m_sincePublish.elapsed(), 1);
+    }
+    m_bytesReadPerSecond = m_bytesRead.exchange(0) * 1000.0 / std::max<qint64>(m_sincePublish.elapsed(), 1);
+    qint64 hits = m_cacheHits.exchange(0);
+    qint64 misses = m_cacheMisses.exchange(0);
+    if (hits + misses > 0)
+        m_tileCacheHitRate = double(hits) / (hits + misses);
+    m_sincePublish.restart();
+    emit countersChanged();
+}
+
+bool PerfCounters::startTrace(const QString &filePath)
+{
+    if (m_tracing)
+        stopTrace();
+
+    // Fail early rather than after collecting the whole trace
+    QFile file(filePath);
+    if (!file.open(QIODevice::WriteOnly)) {
+        qWarning() << "Failed to open trace file" << filePath << ":" << file.errorString();
+        return false;
+    }
+
+    QMutexLocker locker(&m_traceMutex);
+    m_traceFile = filePath;
+    m_traceEvents.clear();
+    m_traceTruncated = false;
+    m_tracing = true;
+    locker.unlock();
+    qDebug() << "Tracing to" << filePath;
+    emit tracingChanged();
+    return true;
+}
+
+bool PerfCounters::stopTrace()
+{
+    if (!m_tracing)
+        return false;
+
+    QMutexLocker locker(&m_traceMutex);
+    m_tracing = false;
+    std::vector<TraceEvent> events;
+    events.swap(m_traceEvents);
+    QString filePath = m_traceFile;
+    bool truncated = m_traceTruncated;
+    locker.unlock();
+    emit tracingChanged();
+
+    QFile file(filePath);
+    if (!file.open(QIODevice::WriteOnly)) {
+        qWarning() << "Failed to write trace file" << filePath << ":" << file.errorString();
+        return false;
+    }
+    // Trace event timestamps and durations are in microseconds
+    QByteArray json = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    for (size_t i = 0; i < events.size(); ++i) {
+        const TraceEvent &event = events[i];
+        json += QByteArray("{\"name\":\"") + stageName(event.stage) + "\",\"cat\":\"geotiff\",\"ph\":\"X\",\"ts\":"
+                + QByteArray::number(event.start / 1000.0, 'f', 3) + ",\"dur\":"
+                + QByteArray::number(event.duration / 1000.0, 'f', 3) + ",\"pid\":1,\"tid\":"
+                + QByteArray::number(event.thread) + "}" + (i + 1 < events.size() ? ",\n" : "\n");
+        // Keep the buffer small for long traces
+        if (json.size() > 1024 * 1024) {
+            file.write(json);
+            json.clear();
+        }
+    }
+    json += "]}\n";
+    file.write(json);
+    if (truncated)
+        qWarning() << "Trace" << filePath << "was truncated at" << s_maxTraceEvents << "events";
+    qDebug() << "Wrote" << events.size() << "trace events to" << filePath;
+    return file.error() == QFile::NoError;
+}
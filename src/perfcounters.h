@@ -0,0 +1,136 @@
+#ifndef PERFCOUNTERS_H
+#define PERFCOUNTERS_H
+
+#include <QObject>
+#include <QQmlEngine>
+#include <QElapsedTimer>
+#include <QMutex>
+#include <QTimer>
+#include <atomic>
+#include <vector>
+
+// Timings of the render and I/O stages, from any thread. Totals are published once a second as
+// per-call averages and rates for a QML HUD, and while tracing every sample is also kept as a Chrome
+// trace event ("ph": "X") and written to a JSON file that chrome://tracing or Perfetto can open.
+//
+// Create it on the main thread (see main.cpp) before any worker records to it.
+class PerfCounters : public QObject
+{
+    Q_OBJECT
+    QML_SINGLETON
+    QML_ELEMENT
+    Q_PROPERTY(double visibleUpdateMs READ visibleUpdateMs NOTIFY countersChanged)
+    Q_PROPERTY(double readMs READ readMs NOTIFY countersChanged)
+    Q_PROPERTY(double conversionMs READ conversionMs NOTIFY countersChanged)
+    Q_PROPERTY(double scalingMs READ scalingMs NOTIFY countersChanged)
+    Q_PROPERTY(double uploadMs READ uploadMs NOTIFY countersChanged)
+    Q_PROPERTY(double frameMs READ frameMs NOTIFY countersChanged)
+    Q_PROPERTY(double warpMs READ warpMs NOTIFY countersChanged)
+    Q_PROPERTY(double metadataMs READ metadataMs NOTIFY countersChanged)
+    Q_PROPERTY(double framesPerSecond READ framesPerSecond NOTIFY countersChanged)
+    Q_PROPERTY(double tilesReadPerSecond READ tilesReadPerSecond NOTIFY countersChanged)
+    Q_PROPERTY(double bytesReadPerSecond READ bytesReadPerSecond NOTIFY countersChanged)
+    Q_PROPERTY(double tileCacheHitRate READ tileCacheHitRate NOTIFY countersChanged)
+    Q_PROPERTY(bool tracing READ tracing NOTIFY tracingChanged)
+
+public:
+    enum Stage {
+        VisibleUpdate,  // Working out the visible window and wanted tiles after the map moved
+        Read,           // GDAL RasterIO of a tile, including GDAL's resampling when decimating
+        Conversion,     // Contrast stretch of non-Byte samples to 8 bits
+        Scaling,        // Resampling of a read overview level to the tile size by the Resampler
+        Upload,         // Creating a texture from a decoded tile
+        Frame,          // The overlay's updatePaintNode()
+        Warp,           // Warping a Web Mercator tile for the tile server
+        Metadata,       // Opening a file and reading its metadata
+        StageCount
+    };
+    Q_ENUM(Stage)
+
+    // Times the enclosing scope.
+    class Scope
+    {
+    public:
+        explicit Scope(Stage stage);
+        ~Scope();
+        Q_DISABLE_COPY(Scope)
+
+    private:
+        Stage m_stage;
+        qint64 m_start;
+    };
+
+    static PerfCounters *instance();
+    static PerfCounters *create(QQmlEngine *, QJSEngine *engine);
+    ~PerfCounters();
+
+    // Nanoseconds on the clock samples are timed with.
+    inline qint64 now() const { return m_clock.nsecsElapsed(); }
+    void record(Stage stage, qint64 start, qint64 duration);
+    // Bytes of samples GDAL delivered for a read, after decompression.
+    void addBytesRead(qint64 bytes);
+    void addCacheLookup(bool hit);
+
+    inline double visibleUpdateMs() const { return m_averageMs[VisibleUpdate]; }
+    inline double readMs() const { return m_averageMs[Read]; }
+    inline double conversionMs() const { return m_averageMs[Conversion]; }
+    inline double scalingMs() const { return m_averageMs[Scaling]; }
+    inline double uploadMs() const { return m_averageMs[Upload]; }
+    inline double frameMs() const { return m_averageMs[Frame]; }
+    inline double warpMs() const { return m_averageMs[Warp]; }
+    inline double metadataMs() const { return m_averageMs[Metadata]; }
+    inline double framesPerSecond() const { return m_framesPerSecond; }
+    inline double tilesReadPerSecond() const { return m_tilesReadPerSecond; }
+    inline double bytesReadPerSecond() const { return m_bytesReadPerSecond; }
+    inline double tileCacheHitRate() const { return m_tileCacheHitRate; }
+
+    inline bool tracing() const { return m_tracing; }
+    // Events are collected in memory until stopTrace() writes them to filePath.
+    Q_INVOKABLE bool startTrace(const QString &filePath);
+    Q_INVOKABLE bool stopTrace();
+
+signals:
+    void countersChanged();
+    void tracingChanged();
+
+private:
+    explicit PerfCounters(QObject *parent);
+    void publish();
+
+private:
+    struct TraceEvent
+    {
+        Stage stage;
+        qint64 start;
+        qint64 duration;
+        quint64 thread;
+    };
+
+    QElapsedTimer m_clock;
+    QTimer m_publishTimer;
+    QElapsedTimer m_sincePublish;
+
+    // Accumulated since the last publish()
+    std::atomic<qint64> m_totalNs[StageCount] = {};
+    std::atomic<qint64> m_count[StageCount] = {};
+    std::atomic<qint64> m_bytesRead = 0;
+    std::atomic<qint64> m_cacheHits = 0;
+    std::atomic<qint64> m_cacheMisses = 0;
+
+    double m_averageMs[StageCount] = {};
+    double m_framesPerSecond = 0;
+    double m_tilesReadPerSecond = 0;
+    double m_bytesReadPerSecond = 0;
+    double m_tileCacheHitRate = 0;
+
+    std::atomic<bool> m_tracing = false;
+    QMutex m_traceMutex;
+    QString m_traceFile;
+    std::vector<TraceEvent> m_traceEvents;
+    bool m_traceTruncated = false;
+
+    inline static PerfCounters *s_singletonInstance = nullptr;
+    inline static QJSEngine *s_engine = nullptr;
+};
+
+#endif // PERFCOUNTERS_H
@@ -0,0 +1,352 @@
+#include "pixelconvert.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define PIXELCONVERT_SSE2
+#include <emmintrin.h>
+#endif
+
+// The AVX2 kernels are compiled with a target attribute and chosen at runtime, so the binary still
+// runs on CPUs without AVX2.
+#if defined(PIXELCONVERT_SSE2) && (defined(__GNUC__) || defined(__clang__))
+#define PIXELCONVERT_AVX2
+#include <immintrin.h>
+#define PIXELCONVERT_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+ChannelStretch ChannelStretch::fromRange(double min, double max)
+{
+    ChannelStretch stretch;
+    if (max > min) {
+        stretch.scale = float(255.0 / (max - min));
+        stretch.offset = float(-min * 255.0 / (max - min));
+    } else {
+        stretch.scale = 0.0f;
+        stretch.offset = 0.0f;
+    }
+    return stretch;
+}
+
+ChannelStretch ChannelStretch::constant(uint8_t value)
+{
+    ChannelStretch stretch;
+    stretch.scale = 0.0f;
+    stretch.offset = value;
+    return stretch;
+}
+
+template <typename T>
+static void toByteScalarImpl(const T *src, uint8_t *dst, size_t pixelCount, int channels, const ChannelStretch *stretch)
+{
+    for (size_t p = 0; p < pixelCount; ++p) {
+        for (int c = 0; c < channels; ++c) {
+            const ChannelStretch &s = stretch[c];
+            float value = float(*src++);
+            float out = 0.0f;
+            if (!std::isnan(value) && !(s.hasNoData && value == s.noData)) {
+                out = value * s.scale + s.offset;
+                // Written so that NaN (e.g. from inf * 0) ends up as 0, like the vector versions
+                out = out > 0.0f ? out : 0.0f;
+                out = out < 255.0f ? out : 255.0f;
+            }
+            *dst++ = uint8_t(std::nearbyint(out));
+        }
+    }
+}
+
+#ifdef PIXELCONVERT_SSE2
+// Per-lane stretch parameters. A vector always starts at a pixel boundary, so lane k uses the
+// parameters of channel k % channels.
+struct LaneParams
+{
+    float scale[8];
+    float offset[8];
+    float noData[8];
+
+    LaneParams(int channels, const ChannelStretch *stretch)
+    {
+        for (int k = 0; k < 8; ++k) {
+            const ChannelStretch &s = stretch[k % channels];
+            scale[k] = s.scale;
+            offset[k] = s.offset;
+            // NaN never compares equal, so channels without nodata never match
+            noData[k] = s.hasNoData ? s.noData : std::numeric_limits<float>::quiet_NaN();
+        }
+    }
+};
+
+static inline void load16(const float *src, __m128 v[4])
+{
+    for (int i = 0; i < 4; ++i)
+        v[i] = _mm_loadu_ps(src + 4 * i);
+}
+
+static inline void load16(const uint16_t *src, __m128 v[4])
+{
+    const __m128i zero = _mm_setzero_si128();
+    for (int i = 0; i < 2; ++i) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 8 * i));
+        v[2 * i] = _mm_cvtepi32_ps(_mm_unpacklo_epi16(x, zero));
+        v[2 * i + 1] = _mm_cvtepi32_ps(_mm_unpackhi_epi16(x, zero));
+    }
+}
+
+static inline void load16(const int16_t *src, __m128 v[4])
+{
+    for (int i = 0; i < 2; ++i) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 8 * i));
+        // Put each value in the upper half of a 32 bit lane and shift it back down, sign extending
+        v[2 * i] = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16));
+        v[2 * i + 1] = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16));
+    }
+}
+
+static inline void load16(const uint32_t *src, __m128 v[4])
+{
+    // There is no unsigned conversion before AVX-512, so convert the 16 bit halves separately. Both are
+    // exact, as is the scaling, so the sum is rounded once just like a scalar conversion.
+    const __m128i lowMask = _mm_set1_epi32(0xffff);
+    const __m128 halfScale = _mm_set1_ps(65536.0f);
+    for (int i = 0; i < 4; ++i) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 4 * i));
+        __m128 high = _mm_cvtepi32_ps(_mm_srli_epi32(x, 16));
+        __m128 low = _mm_cvtepi32_ps(_mm_and_si128(x, lowMask));
+        v[i] = _mm_add_ps(_mm_mul_ps(high, halfScale), low);
+    }
+}
+
+static inline __m128i stretch4(__m128 v, __m128 scale, __m128 offset, __m128 noData)
+{
+    __m128 invalid = _mm_or_ps(_mm_cmpunord_ps(v, v), _mm_cmpeq_ps(v, noData));
+    __m128 out = _mm_add_ps(_mm_mul_ps(v, scale), offset);
+    // maxps returns its second operand when the first is NaN
+    out = _mm_min_ps(_mm_max_ps(out, _mm_setzero_ps()), _mm_set1_ps(255.0f));
+    out = _mm_andnot_ps(invalid, out);
+    return _mm_cvtps_epi32(out);
+}
+
+template <typename T>
+static void toByteSse2(const T *src, uint8_t *dst, size_t pixelCount, int channels, const ChannelStretch *stretch)
+{
+    LaneParams params(channels, stretch);
+    const __m128 scale = _mm_loadu_ps(params.scale);
+    const __m128 offset = _mm_loadu_ps(params.offset);
+    const __m128 noData = _mm_loadu_ps(params.noData);
+
+    size_t count = pixelCount * channels;
+    size_t vectorEnd = count & ~size_t(15);
+    for (size_t i = 0; i < vectorEnd; i += 16) {
+        __m128 v[4];
+        load16(src + i, v);
+        __m128i ab = _mm_packs_epi32(stretch4(v[0], scale, offset, noData), stretch4(v[1], scale, offset, noData));
+        __m128i cd = _mm_packs_epi32(stretch4(v[2], scale, offset, noData), stretch4(v[3], scale, offset, noData));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_packus_epi16(ab, cd));
+    }
+
+    // 16 is a multiple of the channel count, so the rest starts on a pixel boundary
+    toByteScalarImpl(src + vectorEnd, dst + vectorEnd, (count - vectorEnd) / channels, channels, stretch);
+}
+#endif // PIXELCONVERT_SSE2
+
+#ifdef PIXELCONVERT_AVX2
+PIXELCONVERT_TARGET_AVX2 static inline void load32(const float *src, __m256 v[4])
+{
+    for (int i = 0; i < 4; ++i)
+        v[i] = _mm256_loadu_ps(src + 8 * i);
+}
+
+PIXELCONVERT_TARGET_AVX2 static inline void load32(const uint16_t *src, __m256 v[4])
+{
+    for (int i = 0; i < 4; ++i) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 8 * i));
+        v[i] = _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(x));
+    }
+}
+
+PIXELCONVERT_TARGET_AVX2 static inline void load32(const int16_t *src, __m256 v[4])
+{
+    for (int i = 0; i < 4; ++i) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 8 * i));
+        v[i] = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(x));
+    }
+}
+
+PIXELCONVERT_TARGET_AVX2 static inline void load32(const uint32_t *src, __m256 v[4])
+{
+    const __m256i lowMask = _mm256_set1_epi32(0xffff);
+    const __m256 halfScale = _mm256_set1_ps(65536.0f);
+    for (int i = 0; i < 4; ++i) {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + 8 * i));
+        __m256 high = _mm256_cvtepi32_ps(_mm256_srli_epi32(x, 16));
+        __m256 low = _mm256_cvtepi32_ps(_mm256_and_si256(x, lowMask));
+        v[i] = _mm256_add_ps(_mm256_mul_ps(high, halfScale), low);
+    }
+}
+
+PIXELCONVERT_TARGET_AVX2 static inline __m256i stretch8(__m256 v, __m256 scale, __m256 offset, __m256 noData)
+{
+    __m256 invalid = _mm256_or_ps(_mm256_cmp_ps(v, v, _CMP_UNORD_Q), _mm256_cmp_ps(v, noData, _CMP_EQ_OQ));
+    __m256 out = _mm256_add_ps(_mm256_mul_ps(v, scale), offset);
+    out = _mm256_min_ps(_mm256_max_ps(out, _mm256_setzero_ps()), _mm256_set1_ps(255.0f));
+    out = _mm256_andnot_ps(invalid, out);
+    return _mm256_cvtps_epi32(out);
+}
+
+template <typename T>
+PIXELCONVERT_TARGET_AVX2 static void toByteAvx2(const T *src, uint8_t *dst, size_t pixelCount, int channels, const ChannelStretch *stretch)
+{
+    LaneParams params(channels, stretch);
+    const __m256 scale = _mm256_loadu_ps(params.scale);
+    const __m256 offset = _mm256_loadu_ps(params.offset);
+    const __m256 noData = _mm256_loadu_ps(params.noData);
+    // The packs work within 128 bit lanes; this puts the 4 byte groups back in order
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+
+    size_t count = pixelCount * channels;
+    size_t vectorEnd = count & ~size_t(31);
+    for (size_t i = 0; i < vectorEnd; i += 32) {
+        __m256 v[4];
+        load32(src + i, v);
+        __m256i ab = _mm256_packs_epi32(stretch8(v[0], scale, offset, noData), stretch8(v[1], scale, offset, noData));
+        __m256i cd = _mm256_packs_epi32(stretch8(v[2], scale, offset, noData), stretch8(v[3], scale, offset, noData));
+        __m256i bytes = _mm256_permutevar8x32_epi32(_mm256_packus_epi16(ab, cd), order);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), bytes);
+    }
+
+    toByteSse2(src + vectorEnd, dst + vectorEnd, (count - vectorEnd) / channels, channels, stretch);
+}
+
+PIXELCONVERT_TARGET_AVX2 static void expandPaletteAvx2(const uint8_t *src, uint32_t *dst, size_t count, const uint32_t *lut)
+{
+    size_t vectorEnd = count & ~size_t(7);
+    for (size_t i = 0; i < vectorEnd; i += 8) {
+        __m128i indices = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(src + i));
+        __m256i entries = _mm256_i32gather_epi32(reinterpret_cast<const int*>(lut), _mm256_cvtepu8_epi32(indices), 4);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), entries);
+    }
+    for (size_t i = vectorEnd; i < count; ++i)
+        dst[i] = lut[src[i]];
+}
+
+static bool hasAvx2()
+{
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+    return avx2;
+}
+#endif // PIXELCONVERT_AVX2
+
+template <typename T>
+static void toByteImpl(const T *src, uint8_t *dst, size_t pixelCount, int channels, const ChannelStretch *stretch)
+{
+#if defined(PIXELCONVERT_AVX2)
+    if (hasAvx2()) {
+        toByteAvx2(src, dst, pixelCount, channels, stretch);
+        return;
+    }
+#endif
+#if defined(PIXELCONVERT_SSE2)
+    toByteSse2(src, dst, pixelCount, channels, stretch);
+#else
+    toByteScalarImpl(src, dst, pixelCount, channels, stretch);
+#endif
+}
+
+void PixelConvert::toByte(const uint16_t *src, uint8_t *dst, size_t pixelCount, int channels, const ChannelStretch *stretch)
+{
+    toByteImpl(src, dst, pixelCount, channels, stretch);
+}
+
+void PixelConvert::toByte(const int16_t *src, uint8_t *dst, size_t pixelCount, int channels, const ChannelStretch *stretch)
+{
+    toByteImpl(src, dst, pixelCount, channels, stretch);
+}
+
+void PixelConvert::toByte(const uint32_t *src, uint8_t *dst, size_t pixelCount, int channels, const ChannelStretch *stretch)
+{
+    toByteImpl(src, dst, pixelCount, channels, stretch);
+}
+
+void PixelConvert::toByte(const float *src, uint8_t *dst, size_t pixelCount, int channels, const ChannelStretch *stretch)
+{
+    toByteImpl(src, dst, pixelCount, channels, stretch);
+}
+
+void PixelConvert::toByteScalar(const uint16_t *src, uint8_t *dst, size_t pixelCount, int channels, const ChannelStretch *stretch)
+{
+    toByteScalarImpl(src, dst, pixelCount, channels, stretch);
+}
+
+void PixelConvert::toByteScalar(const int16_t *src, uint8_t *dst, size_t pixelCount, int channels, const ChannelStretch *stretch)
+{
+    toByteScalarImpl(src, dst, pixelCount, channels, stretch);
+}
+
+void PixelConvert::toByteScalar(const uint32_t *src, uint8_t *dst, size_t pixelCount, int channels, const ChannelStretch *stretch)
+{
+    toByteScalarImpl(src, dst, pixelCount, channels, stretch);
+}
+
+void PixelConvert::toByteScalar(const float *src, uint8_t *dst, size_t pixelCount, int channels, const ChannelStretch *stretch)
+{
+    toByteScalarImpl(src, dst, pixelCount, channels, stretch);
+}
+
+void PixelConvert::expandPalette(const uint8_t *src, uint32_t *dst, size_t count, const uint32_t *lut)
+{
+#if defined(PIXELCONVERT_AVX2)
+    if (hasAvx2()) {
+        expandPaletteAvx2(src, dst, count, lut);
+        return;
+    }
+#endif
+    // SSE2 has no gather, so this is the scalar loop
+    expandPaletteScalar(src, dst, count, lut);
+}
+
+void PixelConvert::expandPaletteScalar(const uint8_t *src, uint32_t *dst, size_t count, const uint32_t *lut)
+{
+    for (size_t i = 0; i < count; ++i)
+        dst[i] = lut[src[i]];
+}
+
+void PixelConvert::applyMask(uint8_t *rgba, const uint8_t *mask, size_t pixelCount)
+{
+    size_t i = 0;
+#if defined(PIXELCONVERT_SSE2)
+    // Each mask byte is moved to the alpha byte of its pixel, with the colour bytes at 0xff so that the
+    // unsigned minimum leaves them alone
+    const __m128i colour = _mm_set1_epi32(0x00ffffff);
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 4 <= pixelCount; i += 4) {
+        uint32_t maskBytes;
+        std::memcpy(&maskBytes, mask + i, sizeof(maskBytes));
+        __m128i alpha = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(int(maskBytes)), zero), zero);
+        __m128i limit = _mm_or_si128(_mm_slli_epi32(alpha, 24), colour);
+        __m128i *pixels = reinterpret_cast<__m128i*>(rgba + i * 4);
+        _mm_storeu_si128(pixels, _mm_min_epu8(_mm_loadu_si128(pixels), limit));
+    }
+#endif
+    applyMaskScalar(rgba + i * 4, mask + i, pixelCount - i);
+}
+
+void PixelConvert::applyMaskScalar(uint8_t *rgba, const uint8_t *mask, size_t pixelCount)
+{
+    for (size_t i = 0; i < pixelCount; ++i)
+        rgba[i * 4 + 3] = std::min(rgba[i * 4 + 3], mask[i]);
+}
+
+const char *PixelConvert::simdLevel()
+{
+#if defined(PIXELCONVERT_AVX2)
+    if (hasAvx2())
+        return "AVX2";
+#endif
+#if defined(PIXELCONVERT_SSE2)
+    return "SSE2";
+#else
+    return "scalar";
+#endif
+}
@@ -0,0 +1,53 @@
+#ifndef PIXELCONVERT_H
+#define PIXELCONVERT_H
+
+#include <cstddef>
+#include <cstdint>
+
+// Linear contrast stretch of one channel to 8 bits: out = clamp(round(value * scale + offset), 0, 255).
+// Values equal to noData, and NaNs, map to 0.
+struct ChannelStretch
+{
+    float scale = 1.0f;
+    float offset = 0.0f;
+    bool hasNoData = false;
+    float noData = 0.0f;
+
+    // Maps [min, max] onto [0, 255].
+    static ChannelStretch fromRange(double min, double max);
+    // Ignores the input and always gives value, e.g. for an opaque alpha channel.
+    static ChannelStretch constant(uint8_t value);
+};
+
+// Kernels converting pixel interleaved UInt16, Int16, UInt32 and Float32 samples to 8 bits, applying
+// a per-channel stretch. channels must be 1 or 4; src holds pixelCount * channels samples and dst
+// receives as many bytes. The vectorized versions (SSE2, and AVX2 when the CPU has it) give the same
+// results as the scalar reference ones.
+class PixelConvert
+{
+public:
+    static void toByte(const uint16_t *src, uint8_t *dst, size_t pixelCount, int channels, const ChannelStretch *stretch);
+    static void toByte(const int16_t *src, uint8_t *dst, size_t pixelCount, int channels, const ChannelStretch *stretch);
+    static void toByte(const uint32_t *src, uint8_t *dst, size_t pixelCount, int channels, const ChannelStretch *stretch);
+    static void toByte(const float *src, uint8_t *dst, size_t pixelCount, int channels, const ChannelStretch *stretch);
+
+    static void toByteScalar(const uint16_t *src, uint8_t *dst, size_t pixelCount, int channels, const ChannelStretch *stretch);
+    static void toByteScalar(const int16_t *src, uint8_t *dst, size_t pixelCount, int channels, const ChannelStretch *stretch);
+    static void toByteScalar(const uint32_t *src, uint8_t *dst, size_t pixelCount, int channels, const ChannelStretch *stretch);
+    static void toByteScalar(const float *src, uint8_t *dst, size_t pixelCount, int channels, const ChannelStretch *stretch);
+
+    // Palette lookup: dst[i] = lut[src[i]] for count pixels, with a 256 entry lut. The AVX2 version
+    // gathers 8 entries at a time.
+    static void expandPalette(const uint8_t *src, uint32_t *dst, size_t count, const uint32_t *lut);
+    static void expandPaletteScalar(const uint8_t *src, uint32_t *dst, size_t count, const uint32_t *lut);
+
+    // Mask to alpha: the alpha byte of each of the pixelCount RGBA pixels in rgba becomes the smaller of
+    // itself and mask[i], so masked out pixels turn transparent and partly covered ones translucent.
+    static void applyMask(uint8_t *rgba, const uint8_t *mask, size_t pixelCount);
+    static void applyMaskScalar(uint8_t *rgba, const uint8_t *mask, size_t pixelCount);
+
+    // Name of the widest instruction set the kernels use on this CPU.
+    static const char *simdLevel();
+};
+
+#endif // PIXELCONVERT_H
@@ -0,0 +1,369 @@
+#include "rangecache.h"
+#include <QCoreApplication>
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QDebug>
+#include <QDir>
+#include <QDirIterator>
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QStandardPaths>
+#include <algorithm>
+#include <cstring>
+#include <set>
+#include <cpl_conv.h>
+
+static const char *s_prefix = "/vsirangecache/";
+// Ranges are cached in chunks of this size, aligned to it. Large enough to keep the number of files down,
+// small enough that reading one block of a COG doesn't pull in much more than the block.
+static constexpr qint64 s_chunkSize = 64 * 1024;
+static constexpr qint64 s_defaultMaxBytes = qint64(1024) * 1024 * 1024;
+// GDAL keeps an in-memory cache of this size in front of every open file, for the many small reads of
+// TIFF headers that would otherwise each open a chunk file.
+static constexpr size_t s_memoryCacheSize = 4 * 1024 * 1024;
+
+struct RangeCache::File
+{
+    RangeCache *cache = nullptr;
+    VSILFILE *remote = nullptr;
+    QString directory;
+    vsi_l_offset size = 0;
+    vsi_l_offset position = 0;
+    bool eof = false;
+};
+
+static QString chunkPath(const QString &directory, qint64 chunk)
+{
+    return QString("%1/%2.chunk").arg(directory).arg(chunk);
+}
+
+static void appendChunks(QList<qint64> &indices, vsi_l_offset offset, size_t length)
+{
+    if (length == 0)
+        return;
+    for (qint64 chunk = offset / s_chunkSize; chunk <= qint64((offset + length - 1) / s_chunkSize); ++chunk)
+        indices.append(chunk);
+}
+
+// Copies bytes offset to offset + length out of chunks, which must hold all of them.
+static bool copyChunks(const QHash<qint64, QByteArray> &chunks, vsi_l_offset offset, size_t length, char *out)
+{
+    vsi_l_offset end = offset + length;
+    for (vsi_l_offset position = offset; position < end;) {
+        qint64 chunk = position / s_chunkSize;
+        vsi_l_offset chunkStart = vsi_l_offset(chunk) * s_chunkSize;
+        auto it = chunks.constFind(chunk);
+        if (it == chunks.cend())
+            return false;
+        vsi_l_offset chunkEnd = std::min<vsi_l_offset>(end, chunkStart + it->size());
+        if (chunkEnd <= position)
+            return false;
+        std::memcpy(out + (position - offset), it->constData() + (position - chunkStart), chunkEnd - position);
+        position = chunkEnd;
+    }
+    return true;
+}
+
+RangeCache::RangeCache(QObject *parent)
+    : QObject{parent}
+    , m_directory(QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + "/ranges")
+    , m_maxBytes(s_defaultMaxBytes)
+{
+    QDir().mkpath(m_directory);
+    qint64 usedBytes = 0;
+    QDirIterator it(m_directory, { "*.chunk" }, QDir::Files, QDirIterator::Subdirectories);
+    while (it.hasNext())
+        usedBytes += it.nextFileInfo().size();
+    m_usedBytes = usedBytes;
+    install();
+}
+
+RangeCache::~RangeCache()
+{
+    s_instance = nullptr;
+}
+
+RangeCache *RangeCache::instance()
+{
+    if (s_instance == nullptr)
+        s_instance = new RangeCache(qApp);
+    return s_instance;
+}
+
+bool RangeCache::isRemote(const QString &source)
+{
+    return source.startsWith("http://", Qt::CaseInsensitive) || source.startsWith("https://", Qt::CaseInsensitive)
+           || source.startsWith("/vsicurl/");
+}
+
+QString RangeCache::gdalPath(const QString &source)
+{
+    if (!isRemote(source))
+        return source;
+    return s_prefix + (source.startsWith("/vsicurl/") ? source : "/vsicurl/" + source);
+}
+
+void RangeCache::setMaxBytes(qint64 maxBytes)
+{
+    m_maxBytes = maxBytes;
+    if (m_usedBytes > m_maxBytes)
+        trim();
+}
+
+void RangeCache::install()
+{
+    VSIFilesystemPluginCallbacksStruct *callbacks = VSIAllocFilesystemPluginCallbacksStruct();
+    callbacks->pUserData = this;
+    callbacks->stat = &RangeCache::vsiStat;
+    callbacks->read_dir = &RangeCache::vsiReadDir;
+    callbacks->open = &RangeCache::vsiOpen;
+    callbacks->tell = &RangeCache::vsiTell;
+    callbacks->seek = &RangeCache::vsiSeek;
+    callbacks->read = &RangeCache::vsiRead;
+    callbacks->read_multi_range = &RangeCache::vsiReadMultiRange;
+    callbacks->eof = &RangeCache::vsiEof;
+    callbacks->close = &RangeCache::vsiClose;
+    callbacks->nCacheSize = s_memoryCacheSize;
+    if (VSIInstallPluginHandler(s_prefix, callbacks) != 0)
+        qWarning() << "Failed to install the" << s_prefix << "filesystem handler, remote files can't be opened";
+    VSIFreeFilesystemPluginCallbacksStruct(callbacks);
+}
+
+bool RangeCache::chunks(File *file, const QList<qint64> &indices, QHash<qint64, QByteArray> &data)
+{
+    // Chunks on disk are marked as used by their modification time, trim() removes the oldest first
+    std::set<qint64> missing;
+    for (qint64 chunk : indices) {
+        if (data.contains(chunk))
+            continue;
+        qint64 expected = std::min<qint64>(s_chunkSize, qint64(file->size) - chunk * s_chunkSize);
+        QFile chunkFile(chunkPath(file->directory, chunk));
+        if (chunkFile.open(QIODevice::ReadOnly)) {
+            QByteArray bytes = chunkFile.readAll();
+            if (bytes.size() == expected) {
+                chunkFile.setFileTime(QDateTime::currentDateTime(), QFileDevice::FileModificationTime);
+                data.insert(chunk, bytes);
+                continue;
+            }
+        }
+        missing.insert(chunk);
+    }
+    if (missing.empty())
+        return true;
+
+    // Consecutive missing chunks are fetched as one range, all ranges with one multi-range read
+    std::vector<qint64> runStarts;
+    std::vector<vsi_l_offset> offsets;
+    std::vector<size_t> sizes;
+    for (qint64 chunk : missing) {
+        vsi_l_offset start = vsi_l_offset(chunk) * s_chunkSize;
+        size_t size = std::min<vsi_l_offset>(s_chunkSize, file->size - start);
+        if (!offsets.empty() && offsets.back() + sizes.back() == start) {
+            sizes.back() += size;
+        } else {
+            runStarts.push_back(chunk);
+            offsets.push_back(start);
+            sizes.push_back(size);
+        }
+    }
+    std::vector<QByteArray> buffers(offsets.size());
+    std::vector<void *> pointers(offsets.size());
+    for (size_t i = 0; i < offsets.size(); ++i) {
+        buffers[i].resize(qsizetype(sizes[i]));
+        pointers[i] = buffers[i].data();
+    }
+    if (VSIFReadMultiRangeL(int(offsets.size()), pointers.data(), offsets.data(), sizes.data(), file->remote) != 0)
+        return false;
+
+    for (size_t i = 0; i < buffers.size(); ++i) {
+        for (qsizetype from = 0, chunk = runStarts[i]; from < buffers[i].size(); from += s_chunkSize, ++chunk) {
+            QByteArray bytes = buffers[i].mid(from, s_chunkSize);
+            store(file, chunk, bytes);
+            data.insert(chunk, bytes);
+        }
+    }
+    return true;
+}
+
+bool RangeCache::copyRange(File *file, vsi_l_offset offset, size_t length, char *out)
+{
+    QList<qint64> indices;
+    appendChunks(indices, offset, length);
+    QHash<qint64, QByteArray> data;
+    return chunks(file, indices, data) && copyChunks(data, offset, length, out);
+}
+
+void RangeCache::store(File *file, qint64 chunk, const QByteArray &data)
+{
+    // Another thread may have stored the same chunk meanwhile, it is replaced rather than added
+    QString path = chunkPath(file->directory, chunk);
+    QFileInfo previous(path);
+    qint64 previousBytes = previous.exists() ? previous.size() : 0;
+    QSaveFile chunkFile(path);
+    if (!chunkFile.open(QIODevice::WriteOnly) || chunkFile.write(data) != data.size() || !chunkFile.commit())
+        return;
+    m_usedBytes += data.size() - previousBytes;
+    if (m_usedBytes > m_maxBytes)
+        trim();
+}
+
+void RangeCache::drop(const QString &directory)
+{
+    qint64 bytes = 0;
+    QDirIterator it(directory, { "*.chunk" }, QDir::Files);
+    while (it.hasNext())
+        bytes += it.nextFileInfo().size();
+    QDir(directory).removeRecursively();
+    m_usedBytes -= bytes;
+}
+
+void RangeCache::trim()
+{
+    // Another thread is already at it
+    if (!m_trimMutex.tryLock())
+        return;
+
+    QList<QFileInfo> chunkFiles;
+    qint64 usedBytes = 0;
+    QDirIterator it(m_directory, { "*.chunk" }, QDir::Files, QDirIterator::Subdirectories);
+    while (it.hasNext()) {
+        chunkFiles.append(it.nextFileInfo());
+        usedBytes += chunkFiles.last().size();
+    }
+    std::sort(chunkFiles.begin(), chunkFiles.end(), [](const QFileInfo &a, const QFileInfo &b) {
+        return a.lastModified() < b.lastModified();
+    });
+
+    // Down to 90%, so that not every chunk stored afterwards has to trim again
+    qint64 target = m_maxBytes / 10 * 9;
+    for (const QFileInfo &info : std::as_const(chunkFiles)) {
+        if (usedBytes <= target)
+            break;
+        if (QFile::remove(info.filePath()))
+            usedBytes -= info.size();
+    }
+    m_usedBytes = usedBytes;
+    m_trimMutex.unlock();
+}
+
+int RangeCache::vsiStat(void *, const char *filename, VSIStatBufL *statBuf, int flags)
+{
+    return VSIStatExL(filename + strlen(s_prefix), statBuf, flags);
+}
+
+char **RangeCache::vsiReadDir(void *, const char *, int)
+{
+    // An empty listing rather than none, otherwise GDAL asks the server for every sidecar file (.ovr,
+    // .aux.xml, .msk, ...) a driver might look for
+    return static_cast<char **>(CPLCalloc(1, sizeof(char *)));
+}
+
+void *RangeCache::vsiOpen(void *userData, const char *filename, const char *access)
+{
+    if (strpbrk(access, "wa+"))
+        return nullptr;
+
+    const char *remotePath = filename + strlen(s_prefix);
+    VSIStatBufL statBuf;
+    if (VSIStatExL(remotePath, &statBuf, VSI_STAT_EXISTS_FLAG | VSI_STAT_SIZE_FLAG) != 0)
+        return nullptr;
+    VSILFILE *remote = VSIFOpenL(remotePath, "rb");
+    if (!remote)
+        return nullptr;
+
+    RangeCache *cache = static_cast<RangeCache *>(userData);
+    File *file = new File;
+    file->cache = cache;
+    file->remote = remote;
+    file->size = statBuf.st_size;
+    file->directory = cache->m_directory + "/"
+                      + QCryptographicHash::hash(QByteArray(remotePath), QCryptographicHash::Sha1).toHex();
+
+    // Chunks of another version of the file are dropped
+    QByteArray version = QByteArray::number(qint64(statBuf.st_size)) + " " + QByteArray::number(qint64(statBuf.st_mtime));
+    QFile versionFile(file->directory + "/version");
+    if (versionFile.open(QIODevice::ReadOnly) && versionFile.readAll() != version) {
+        versionFile.close();
+        cache->drop(file->directory);
+    }
+    if (!QFile::exists(versionFile.fileName())) {
+        QDir().mkpath(file->directory);
+        QSaveFile newVersionFile(versionFile.fileName());
+        if (newVersionFile.open(QIODevice::WriteOnly)) {
+            newVersionFile.write(version);
+            newVersionFile.commit();
+        }
+    }
+    return file;
+}
+
+vsi_l_offset RangeCache::vsiTell(void *file)
+{
+    return static_cast<File *>(file)->position;
+}
+
+int RangeCache::vsiSeek(void *pointer, vsi_l_offset offset, int whence)
+{
+    File *file = static_cast<File *>(pointer);
+    if (whence == SEEK_SET)
+        file->position = offset;
+    else if (whence == SEEK_CUR)
+        file->position += offset;
+    else if (whence == SEEK_END)
+        file->position = file->size + offset;
+    else
+        return -1;
+    file->eof = false;
+    return 0;
+}
+
+size_t RangeCache::vsiRead(void *pointer, void *buffer, size_t size, size_t count)
+{
+    File *file = static_cast<File *>(pointer);
+    if (size == 0 || count == 0)
+        return 0;
+    vsi_l_offset available = file->position < file->size ? file->size - file->position : 0;
+    size_t readCount = std::min<vsi_l_offset>(count, available / size);
+    if (readCount < count)
+        file->eof = true;
+    if (readCount == 0)
+        return 0;
+    if (!file->cache->copyRange(file, file->position, readCount * size, static_cast<char *>(buffer)))
+        return 0;
+    file->position += readCount * size;
+    return readCount;
+}
+
+int RangeCache::vsiReadMultiRange(void *pointer, int ranges, void **data, const vsi_l_offset *offsets, const size_t *sizes)
+{
+    // GDAL asks for the blocks of a whole window at once, fetch whatever is missing of them together
+    File *file = static_cast<File *>(pointer);
+    QList<qint64> indices;
+    for (int i = 0; i < ranges; ++i) {
+        if (offsets[i] + sizes[i] > file->size)
+            return -1;
+        appendChunks(indices, offsets[i], sizes[i]);
+    }
+    QHash<qint64, QByteArray> chunkData;
+    if (!file->cache->chunks(file, indices, chunkData))
+        return -1;
+    for (int i = 0; i < ranges; ++i) {
+        if (!copyChunks(chunkData, offsets[i], sizes[i], static_cast<char *>(data[i])))
+            return -1;
+    }
+    return 0;
+}
+
+int RangeCache::vsiEof(void *file)
+{
+    return static_cast<File *>(file)->eof ? 1 : 0;
+}
+
+int RangeCache::vsiClose(void *pointer)
+{
+    File *file = static_cast<File *>(pointer);
+    int result = VSIFCloseL(file->remote);
+    delete file;
+    return result;
+}
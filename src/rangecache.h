@@ -0,0 +1,69 @@
+#ifndef RANGECACHE_H
+#define RANGECACHE_H
+
+#include <QObject>
+#include <QHash>
+#include <QMutex>
+#include <QString>
+#include <atomic>
+#include <cpl_vsi.h>
+
+// Persistent on-disk cache for the bytes GDAL reads from remote files, so that a cloud optimized
+// GeoTIFF viewed again (or a part of it) doesn't go back to the server. http(s) URLs are opened through
+// GDAL's /vsicurl/, which only fetches the byte ranges of the header, the overview level and the blocks
+// that are actually read, and wrapped in a /vsirangecache/ filesystem handler that keeps those ranges as
+// fixed size chunks in the cache directory.
+//
+// The cache is trimmed to maxBytes() by removing the least recently used chunks. A file whose size or
+// modification time on the server changed has its chunks dropped when opened. Created by DatasetPool,
+// which opens every file through gdalPath().
+class RangeCache : public QObject
+{
+    Q_OBJECT
+
+public:
+    static RangeCache *instance();
+    ~RangeCache();
+
+    static bool isRemote(const QString &source);
+    // Path to open source with in GDAL: through the cache for http(s) URLs, unchanged otherwise.
+    static QString gdalPath(const QString &source);
+
+    inline qint64 maxBytes() const { return m_maxBytes; }
+    void setMaxBytes(qint64 maxBytes);
+    inline qint64 usedBytes() const { return m_usedBytes; }
+    inline QString directory() const { return m_directory; }
+
+private:
+    struct File;
+
+    explicit RangeCache(QObject *parent);
+    void install();
+    // Data of the given chunks, from the cache directory where present and fetched (and stored) otherwise.
+    bool chunks(File *file, const QList<qint64> &indices, QHash<qint64, QByteArray> &data);
+    bool copyRange(File *file, vsi_l_offset offset, size_t length, char *out);
+    void store(File *file, qint64 chunk, const QByteArray &data);
+    void drop(const QString &directory);
+    void trim();
+
+    // GDAL filesystem plugin callbacks
+    static int vsiStat(void *userData, const char *filename, VSIStatBufL *statBuf, int flags);
+    static char **vsiReadDir(void *userData, const char *dirname, int maxFiles);
+    static void *vsiOpen(void *userData, const char *filename, const char *access);
+    static vsi_l_offset vsiTell(void *file);
+    static int vsiSeek(void *file, vsi_l_offset offset, int whence);
+    static size_t vsiRead(void *file, void *buffer, size_t size, size_t count);
+    static int vsiReadMultiRange(void *file, int ranges, void **data, const vsi_l_offset *offsets, const size_t *sizes);
+    static int vsiEof(void *file);
+    static int vsiClose(void *file);
+
+private:
+    QString m_directory;
+    std::atomic<qint64> m_maxBytes;
+    std::atomic<qint64> m_usedBytes = 0;
+    QMutex m_trimMutex;
+
+    inline static RangeCache *s_instance = nullptr;
+};
+
+#endif // RANGECACHE_H
@@ -0,0 +1,519 @@
+#include "rasterreader.h"
+#include "bandstatistics.h"
+#include "resampler.h"
+#include <QDebug>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+// Most pixels of the level read per output pixel for the Resampler to do the scaling, bounding the
+// memory of the intermediate image. selectOverview() keeps it below 4 where there are overviews.
+static constexpr int s_maxResampledRatio = 16;
+// Without computed statistics, stretches come from a read of the band about this many pixels across
+static constexpr int s_sampleSize = 1024;
+static constexpr int s_sampleBuckets = 1024;
+
+static void reportCplErrWarning(CPLErr errType, const QString& msg)
+{
+    QString errTypeStr;
+    switch(errType) {
+    case CPLErr::CE_Debug:
+        errTypeStr = "debug";
+        break;
+    case CPLErr::CE_Failure:
+        errTypeStr = "failure";
+        break;
+    case CPLErr::CE_Fatal:
+        errTypeStr = "fatal";
+        break;
+    case CPLErr::CE_Warning:
+        errTypeStr = "warning";
+        break;
+    case CPLErr::CE_None:
+        errTypeStr = "none";
+        break;
+    default:
+        errTypeStr = "unknown";
+    }
+    qWarning() << msg << errTypeStr << ": " << CPLGetLastErrorMsg();
+}
+
+int RasterReader::selectOverview(GDALDataset *dataset, const QRect &window, const QSize &outSize)
+{
+    // Zoomed out reads then come from a thumbnail-sized pyramid level instead of level 0.
+    GDALRasterBand *band = dataset->GetRasterBand(1);
+    double decimation = std::min(double(window.width()) / outSize.width(),
+                                 double(window.height()) / outSize.height());
+    int bestLevel = -1;
+    double bestFactor = 1.0;
+    for (int i = 0; i < band->GetOverviewCount(); ++i) {
+        GDALRasterBand *overview = band->GetOverview(i);
+        if (!overview)
+            continue;
+        double factor = double(dataset->GetRasterXSize()) / overview->GetXSize();
+        if (factor <= decimation && factor > bestFactor) {
+            bestFactor = factor;
+            bestLevel = i;
+        }
+    }
+    return bestLevel;
+}
+
+QImage::Format RasterReader::imageFormat(int bandCount)
+{
+    if (bandCount >= 4)
+        return QImage::Format_RGBA8888;
+    if (bandCount == 3)
+        return QImage::Format_RGBX8888;
+    return QImage::Format_Grayscale8;
+}
+
+QImage::Format RasterReader::imageFormat(GDALDataset *dataset)
+{
+    if (needsMask(dataset))
+        return QImage::Format_RGBA8888;
+    if (!colorTable(dataset).isEmpty())
+        return QImage::Format_Indexed8;
+    return imageFormat(dataset ? dataset->GetRasterCount() : 0);
+}
+
+bool RasterReader::needsStretch(GDALDataset *dataset)
+{
+    return dataset && dataset->GetRasterCount() > 0 && dataset->GetRasterBand(1)->GetRasterDataType() != GDT_Byte;
+}
+
+// Bands read as colour, whose masks decide which pixels are valid.
+static int colorBandCount(GDALDataset *dataset)
+{
+    return dataset->GetRasterCount() >= 3 ? 3 : 1;
+}
+
+// The band of the given level, or null when the overview doesn't exist.
+static GDALRasterBand *levelBand(GDALDataset *dataset, int band, int overviewLevel)
+{
+    GDALRasterBand *fullBand = dataset->GetRasterBand(band);
+    return overviewLevel >= 0 ? fullBand->GetOverview(overviewLevel) : fullBand;
+}
+
+bool RasterReader::needsMask(GDALDataset *dataset)
+{
+    if (!dataset || dataset->GetRasterCount() < 1)
+        return false;
+    int flags = dataset->GetRasterBand(1)->GetMaskFlags();
+    if (flags & GMF_PER_DATASET)
+        return !((flags & GMF_ALPHA) && dataset->GetRasterCount() >= 4);
+    if ((flags & GMF_NODATA) && !colorTable(dataset).isEmpty())
+        return false;
+    for (int i = 1; i <= colorBandCount(dataset); ++i) {
+        if (dataset->GetRasterBand(i)->GetMaskFlags() & GMF_ALL_VALID)
+            return false;
+    }
+    return true;
+}
+
+// Band 1 of the level read, or null when the overview doesn't exist, with the window scaled from full
+// resolution pixels to the pixel grid of that level.
+static GDALRasterBand *levelWindow(GDALDataset *dataset, const QRect &window, int overviewLevel, QRect &levelRect)
+{
+    GDALRasterBand *band = levelBand(dataset, 1, overviewLevel);
+    if (!band)
+        return nullptr;
+    double xRatio = double(band->GetXSize()) / dataset->GetRasterXSize();
+    double yRatio = double(band->GetYSize()) / dataset->GetRasterYSize();
+    int xOff = int(std::floor(window.left() * xRatio));
+    int yOff = int(std::floor(window.top() * yRatio));
+    int width = std::clamp(int(std::ceil((window.left() + window.width()) * xRatio)) - xOff, 1, band->GetXSize() - xOff);
+    int height = std::clamp(int(std::ceil((window.top() + window.height()) * yRatio)) - yOff, 1, band->GetYSize() - yOff);
+    levelRect = QRect(xOff, yOff, width, height);
+    return band;
+}
+
+bool RasterReader::isEmpty(GDALDataset *dataset, const QRect &window, int overviewLevel)
+{
+    if (!dataset || dataset->GetRasterCount() < 1 || window.isEmpty())
+        return false;
+    QRect levelRect;
+    if (!levelWindow(dataset, window, overviewLevel, levelRect))
+        return false;
+
+    // Missing blocks of a band with a nodata value read as nodata, and those of a mask or alpha band as
+    // masked out. Drivers that can't tell report GDAL_DATA_COVERAGE_STATUS_UNIMPLEMENTED.
+    bool perDataset = dataset->GetRasterBand(1)->GetMaskFlags() & GMF_PER_DATASET;
+    int bandCount = perDataset ? 1 : colorBandCount(dataset);
+    for (int i = 1; i <= bandCount; ++i) {
+        GDALRasterBand *band = levelBand(dataset, i, overviewLevel);
+        int flags = dataset->GetRasterBand(i)->GetMaskFlags();
+        if (!band || (flags & GMF_ALL_VALID))
+            return false;
+        if (perDataset || !(flags & GMF_NODATA))
+            band = band->GetMaskBand();
+        if (!band || band->GetDataCoverageStatus(levelRect.x(), levelRect.y(), levelRect.width(), levelRect.height(),
+                                                 0, nullptr) != GDAL_DATA_COVERAGE_STATUS_EMPTY)
+            return false;
+    }
+    return true;
+}
+
+bool RasterReader::isTransparent(const QImage &image)
+{
+    if (image.isNull() || !image.hasAlphaChannel())
+        return false;
+    if (image.format() == QImage::Format_RGBA8888) {
+        for (int y = 0; y < image.height(); ++y) {
+            const uchar *line = image.constScanLine(y);
+            for (int x = 0; x < image.width(); ++x) {
+                if (line[x * 4 + 3])
+                    return false;
+            }
+        }
+        return true;
+    }
+
+    QImage alpha = image.convertToFormat(QImage::Format_Alpha8);
+    for (int y = 0; y < alpha.height(); ++y) {
+        const uchar *line = alpha.constScanLine(y);
+        if (std::any_of(line, line + alpha.width(), [](uchar a) { return a != 0; }))
+            return false;
+    }
+    return true;
+}
+
+QList<QRgb> RasterReader::colorTable(GDALDataset *dataset)
+{
+    // Band 2 may be an alpha band, any more and the raster is read as colour
+    QList<QRgb> colors;
+    if (!dataset || dataset->GetRasterCount() < 1 || dataset->GetRasterCount() > 2)
+        return colors;
+    GDALRasterBand *band = dataset->GetRasterBand(1);
+    GDALColorTable *table = band->GetColorTable();
+    if (!table || band->GetRasterDataType() != GDT_Byte || band->GetColorInterpretation() != GCI_PaletteIndex
+        || table->GetPaletteInterpretation() != GPI_RGB)
+        return colors;
+
+    // Indices past the end of the table are transparent
+    colors.fill(qRgba(0, 0, 0, 0), 256);
+    int count = std::min(table->GetColorEntryCount(), 256);
+    for (int i = 0; i < count; ++i) {
+        const GDALColorEntry *entry = table->GetColorEntry(i);
+        colors[i] = qRgba(entry->c1, entry->c2, entry->c3, entry->c4);
+    }
+    int hasNoData = FALSE;
+    double noData = band->GetNoDataValue(&hasNoData);
+    if (hasNoData && noData >= 0 && noData < 256 && noData == std::floor(noData))
+        colors[int(noData)] = qRgba(0, 0, 0, 0);
+    return colors;
+}
+
+QImage RasterReader::expandPalette(const QImage &indexed)
+{
+    QImage image(indexed.size(), QImage::Format_ARGB32_Premultiplied);
+    if (image.isNull())
+        return QImage();
+    uint32_t lut[256] = {};
+    QList<QRgb> colors = indexed.colorTable();
+    for (int i = 0; i < std::min(int(colors.size()), 256); ++i)
+        lut[i] = qPremultiply(colors[i]);
+    for (int y = 0; y < image.height(); ++y)
+        PixelConvert::expandPalette(indexed.constScanLine(y), reinterpret_cast<uint32_t*>(image.scanLine(y)),
+                                    image.width(), lut);
+    return image;
+}
+
+static int imageBandCount(QImage::Format format)
+{
+    switch (format) {
+    case QImage::Format_RGBA8888:
+        return 4;
+    case QImage::Format_RGBX8888:
+        return 3;
+    default:
+        return 1;
+    }
+}
+
+// Range and histogram of a decimated read of the band, from the smallest overview that is still
+// large enough. Read directly rather than through GDAL's statistics, which are saved to .aux.xml.
+static BandStatistics sampleStatistics(GDALRasterBand *band)
+{
+    BandStatistics sampled;
+    GDALRasterBand *source = band;
+    for (int i = 0; i < band->GetOverviewCount(); ++i) {
+        GDALRasterBand *overview = band->GetOverview(i);
+        if (overview && std::max(overview->GetXSize(), overview->GetYSize()) >= s_sampleSize
+            && overview->GetXSize() < source->GetXSize()) {
+            source = overview;
+        }
+    }
+    QSize sourceSize(source->GetXSize(), source->GetYSize());
+    QSize outSize = sourceSize.scaled(s_sampleSize, s_sampleSize, Qt::KeepAspectRatio).boundedTo(sourceSize)
+                        .expandedTo(QSize(1, 1));
+    std::vector<double> samples(size_t(outSize.width()) * outSize.height());
+    if (source->RasterIO(GF_Read, 0, 0, sourceSize.width(), sourceSize.height(), samples.data(),
+                         outSize.width(), outSize.height(), GDT_Float64, 0, 0) > CE_Warning) {
+        qWarning() << "Failed to sample band" << band->GetBand() << ":" << CPLGetLastErrorMsg();
+        return sampled;
+    }
+
+    int hasNoData = FALSE;
+    double noData = band->GetNoDataValue(&hasNoData);
+    auto valid = [&](double value) { return !std::isnan(value) && !(hasNoData && value == noData); };
+    sampled.min = std::numeric_limits<double>::infinity();
+    sampled.max = -std::numeric_limits<double>::infinity();
+    for (double value : samples) {
+        if (valid(value)) {
+            sampled.min = std::min(sampled.min, value);
+            sampled.max = std::max(sampled.max, value);
+        }
+    }
+    if (!(sampled.max >= sampled.min)) {
+        sampled.min = 0;
+        sampled.max = 255;
+        return sampled;
+    }
+
+    sampled.histogramMin = sampled.min;
+    sampled.histogramMax = sampled.max > sampled.min ? sampled.max : sampled.min + 1;
+    sampled.histogram.fill(0, s_sampleBuckets);
+    double bucketScale = s_sampleBuckets / (sampled.histogramMax - sampled.histogramMin);
+    for (double value : samples) {
+        if (valid(value)) {
+            int bucket = int((value - sampled.histogramMin) * bucketScale);
+            ++sampled.histogram[std::clamp(bucket, 0, s_sampleBuckets - 1)];
+            ++sampled.validCount;
+        }
+    }
+    return sampled;
+}
+
+static ChannelStretch bandStretch(GDALRasterBand *band, RasterReader::StretchMode mode, const BandStatistics *statistics)
+{
+    BandStatistics sampled;
+    if (!statistics) {
+        sampled = sampleStatistics(band);
+        statistics = &sampled;
+    }
+    double low = mode == RasterReader::PercentileStretch ? statistics->percentile(0.02) : statistics->min;
+    double high = mode == RasterReader::PercentileStretch ? statistics->percentile(0.98) : statistics->max;
+
+    ChannelStretch stretch = ChannelStretch::fromRange(low, high);
+    int hasNoData = FALSE;
+    double noData = band->GetNoDataValue(&hasNoData);
+    stretch.hasNoData = hasNoData;
+    stretch.noData = float(noData);
+    return stretch;
+}
+
+QList<ChannelStretch> RasterReader::computeStretch(GDALDataset *dataset, StretchMode mode)
+{
+    QList<ChannelStretch> stretch;
+    if (!dataset || dataset->GetRasterCount() < 1)
+        return stretch;
+
+    // Statistics computed by the StatisticsEngine are preferred, GDAL's approximate ones are the fallback.
+    QList<BandStatistics> statistics = StatisticsCache::load(QString::fromUtf8(dataset->GetDescription()));
+    int imageBands = imageBandCount(imageFormat(dataset->GetRasterCount()));
+    for (int i = 1; i <= imageBands; ++i) {
+        const BandStatistics *bandStatistics = i <= statistics.size() ? &statistics[i - 1] : nullptr;
+        stretch.append(bandStretch(dataset->GetRasterBand(i), mode, bandStatistics));
+    }
+    // The padding channel of RGBX images is always opaque
+    if (imageBands == 3)
+        stretch.append(ChannelStretch::constant(255));
+    return stretch;
+}
+
+static bool allValid(GDALDataset *dataset, int bandCount)
+{
+    for (int i = 1; i <= bandCount; ++i) {
+        if (dataset->GetRasterBand(i)->GetMaskFlags() != GMF_ALL_VALID)
+            return false;
+    }
+    return true;
+}
+
+// Type the samples of a band are read as before being stretched to 8 bits.
+static GDALDataType stretchBufferType(GDALDataType dataType)
+{
+    switch (dataType) {
+    case GDT_UInt16:
+    case GDT_Int16:
+    case GDT_UInt32:
+        return dataType;
+    default:
+        return GDT_Float32;
+    }
+}
+
+static void stretchRow(GDALDataType type, const void *src, uint8_t *dst, size_t pixelCount, int channels,
+                       const ChannelStretch *stretch)
+{
+    switch (type) {
+    case GDT_UInt16:
+        PixelConvert::toByte(static_cast<const uint16_t*>(src), dst, pixelCount, channels, stretch);
+        break;
+    case GDT_Int16:
+        PixelConvert::toByte(static_cast<const int16_t*>(src), dst, pixelCount, channels, stretch);
+        break;
+    case GDT_UInt32:
+        PixelConvert::toByte(static_cast<const uint32_t*>(src), dst, pixelCount, channels, stretch);
+        break;
+    default:
+        PixelConvert::toByte(static_cast<const float*>(src), dst, pixelCount, channels, stretch);
+        break;
+    }
+}
+
+QImage RasterReader::read(GDALDataset *dataset, const QRect &window, const QSize &outSize, int overviewLevel,
+                          GDALRIOResampleAlg resampleAlg, const QList<ChannelStretch> &stretch, Timings *timings)
+{
+    if (!dataset || dataset->GetRasterCount() < 1 || window.isEmpty() || outSize.isEmpty())
+        return QImage();
+
+    // Scale the window from full resolution pixels to the pixel grid of the level being read.
+    QRect levelRect;
+    GDALRasterBand *firstBand = levelWindow(dataset, window, overviewLevel, levelRect);
+    if (!firstBand)
+        return QImage();
+    int xOff = levelRect.x();
+    int yOff = levelRect.y();
+    int windowWidth = levelRect.width();
+    int windowHeight = levelRect.height();
+
+    // Averaging palette indices would give unrelated colours
+    QList<QRgb> palette = colorTable(dataset);
+    if (!palette.isEmpty() && resampleAlg != GRIORA_Mode)
+        resampleAlg = GRIORA_NearestNeighbour;
+
+    // GDAL's bilinear and average resampling converts every sample to floating point, one band at a time.
+    // When the level read is at most a few times larger than the output, read it as is and let the
+    // Resampler scale it instead. Only where every pixel is valid, as GDAL leaves out masked ones.
+    Resampler::Filter filter = resampleAlg == GRIORA_Average ? Resampler::Area : Resampler::Bilinear;
+    if ((resampleAlg == GRIORA_Average || resampleAlg == GRIORA_Bilinear) && QSize(windowWidth, windowHeight) != outSize
+        && qint64(windowWidth) * windowHeight <= qint64(outSize.width()) * outSize.height() * s_maxResampledRatio
+        && !needsStretch(dataset) && allValid(dataset, imageBandCount(imageFormat(dataset->GetRasterCount())))) {
+        QImage level = read(dataset, window, QSize(windowWidth, windowHeight), overviewLevel, GRIORA_NearestNeighbour,
+                            stretch, timings);
+        if (level.isNull())
+            return QImage();
+        auto resampleStart = std::chrono::steady_clock::now();
+        QImage image = Resampler::resample(level, outSize, filter);
+        if (timings)
+            timings->scalingNs = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - resampleStart).count();
+        return image;
+    }
+
+    int bandCount = dataset->GetRasterCount();
+    QImage image(outSize, palette.isEmpty() ? imageFormat(bandCount) : QImage::Format_Indexed8);
+    if (image.isNull())
+        return QImage();
+    if (!palette.isEmpty())
+        image.setColorTable(palette);
+
+    int imageBands = imageBandCount(image.format());
+    int channels = image.depth() / 8;
+    int bandMap[] = { 1, 2, 3, 4 };
+
+    // Byte data goes straight into the image. Anything else is read into a buffer with the same pixel
+    // interleaving (and the padding channel of RGBX zeroed) and stretched into the image afterwards.
+    GDALDataType bufferType = GDT_Byte;
+    QList<ChannelStretch> channelStretch;
+    std::vector<uint8_t> buffer;
+    uint8_t *target = image.bits();
+    GSpacing sampleSize = 1;
+    GSpacing lineSpace = image.bytesPerLine();
+    if (needsStretch(dataset)) {
+        bufferType = stretchBufferType(dataset->GetRasterBand(1)->GetRasterDataType());
+        sampleSize = GDALGetDataTypeSizeBytes(bufferType);
+        lineSpace = sampleSize * channels * image.width();
+        buffer.resize(size_t(lineSpace) * image.height());
+        target = buffer.data();
+        channelStretch = stretch.size() == channels ? stretch : computeStretch(dataset, PercentileStretch);
+    } else if (image.format() == QImage::Format_RGBX8888) {
+        // GDAL only fills R, G and B; the padding byte must read as opaque.
+        image.fill(Qt::white);
+    }
+    GSpacing pixelSpace = sampleSize * channels;
+
+    // Overviews are read through the dataset their bands belong to, so the dataset-level read below
+    // works for them too. Drivers that don't expose one fall back to reading band by band.
+    GDALDataset *source = dataset;
+    if (overviewLevel >= 0) {
+        GDALRasterBand *overview = dataset->GetRasterBand(1)->GetOverview(overviewLevel);
+        if (!overview)
+            return QImage();
+        GDALDataset *overviewDataset = overview->GetDataset();
+        bool usable = overviewDataset && overviewDataset->GetRasterCount() >= imageBands;
+        for (int i = 1; usable && i <= imageBands; ++i)
+            usable = overviewDataset->GetRasterBand(i) == dataset->GetRasterBand(i)->GetOverview(overviewLevel);
+        source = usable ? overviewDataset : nullptr;
+    }
+
+    GDALRasterIOExtraArg extraArg;
+    INIT_RASTERIO_EXTRA_ARG(extraArg);
+    extraArg.eResampleAlg = resampleAlg;
+
+    auto readStart = std::chrono::steady_clock::now();
+    CPLErr err = CE_None;
+    if (source) {
+        err = source->RasterIO(GF_Read, xOff, yOff, windowWidth, windowHeight, target,
+                               image.width(), image.height(), bufferType, imageBands, bandMap,
+                               pixelSpace, lineSpace, sampleSize, &extraArg);
+    } else {
+        for (int i = 0; i < imageBands && err <= CE_Warning; ++i) {
+            GDALRasterBand *band = dataset->GetRasterBand(bandMap[i])->GetOverview(overviewLevel);
+            err = band ? band->RasterIO(GF_Read, xOff, yOff, windowWidth, windowHeight, target + i * sampleSize,
+                                        image.width(), image.height(), bufferType,
+                                        pixelSpace, lineSpace, &extraArg)
+                       : CE_Failure;
+        }
+    }
+
+    // The mask of the level is resampled like the data, so averaged edges come out translucent. Per band
+    // masks are combined by their maximum: a pixel is valid where any of its colour bands is.
+    std::vector<uint8_t> mask;
+    if (needsMask(dataset) && err <= CE_Warning) {
+        size_t pixelCount = size_t(image.width()) * image.height();
+        int maskCount = dataset->GetRasterBand(1)->GetMaskFlags() & GMF_PER_DATASET ? 1 : colorBandCount(dataset);
+        std::vector<uint8_t> bandMask;
+        for (int i = 1; i <= maskCount && err <= CE_Warning; ++i) {
+            std::vector<uint8_t> &out = i == 1 ? mask : bandMask;
+            out.resize(pixelCount);
+            GDALRasterBand *band = levelBand(dataset, i, overviewLevel);
+            GDALRasterBand *maskBand = band ? band->GetMaskBand() : nullptr;
+            err = maskBand ? maskBand->RasterIO(GF_Read, xOff, yOff, windowWidth, windowHeight, out.data(),
+                                                image.width(), image.height(), GDT_Byte, 0, 0, &extraArg)
+                           : CE_Failure;
+            if (i > 1)
+                std::transform(mask.cbegin(), mask.cend(), bandMask.cbegin(), mask.begin(),
+                               [](uint8_t a, uint8_t b) { return std::max(a, b); });
+        }
+    }
+
+    auto readEnd = std::chrono::steady_clock::now();
+    if (timings) {
+        timings->readNs = std::chrono::duration_cast<std::chrono::nanoseconds>(readEnd - readStart).count();
+        timings->bytes = qint64(image.width()) * image.height() * imageBands * sampleSize + qint64(mask.size());
+    }
+
+    if (err > CE_Warning) {
+        reportCplErrWarning(err, "GDAL RasterIO call failed with ");
+        return QImage();
+    }
+
+    if (!buffer.empty()) {
+        for (int y = 0; y < image.height(); ++y)
+            stretchRow(bufferType, buffer.data() + y * lineSpace, image.scanLine(y), image.width(), channels,
+                       channelStretch.constData());
+    }
+    if (!mask.empty()) {
+        image = image.convertToFormat(QImage::Format_RGBA8888);
+        for (int y = 0; y < image.height(); ++y)
+            PixelConvert::applyMask(image.scanLine(y), mask.data() + size_t(y) * image.width(), image.width());
+    }
+    if (timings && (!buffer.empty() || !mask.empty()))
+        timings->conversionNs = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - readEnd).count();
+
+    return image;
+}
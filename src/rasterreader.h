@@ -0,0 +1,75 @@
+#ifndef RASTERREADER_H
+#define RASTERREADER_H
+
+#include <QImage>
+#include <QList>
+#include <QRect>
+#include <gdal_priv.h>
+#include "pixelconvert.h"
+
+// Reads a window of a GDAL dataset into a QImage. Bands are read with a single dataset-level RasterIO
+// call whose band map and pixel/line spacing match the QImage layout, so GDAL writes the interleaved
+// pixels straight into the image's scanlines without any intermediate per-band buffers.
+//
+// Bands of other data types than Byte are read in (or, for the less common types, converted by GDAL
+// to) their native width and contrast stretched to 8 bits with the PixelConvert kernels.
+class RasterReader
+{
+public:
+    enum StretchMode {
+        MinMaxStretch,      // Band minimum to maximum
+        PercentileStretch   // 2nd to 98th percentile of the band histogram
+    };
+
+    // Filled in by read() when asked for, so callers can report where the time went.
+    struct Timings
+    {
+        qint64 readNs = 0;          // GDAL RasterIO, including its resampling
+        qint64 conversionNs = 0;    // Contrast stretch to 8 bits
+        qint64 scalingNs = 0;       // Resampling of the read level by the Resampler
+        qint64 bytes = 0;           // Sample bytes GDAL delivered
+    };
+
+    // Pick the coarsest overview that still has at least as many pixels across the window as the
+    // output. Returns -1 when the full resolution raster should be read.
+    static int selectOverview(GDALDataset *dataset, const QRect &window, const QSize &outSize);
+
+    // The window is given in full resolution raster pixels and decimated (or replicated) to outSize by
+    // GDAL while reading, or for bilinear and average resampling of valid 8-bit data, by the Resampler.
+    // 1 and 2 band rasters give Format_Grayscale8, 3 bands Format_RGBX8888 and 4 or more bands
+    // Format_RGBA8888. Paletted rasters (see colorTable()) give Format_Indexed8 with their colour table,
+    // and are always resampled by nearest neighbour or mode, as averaging indices is meaningless.
+    // Rasters that need their mask (see needsMask()) give Format_RGBA8888 with the mask as alpha.
+    // stretch holds one entry per image channel (1 for grayscale, 4 otherwise) and is only used for
+    // non-Byte data. When empty, it is computed with computeStretch() for every call.
+    static QImage read(GDALDataset *dataset, const QRect &window, const QSize &outSize, int overviewLevel = -1,
+                       GDALRIOResampleAlg resampleAlg = GRIORA_NearestNeighbour,
+                       const QList<ChannelStretch> &stretch = QList<ChannelStretch>(), Timings *timings = nullptr);
+
+    static QImage::Format imageFormat(int bandCount);
+    // Format read() gives for the dataset, taking its colour table and mask into account.
+    static QImage::Format imageFormat(GDALDataset *dataset);
+    static bool needsStretch(GDALDataset *dataset);
+    // 256 entry colour table of a raster whose first band is a Byte palette index, with the nodata
+    // index transparent. Empty for every other raster.
+    static QList<QRgb> colorTable(GDALDataset *dataset);
+    // True when some pixels are nodata or masked out, and neither an alpha band read as the fourth
+    // channel nor the colour table already makes them transparent. A mask shared by all bands
+    // (GMF_PER_DATASET) is used as is. Otherwise the masks of the colour bands are combined, so a pixel
+    // is only transparent when every band is nodata, and a band whose pixels are all valid means no mask.
+    static bool needsMask(GDALDataset *dataset);
+    // True when GDAL can tell from the file's block layout alone that the window holds nothing but
+    // nodata or masked out pixels, e.g. missing blocks of a sparse GeoTIFF, so it needn't be read at all.
+    // With per band masks, that has to hold for every colour band.
+    static bool isEmpty(GDALDataset *dataset, const QRect &window, int overviewLevel = -1);
+    // True when every pixel of the image is fully transparent.
+    static bool isTransparent(const QImage &image);
+    // Paletted image expanded to Format_ARGB32_Premultiplied, the format textures are uploaded from
+    // without another conversion.
+    static QImage expandPalette(const QImage &indexed);
+    // Uses the statistics in the StatisticsCache when there are any for the dataset's file, and GDAL's
+    // approximate statistics (from overviews or a subsample) otherwise, so it is cheap enough per dataset.
+    static QList<ChannelStretch> computeStretch(GDALDataset *dataset, StretchMode mode);
+};
+
+#endif // RASTERREADER_H
@@ -0,0 +1,215 @@
+#include "resampler.h"
+#include <QtConcurrent>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define RESAMPLER_SSE2
+#include <emmintrin.h>
+#endif
+
+// Filter weights are fixed point with this many fractional bits and sum to exactly 1 per output sample.
+static constexpr int s_weightBits = 14;
+// Horizontal results are kept with this many fractional bits, so they fit 16 bits (255 << 7 < 2^15).
+static constexpr int s_intermediateBits = 7;
+static constexpr int s_verticalShift = s_weightBits + s_intermediateBits;
+// Outputs smaller than this are resampled on the calling thread, e.g. a single map tile.
+static constexpr qint64 s_minParallelPixels = 512 * 512;
+static constexpr int s_minBandRows = 16;
+
+namespace {
+
+// Taps of every output sample along one axis: count source samples from first, with their weights.
+struct AxisFilter
+{
+    std::vector<int> first;
+    std::vector<int> count;
+    std::vector<int> offset;        // Into weights
+    std::vector<int16_t> weights;
+
+    void append(int start, const std::vector<double> &tapWeights)
+    {
+        // Round to fixed point and give the rounding error to the largest tap, so the sum is exact
+        int total = 0;
+        size_t largest = 0;
+        offset.push_back(int(weights.size()));
+        first.push_back(start);
+        count.push_back(int(tapWeights.size()));
+        for (size_t i = 0; i < tapWeights.size(); ++i) {
+            int weight = int(std::lround(tapWeights[i] * (1 << s_weightBits)));
+            weights.push_back(int16_t(weight));
+            total += weight;
+            if (tapWeights[i] > tapWeights[largest])
+                largest = i;
+        }
+        weights[offset.back() + largest] += int16_t((1 << s_weightBits) - total);
+    }
+};
+
+AxisFilter axisFilter(int sourceSize, int outSize, Resampler::Filter filter)
+{
+    AxisFilter axis;
+    double scale = double(sourceSize) / outSize;
+    if (filter == Resampler::Area && scale <= 1.0)
+        filter = Resampler::Bilinear;
+
+    for (int i = 0; i < outSize; ++i) {
+        switch (filter) {
+        case Resampler::Nearest:
+            axis.append(std::min(int((i + 0.5) * scale), sourceSize - 1), { 1.0 });
+            break;
+        case Resampler::Bilinear: {
+            double centre = std::clamp((i + 0.5) * scale - 0.5, 0.0, double(sourceSize - 1));
+            int first = std::min(int(centre), std::max(sourceSize - 2, 0));
+            double fraction = centre - first;
+            if (sourceSize == 1 || fraction <= 0.0)
+                axis.append(first, { 1.0 });
+            else
+                axis.append(first, { 1.0 - fraction, fraction });
+            break;
+        }
+        case Resampler::Area: {
+            double begin = i * scale;
+            double end = std::min((i + 1) * scale, double(sourceSize));
+            int first = int(begin);
+            int last = std::min(int(std::ceil(end)), sourceSize);
+            std::vector<double> tapWeights;
+            for (int s = first; s < last; ++s)
+                tapWeights.push_back((std::min(end, s + 1.0) - std::max(begin, double(s))) / (end - begin));
+            axis.append(first, tapWeights);
+            break;
+        }
+        }
+    }
+    return axis;
+}
+
+template <int Channels>
+void filterRow(const uchar *source, uint16_t *out, const AxisFilter &axis)
+{
+    size_t outWidth = axis.first.size();
+    for (size_t x = 0; x < outWidth; ++x) {
+        const uchar *pixel = source + axis.first[x] * Channels;
+        const int16_t *weights = axis.weights.data() + axis.offset[x];
+        int sum[Channels] = {};
+        for (int k = 0; k < axis.count[x]; ++k, pixel += Channels) {
+            for (int c = 0; c < Channels; ++c)
+                sum[c] += weights[k] * pixel[c];
+        }
+        for (int c = 0; c < Channels; ++c)
+            out[x * Channels + c] = uint16_t((sum[c] + (1 << (s_weightBits - s_intermediateBits - 1)))
+                                             >> (s_weightBits - s_intermediateBits));
+    }
+}
+
+// Blends count intermediate rows (rows[k] with weights[k]) into length output bytes.
+void blendRows(const uint16_t *const *rows, const int16_t *weights, int count, uchar *out, size_t length)
+{
+    size_t i = 0;
+#ifdef RESAMPLER_SSE2
+    // Taps are taken in pairs, interleaving two rows so that _mm_madd_epi16 does both multiplies and the
+    // add; an odd last tap is paired with itself at weight 0
+    const __m128i round = _mm_set1_epi32(1 << (s_verticalShift - 1));
+    for (; i + 8 <= length; i += 8) {
+        __m128i low = round;
+        __m128i high = round;
+        for (int k = 0; k < count; k += 2) {
+            bool pair = k + 1 < count;
+            __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(rows[k] + i));
+            __m128i b = pair ? _mm_loadu_si128(reinterpret_cast<const __m128i *>(rows[k + 1] + i)) : a;
+            int weightB = pair ? weights[k + 1] : 0;
+            __m128i weight = _mm_set1_epi32(int(uint16_t(weights[k])) | (weightB << 16));
+            low = _mm_add_epi32(low, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), weight));
+            high = _mm_add_epi32(high, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), weight));
+        }
+        low = _mm_srai_epi32(low, s_verticalShift);
+        high = _mm_srai_epi32(high, s_verticalShift);
+        __m128i bytes = _mm_packus_epi16(_mm_packs_epi32(low, high), _mm_setzero_si128());
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(out + i), bytes);
+    }
+#endif
+    for (; i < length; ++i) {
+        int sum = 1 << (s_verticalShift - 1);
+        for (int k = 0; k < count; ++k)
+            sum += weights[k] * rows[k][i];
+        out[i] = uchar(std::clamp(sum >> s_verticalShift, 0, 255));
+    }
+}
+
+struct Job
+{
+    const QImage *source;
+    QImage *out;
+    const AxisFilter *horizontal;
+    const AxisFilter *vertical;
+    int channels;
+};
+
+void resampleBand(const Job &job, int firstRow, int lastRow)
+{
+    // Source rows this band of output rows needs, filtered horizontally once each
+    int sourceFirst = job.vertical->first[firstRow];
+    int sourceLast = sourceFirst;
+    for (int y = firstRow; y < lastRow; ++y) {
+        sourceFirst = std::min(sourceFirst, job.vertical->first[y]);
+        sourceLast = std::max(sourceLast, job.vertical->first[y] + job.vertical->count[y]);
+    }
+    size_t rowLength = size_t(job.out->width()) * job.channels;
+    std::vector<uint16_t> intermediate(rowLength * (sourceLast - sourceFirst));
+    for (int y = sourceFirst; y < sourceLast; ++y) {
+        uint16_t *row = intermediate.data() + rowLength * (y - sourceFirst);
+        if (job.channels == 4)
+            filterRow<4>(job.source->constScanLine(y), row, *job.horizontal);
+        else
+            filterRow<1>(job.source->constScanLine(y), row, *job.horizontal);
+    }
+
+    std::vector<const uint16_t *> rows;
+    for (int y = firstRow; y < lastRow; ++y) {
+        int count = job.vertical->count[y];
+        rows.resize(count);
+        for (int k = 0; k < count; ++k)
+            rows[k] = intermediate.data() + rowLength * (job.vertical->first[y] + k - sourceFirst);
+        blendRows(rows.data(), job.vertical->weights.data() + job.vertical->offset[y], count, job.out->scanLine(y),
+                  rowLength);
+    }
+}
+
+} // namespace
+
+QImage Resampler::resample(const QImage &source, const QSize &outSize, Filter filter, QThreadPool *pool)
+{
+    if (source.isNull() || outSize.isEmpty())
+        return QImage();
+    if (source.size() == outSize)
+        return source;
+
+    QImage input = source;
+    if (input.format() != QImage::Format_Grayscale8 && input.depth() != 32)
+        input = input.convertToFormat(QImage::Format_RGBA8888);
+    QImage out(outSize, input.format());
+    if (out.isNull())
+        return QImage();
+
+    AxisFilter horizontal = axisFilter(input.width(), outSize.width(), filter);
+    AxisFilter vertical = axisFilter(input.height(), outSize.height(), filter);
+    Job job { &input, &out, &horizontal, &vertical, input.depth() / 8 };
+
+    int threads = pool ? pool->maxThreadCount() : 1;
+    if (threads <= 1 || qint64(outSize.width()) * outSize.height() < s_minParallelPixels) {
+        resampleBand(job, 0, outSize.height());
+        return out;
+    }
+
+    // A few bands per thread, so that uneven bands don't leave threads idle at the end
+    int bandRows = std::max(s_minBandRows, (outSize.height() + threads * 4 - 1) / (threads * 4));
+    QList<int> bands;
+    for (int y = 0; y < outSize.height(); y += bandRows)
+        bands.append(y);
+    QtConcurrent::blockingMap(pool, bands, [&job, bandRows](int firstRow) {
+        resampleBand(job, firstRow, std::min(firstRow + bandRows, job.out->height()));
+    });
+    return out;
+}
@@ -0,0 +1,28 @@
+#ifndef RESAMPLER_H
+#define RESAMPLER_H
+
+#include <QImage>
+#include <QThreadPool>
+
+// Scales 8-bit images with a separable fixed point filter: every source row the output needs is filtered
+// horizontally into 16-bit intermediates, which are then blended vertically into the output rows. The
+// vertical pass, where most of the work is, runs on SSE2 where available. Large outputs are split into
+// bands of rows that are resampled in parallel on a thread pool.
+//
+// Grayscale8 images stay Grayscale8 and 32-bit ones keep their format, channels are filtered independently
+// (so premultiplied formats stay premultiplied). Anything else is converted to RGBA8888 first.
+class Resampler
+{
+public:
+    enum Filter {
+        Nearest,    // Pixel whose centre is closest
+        Bilinear,   // Two by two pixels around the sample point
+        Area        // Average of the source pixels covered, weighted by coverage; bilinear when enlarging
+    };
+
+    // With a null pool, or for small outputs, everything runs on the calling thread.
+    static QImage resample(const QImage &source, const QSize &outSize, Filter filter,
+                           QThreadPool *pool = QThreadPool::globalInstance());
+};
+
+#endif // RESAMPLER_H
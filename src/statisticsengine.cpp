@@ -0,0 +1,309 @@
+#include "statisticsengine.h"
+#include "datasetpool.h"
+#include <QtConcurrent>
+#include <QDebug>
+#include <gdal_priv.h>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+// Approximate statistics are taken from an overview (or decimated read) about this many pixels across.
+static constexpr int s_approximateSize = 1024;
+static constexpr int s_histogramBuckets = 256;
+// Natural blocks are grouped into read units of at least this many pixels, so stripped files are not
+// read one scanline at a time.
+static constexpr int s_minUnitPixels = 256 * 1024;
+
+namespace {
+
+// Running count, mean and sum of squared deviations (Welford), merged across threads with Chan's
+// parallel update.
+struct Accumulator
+{
+    qint64 count = 0;
+    double mean = 0;
+    double m2 = 0;
+    double min = std::numeric_limits<double>::infinity();
+    double max = -std::numeric_limits<double>::infinity();
+    std::vector<qint64> histogram = std::vector<qint64>(s_histogramBuckets);
+
+    void merge(const Accumulator &other)
+    {
+        if (other.count == 0)
+            return;
+        qint64 total = count + other.count;
+        double delta = other.mean - mean;
+        mean += delta * other.count / total;
+        m2 += other.m2 + delta * delta * (double(count) * other.count / total);
+        count = total;
+        min = std::min(min, other.min);
+        max = std::max(max, other.max);
+        for (int i = 0; i < s_histogramBuckets; ++i)
+            histogram[i] += other.histogram[i];
+    }
+};
+
+struct BandSetup
+{
+    bool hasNoData = false;
+    double noData = 0;
+    bool integer = false;
+    double histogramMin = 0;
+    double histogramMax = 1;
+
+    // Integer bins are centred on whole values.
+    void setRange(double min, double max)
+    {
+        histogramMin = integer ? min - 0.5 : min;
+        histogramMax = integer ? max + 0.5 : max;
+        if (!(histogramMax > histogramMin))
+            histogramMax = histogramMin + 1;
+    }
+
+    inline bool covers(const Accumulator &accumulator) const
+    {
+        return accumulator.count == 0 || (accumulator.min >= histogramMin && accumulator.max <= histogramMax);
+    }
+};
+
+}
+
+static BandSetup bandSetup(GDALRasterBand *band)
+{
+    BandSetup setup;
+    int hasNoData = FALSE;
+    setup.noData = band->GetNoDataValue(&hasNoData);
+    setup.hasNoData = hasNoData;
+    setup.integer = !GDALDataTypeIsFloating(band->GetRasterDataType());
+
+    // The histogram range comes from GDAL's cheap approximate min/max so that a single pass over the
+    // data is usually enough. An exact pass that finds values outside of it is repeated with the range
+    // it found.
+    double minMax[2] = { 0, 255 };
+    if (band->GetRasterDataType() != GDT_Byte && band->ComputeRasterMinMax(TRUE, minMax) > CE_Warning)
+        qWarning() << "Failed to compute the value range of band" << band->GetBand() << ":" << CPLGetLastErrorMsg();
+    setup.setRange(minMax[0], minMax[1]);
+    return setup;
+}
+
+static bool accumulateWindow(GDALRasterBand *band, const QRect &window, const QSize &outSize, const BandSetup &setup,
+                             Accumulator &accumulator, std::vector<double> &buffer)
+{
+    buffer.resize(size_t(outSize.width()) * outSize.height());
+    if (band->RasterIO(GF_Read, window.x(), window.y(), window.width(), window.height(), buffer.data(),
+                       outSize.width(), outSize.height(), GDT_Float64, 0, 0) > CE_Warning) {
+        qWarning() << "Failed to read band" << band->GetBand() << "for statistics :" << CPLGetLastErrorMsg();
+        return false;
+    }
+
+    // Accumulate the window locally first, it is merged into the running totals once.
+    Accumulator local;
+    double bucketScale = s_histogramBuckets / (setup.histogramMax - setup.histogramMin);
+    for (double value : buffer) {
+        if (std::isnan(value) || (setup.hasNoData && value == setup.noData))
+            continue;
+        ++local.count;
+        double delta = value - local.mean;
+        local.mean += delta / local.count;
+        local.m2 += delta * (value - local.mean);
+        local.min = std::min(local.min, value);
+        local.max = std::max(local.max, value);
+        int bucket = int((value - setup.histogramMin) * bucketScale);
+        ++local.histogram[std::clamp(bucket, 0, s_histogramBuckets - 1)];
+    }
+    accumulator.merge(local);
+    return true;
+}
+
+StatisticsEngine::StatisticsEngine(QObject *parent)
+    : QObject{parent}
+{
+    connect(&m_watcher, &QFutureWatcher<QList<BandStatistics>>::finished, this, [this]() {
+        m_result = m_watcher.result();
+        emit runningChanged();
+        emit finished(!m_result.isEmpty());
+    });
+}
+
+StatisticsEngine::~StatisticsEngine()
+{
+    cancel();
+    m_watcher.waitForFinished();
+}
+
+bool StatisticsEngine::start(const QString &filePath, bool approximate)
+{
+    if (running())
+        return false;
+
+    m_filePath = filePath;
+    m_result.clear();
+    m_cancelRequested = false;
+    m_progress = 0;
+    m_blocksDone = 0;
+    emit progressChanged(0);
+
+    m_watcher.setFuture(QtConcurrent::run(&StatisticsEngine::compute, this, filePath, approximate));
+    emit runningChanged();
+    return true;
+}
+
+void StatisticsEngine::cancel()
+{
+    m_cancelRequested = true;
+}
+
+QList<BandStatistics> StatisticsEngine::compute(const QString &filePath, bool approximate)
+{
+    DatasetPool::Handle handle = DatasetPool::instance()->acquire(filePath);
+    GDALDataset *dataset = handle.get();
+    if (!dataset) {
+        qWarning() << "Failed to open" << filePath << "for computing statistics";
+        return {};
+    }
+
+    int bandCount = dataset->GetRasterCount();
+    int width = dataset->GetRasterXSize();
+    int height = dataset->GetRasterYSize();
+    std::vector<BandSetup> setups;
+    for (int i = 1; i <= bandCount; ++i)
+        setups.push_back(bandSetup(dataset->GetRasterBand(i)));
+    std::vector<Accumulator> totals(bandCount);
+
+    bool ok = true;
+    if (approximate) {
+        std::vector<double> buffer;
+        for (int i = 1; i <= bandCount && ok && !m_cancelRequested; ++i) {
+            GDALRasterBand *band = dataset->GetRasterBand(i);
+            // Smallest overview that is still large enough, or else a decimated read of the band.
+            GDALRasterBand *source = nullptr;
+            for (int j = 0; j < band->GetOverviewCount(); ++j) {
+                GDALRasterBand *overview = band->GetOverview(j);
+                if (overview && std::max(overview->GetXSize(), overview->GetYSize()) >= s_approximateSize
+                    && (!source || overview->GetXSize() < source->GetXSize())) {
+                    source = overview;
+                }
+            }
+            QRect window;
+            QSize outSize;
+            if (source) {
+                window = QRect(0, 0, source->GetXSize(), source->GetYSize());
+                outSize = window.size();
+            } else {
+                source = band;
+                window = QRect(0, 0, width, height);
+                outSize = window.size().scaled(s_approximateSize, s_approximateSize, Qt::KeepAspectRatio)
+                              .boundedTo(window.size()).expandedTo(QSize(1, 1));
+            }
+            ok = accumulateWindow(source, window, outSize, setups[i - 1], totals[i - 1], buffer);
+            m_progress = double(i) / bandCount;
+            emit progressChanged(m_progress);
+        }
+    } else {
+        int blockXSize = 0;
+        int blockYSize = 0;
+        dataset->GetRasterBand(1)->GetBlockSize(&blockXSize, &blockYSize);
+        blockXSize = std::max(1, blockXSize);
+        blockYSize = std::max(1, blockYSize);
+        int unitWidth = blockXSize;
+        int unitHeight = blockYSize * std::max(1, s_minUnitPixels / (blockXSize * blockYSize));
+        int unitColumns = (width + unitWidth - 1) / unitWidth;
+        int unitRows = (height + unitHeight - 1) / unitHeight;
+        qint64 unitCount = qint64(unitColumns) * unitRows;
+
+        // A second pass is needed when the approximate range the histogram was laid out for missed values
+        for (int pass = 0; pass < 2 && ok && !m_cancelRequested; ++pass) {
+            m_blocksDone = 0;
+            // Each job takes a contiguous range of unit rows and reads it through the pooled dataset handle
+            // of its thread, GDAL datasets can't be shared between threads.
+            int jobCount = std::min(unitRows, m_blockPool.maxThreadCount() * 4);
+            std::vector<std::vector<Accumulator>> partials(jobCount, std::vector<Accumulator>(bandCount));
+            std::atomic<bool> failed = false;
+            for (int job = 0; job < jobCount; ++job) {
+                int firstRow = qint64(unitRows) * job / jobCount;
+                int lastRow = qint64(unitRows) * (job + 1) / jobCount;
+                m_blockPool.start([this, &filePath, &setups, &partials, &failed, job, firstRow, lastRow, unitWidth,
+                                   unitHeight, unitColumns, unitCount, width, height, bandCount]() {
+                    DatasetPool::Handle jobDataset = DatasetPool::instance()->acquire(filePath);
+                    if (!jobDataset) {
+                        failed = true;
+                        return;
+                    }
+                    std::vector<double> buffer;
+                    for (int row = firstRow; row < lastRow && !failed && !m_cancelRequested; ++row) {
+                        for (int column = 0; column < unitColumns && !failed && !m_cancelRequested; ++column) {
+                            QRect window = QRect(column * unitWidth, row * unitHeight, unitWidth, unitHeight)
+                                               .intersected(QRect(0, 0, width, height));
+                            for (int i = 1; i <= bandCount; ++i) {
+                                if (!accumulateWindow(jobDataset->GetRasterBand(i), window, window.size(),
+                                                      setups[i - 1], partials[job][i - 1], buffer)) {
+                                    failed = true;
+                                    break;
+                                }
+                            }
+                            qint64 done = ++m_blocksDone;
+                            // Only report whole percent steps, jobs finish blocks far more often than that.
+                            if (done * 100 / unitCount != (done - 1) * 100 / unitCount) {
+                                m_progress = double(done) / unitCount;
+                                emit progressChanged(m_progress);
+                            }
+                        }
+                    }
+                });
+            }
+            m_blockPool.waitForDone();
+            ok = !failed;
+
+            totals.assign(bandCount, Accumulator());
+            for (const std::vector<Accumulator> &partial : partials) {
+                for (int i = 0; i < bandCount; ++i)
+                    totals[i].merge(partial[i]);
+            }
+
+            bool covered = true;
+            for (int i = 0; i < bandCount; ++i) {
+                if (!setups[i].covers(totals[i])) {
+                    setups[i].setRange(totals[i].min, totals[i].max);
+                    covered = false;
+                }
+            }
+            if (covered)
+                break;
+            if (pass == 0 && ok)
+                qDebug() << "Approximate value range of" << filePath << "was too narrow, reading it again";
+        }
+    }
+    handle.reset();
+
+    if (m_cancelRequested) {
+        qDebug() << "Statistics computation for" << filePath << "cancelled";
+        return {};
+    }
+    if (!ok)
+        return {};
+
+    QList<BandStatistics> statistics;
+    for (int i = 0; i < bandCount; ++i) {
+        const Accumulator &total = totals[i];
+        BandStatistics band;
+        band.band = i + 1;
+        band.validCount = total.count;
+        if (total.count > 0) {
+            band.min = total.min;
+            band.max = total.max;
+            band.mean = total.mean;
+            band.stdDev = std::sqrt(total.m2 / total.count);
+        }
+        band.histogramMin = setups[i].histogramMin;
+        band.histogramMax = setups[i].histogramMax;
+        band.histogram = QList<qint64>(total.histogram.begin(), total.histogram.end());
+        band.approximate = approximate;
+        statistics.append(band);
+    }
+
+    // Approximate results never replace exact ones that are already cached.
+    if (!approximate || StatisticsCache::load(filePath, true).isEmpty())
+        StatisticsCache::store(filePath, statistics);
+    return statistics;
+}
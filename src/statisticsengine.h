@@ -0,0 +1,51 @@
+#ifndef STATISTICSENGINE_H
+#define STATISTICSENGINE_H
+
+#include <QObject>
+#include <QFutureWatcher>
+#include <QThreadPool>
+#include <atomic>
+#include "bandstatistics.h"
+
+// Computes per-band statistics and histograms for a raster on a worker thread and stores them in the
+// StatisticsCache. Exact statistics are computed from all natural blocks of the full resolution raster,
+// split into groups of block rows that are read in parallel, each through its own dataset handle.
+// Approximate statistics are read from the smallest overview that is still at least s_approximateSize
+// pixels across, or from a decimated read when the raster has no overviews.
+class StatisticsEngine : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit StatisticsEngine(QObject *parent = nullptr);
+    ~StatisticsEngine();
+
+    bool start(const QString &filePath, bool approximate);
+    void cancel();
+
+    inline bool running() const { return m_watcher.isRunning(); }
+    inline qreal progress() const { return m_progress.load(); }
+    inline QString filePath() const { return m_filePath; }
+    // Valid after finished(true) until the next start().
+    inline QList<BandStatistics> result() const { return m_result; }
+
+signals:
+    void runningChanged();
+    // Emitted from the worker thread; use queued (or auto) connections.
+    void progressChanged(qreal progress);
+    void finished(bool success);
+
+private:
+    QList<BandStatistics> compute(const QString &filePath, bool approximate);
+
+private:
+    QString m_filePath;
+    QFutureWatcher<QList<BandStatistics>> m_watcher;
+    QList<BandStatistics> m_result;
+    QThreadPool m_blockPool;
+    std::atomic<bool> m_cancelRequested = false;
+    std::atomic<qreal> m_progress = 0;
+    std::atomic<qint64> m_blocksDone = 0;
+};
+
+#endif // STATISTICSENGINE_H
@@ -1,7 +1,23 @@
 #include "thunderforestconfigserver.h"
+#include "datasetpool.h"
+#include "memorybudget.h"
+#include "perfcounters.h"
+#include "rasterreader.h"
+#include "tilerenderer.h"
 
 #include <QTcpServer>
 #include <QJsonObject>
+#include <QBuffer>
+#include <QCryptographicHash>
+#include <QFileInfo>
+#include <QDateTime>
+#include <QHttpHeaders>
+#include <QLocale>
+#include <QtConcurrent>
+#include <memory>
+
+// Largest byte range served from a layer's file in one response.
+static constexpr qint64 s_maxFileResponseBytes = 64 * 1024 * 1024;
 
 std::map<QString, QString> s_osmToThunderforestMapNames = { {"street", "atlas"}, {"satellite", ""}, { "cycle", "cycle" }, {"transit", "transport"}, {"night-transit", "transport-dark"}, {"terrain", "outdoors"}, {"hiking", "outdoors"} };
 
@@ -17,15 +33,54 @@ QJsonObject createOsmJson(const QString &apiKey, const QString &mapType) {
     return json;
 }
 
+QJsonObject createGeoTiffJson(const QString &address, const QString &layer, int maxZoomLevel) {
+    QJsonObject json;
+    json["UrlTemplate"] = address + "%z/%x/%y.png";
+    json["ImageFormat"] = "png";
+    json["QImageFormat"] = "ARGB32";
+    json["ID"] = QString("geotiff-%1").arg(layer);
+    json["MaximumZoomLevel"] = maxZoomLevel;
+    json["MapCopyRight"] = "";
+    json["DataCopyRight"] = "";
+    return json;
+}
+
+static QByteArray encodePng(const QImage &image)
+{
+    QByteArray png;
+    QBuffer buffer(&png);
+    buffer.open(QIODevice::WriteOnly);
+    image.save(&buffer, "PNG");
+    return png;
+}
+
+// Served for tiles outside the raster, so Qt Location caches them instead of retrying.
+static QByteArray transparentTile()
+{
+    static const QByteArray png = []() {
+        QImage image(TileRenderer::s_tileSize, TileRenderer::s_tileSize, QImage::Format_RGBA8888);
+        image.fill(Qt::transparent);
+        return encodePng(image);
+    }();
+    return png;
+}
+
 ThunderForestConfigServer::ThunderForestConfigServer(const QString &apiKey, QObject *parent)
     : QAbstractHttpServer{parent}
     , m_apiKey{apiKey}
 {}
 
+ThunderForestConfigServer::~ThunderForestConfigServer()
+{
+    // Running jobs hold pooled datasets, let them finish before the pool goes away
+    m_tilePool.clear();
+    m_tilePool.waitForDone();
+}
+
 bool ThunderForestConfigServer::listen()
 {
     m_tcpServer = new QTcpServer(this);
-    if(!m_tcpServer->listen(QHostAddress::Any, 0) || !bind(m_tcpServer)) {
+    if(!m_tcpServer->listen(QHostAddress::LocalHost, 0) || !bind(m_tcpServer)) {
         delete m_tcpServer;
         m_tcpServer = nullptr;
         return false;
@@ -49,6 +104,10 @@ bool ThunderForestConfigServer::handleRequest(const QHttpServerRequest &request,
         return true;
     }
 
+    QStringList parts = path.split('/', Qt::SkipEmptyParts);
+    if (parts.size() >= 2 && parts[0] == "geotiff")
+        return handleGeoTiffRequest(request, parts, responder);
+
     for (auto &mapType : s_osmToThunderforestMapNames)
     {
         QString targetPath = QString("/%1").arg(mapType.first);
@@ -63,6 +122,175 @@ bool ThunderForestConfigServer::handleRequest(const QHttpServerRequest &request,
     return false;
 }
 
+QFuture<QString> ThunderForestConfigServer::publishLayer(const QString &filePath)
+{
+    QFileInfo info(filePath);
+    QByteArray key = QString("%1|%2|%3").arg(info.absoluteFilePath()).arg(info.size())
+                         .arg(info.lastModified().toMSecsSinceEpoch()).toUtf8();
+    QString layer = QString::fromLatin1(QCryptographicHash::hash(key, QCryptographicHash::Sha1).toHex().left(16));
+    if (m_layers.contains(layer))
+        return QtFuture::makeReadyValueFuture(layer);
+
+    return QtConcurrent::run(&ThunderForestConfigServer::readLayer, filePath).then(this, [this, layer](const Layer &entry) {
+        if (entry.filePath.isEmpty())
+            return QString();
+        m_layers.insert(layer, entry);
+        qDebug() << "Serving" << entry.filePath << "as tile layer" << layer << "at" << layerAddress(layer);
+        return layer;
+    });
+}
+
+ThunderForestConfigServer::Layer ThunderForestConfigServer::readLayer(const QString &filePath)
+{
+    Layer entry;
+    DatasetPool::Handle dataset = DatasetPool::instance()->acquire(filePath);
+    if (!dataset)
+        return entry;
+    entry.mercatorBounds = TileRenderer::mercatorBounds(dataset.get());
+    if (entry.mercatorBounds.isEmpty()) {
+        qWarning() << filePath << "can't be served as tiles, it is not georeferenced";
+        return entry;
+    }
+    // A couple of levels past native resolution, Qt Location overzooms beyond that
+    entry.maxZoomLevel = std::min(TileRenderer::nativeZoomLevel(dataset.get(), entry.mercatorBounds) + 2, 22);
+    // One stretch for all tiles so that they match
+    if (RasterReader::needsStretch(dataset.get()))
+        entry.stretch = RasterReader::computeStretch(dataset.get(), RasterReader::PercentileStretch);
+    entry.filePath = filePath;
+    return entry;
+}
+
+QString ThunderForestConfigServer::layerAddress(const QString &layer)
+{
+    return QString("http://127.0.0.1:%1/geotiff/%2/").arg(serverPort()).arg(layer);
+}
+
+bool ThunderForestConfigServer::handleGeoTiffRequest(const QHttpServerRequest &request, const QStringList &parts,
+                                                     QHttpServerResponder &responder)
+{
+    auto it = m_layers.constFind(parts.value(1));
+    if (it == m_layers.cend())
+        return false;
+
+    // /geotiff/<layer>/file.tif: the file itself
+    if (parts.size() == 3 && parts[2] == "file.tif")
+        return handleFileRequest(request, it->filePath, responder);
+
+    // /geotiff/<layer> or /geotiff/<layer>/<map type>: provider JSON
+    if (parts.size() <= 3) {
+        responder.write(QJsonDocument(createGeoTiffJson(layerAddress(it.key()), it.key(), it->maxZoomLevel)));
+        return true;
+    }
+
+    // /geotiff/<layer>/<z>/<x>/<y>.png
+    if (parts.size() != 5 || !parts[4].endsWith(".png"))
+        return false;
+    bool zOk = false, xOk = false, yOk = false;
+    int z = parts[2].toInt(&zOk);
+    int x = parts[3].toInt(&xOk);
+    int y = parts[4].chopped(4).toInt(&yOk);
+    if (!zOk || !xOk || !yOk || z < 0 || z > 30 || x < 0 || y < 0 || x >= (1 << z) || y >= (1 << z))
+        return false;
+
+    if (!TileRenderer::tileBounds(z, x, y).intersects(it->mercatorBounds)) {
+        responder.write(transparentTile(), "image/png");
+        return true;
+    }
+
+    // The responder is written from this thread once the worker is done
+    auto sharedResponder = std::make_shared<QHttpServerResponder>(std::move(responder));
+    Layer layer = it.value();
+    QtConcurrent::run(&m_tilePool, [layer, z, x, y]() {
+        PerfCounters::Scope scope(PerfCounters::Warp);
+        DatasetPool::Handle dataset = DatasetPool::instance()->acquire(layer.filePath);
+        QImage image = TileRenderer::render(dataset.get(), layer.mercatorBounds, z, x, y, layer.stretch);
+        MemoryBudget::Charge charge(image.sizeInBytes());
+        return image.isNull() ? QByteArray() : encodePng(image);
+    }).then(this, [sharedResponder](const QByteArray &png) {
+        if (png.isEmpty())
+            sharedResponder->write(QHttpServerResponder::StatusCode::InternalServerError);
+        else
+            sharedResponder->write(png, "image/png");
+    });
+    return true;
+}
+
+bool ThunderForestConfigServer::handleFileRequest(const QHttpServerRequest &request, const QString &filePath,
+                                                  QHttpServerResponder &responder)
+{
+    QFileInfo info(filePath);
+    if (!info.isFile())
+        return false;
+
+    qint64 size = info.size();
+    QHttpHeaders headers;
+    headers.append(QHttpHeaders::WellKnownHeader::ContentType, "image/tiff");
+    headers.append(QHttpHeaders::WellKnownHeader::AcceptRanges, "bytes");
+    headers.append(QHttpHeaders::WellKnownHeader::LastModified,
+                   QLocale::c().toString(info.lastModified().toUTC(), "ddd, dd MMM yyyy hh:mm:ss 'GMT'"));
+    if (request.method() == QHttpServerRequest::Method::Head) {
+        headers.append(QHttpHeaders::WellKnownHeader::ContentLength, QByteArray::number(size));
+        responder.writeStatusLine(QHttpServerResponder::StatusCode::Ok);
+        responder.writeHeaders(headers);
+        responder.writeBody(QByteArray());
+        return true;
+    }
+
+    // Only single ranges, several are answered with the one range covering them all
+    qint64 start = 0;
+    qint64 end = size - 1;
+    QByteArray range = request.headers().value(QHttpHeaders::WellKnownHeader::Range).toByteArray().trimmed();
+    bool partial = range.startsWith("bytes=");
+    if (partial) {
+        start = size;
+        end = -1;
+        for (const QByteArray &part : range.mid(6).split(',')) {
+            QList<QByteArray> bounds = part.trimmed().split('-');
+            bool startOk = false, endOk = false;
+            qint64 first = bounds.value(0).toLongLong(&startOk);
+            qint64 last = bounds.value(1).toLongLong(&endOk);
+            if (bounds.size() != 2 || (!startOk && !endOk)) {
+                start = size;
+                break;
+            }
+            if (!startOk) {
+                // Suffix range, the last bytes of the file
+                first = size - last;
+                last = size - 1;
+            } else if (!endOk) {
+                last = size - 1;
+            }
+            start = std::min(start, std::max<qint64>(first, 0));
+            end = std::max(end, std::min(last, size - 1));
+        }
+    }
+    // Reads are held in memory while they're written, bound them for files opened without ranges
+    if (start > end || end - start + 1 > s_maxFileResponseBytes) {
+        QHttpHeaders rangeHeaders;
+        rangeHeaders.append(QHttpHeaders::WellKnownHeader::ContentRange, QString("bytes */%1").arg(size));
+        responder.write(QByteArray(), rangeHeaders, QHttpServerResponder::StatusCode::RequestRangeNotSatisfiable);
+        return true;
+    }
+    if (partial)
+        headers.append(QHttpHeaders::WellKnownHeader::ContentRange, QString("bytes %1-%2/%3").arg(start).arg(end).arg(size));
+
+    auto sharedResponder = std::make_shared<QHttpServerResponder>(std::move(responder));
+    qint64 length = end - start + 1;
+    QtConcurrent::run(&m_tilePool, [filePath, start, length]() {
+        QFile file(filePath);
+        if (!file.open(QIODevice::ReadOnly) || !file.seek(start))
+            return QByteArray();
+        return file.read(length);
+    }).then(this, [sharedResponder, headers, partial, length](const QByteArray &data) {
+        if (data.size() != length)
+            sharedResponder->write(QHttpServerResponder::StatusCode::InternalServerError);
+        else
+            sharedResponder->write(data, headers, partial ? QHttpServerResponder::StatusCode::PartialContent
+                                                          : QHttpServerResponder::StatusCode::Ok);
+    });
+    return true;
+}
+
 void ThunderForestConfigServer::missingHandler(const QHttpServerRequest &request, QHttpServerResponder &responder)
 {
     qDebug() << "Missing" << request.url();
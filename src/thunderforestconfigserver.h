@@ -4,24 +4,65 @@
 #include <QAbstractHttpServer>
 #include <QHttpServerRequest>
 #include <QHttpServerResponder>
+#include <QFuture>
+#include <QHash>
+#include <QRectF>
+#include <QThreadPool>
+#include "pixelconvert.h"
 
 class QTcpServer;
 
+// Serves the provider JSON the OSM plugin reads for each map type, pointing it at Thunderforest.
+//
+// GeoTIFFs published with publishLayer() are also served as Web Mercator XYZ tiles under
+// /geotiff/<layer>/{z}/{x}/{y}.png, with a matching provider JSON under /geotiff/<layer>/ (and any
+// map type name below it), so a raster can be shown as a native tiled Map layer through the OSM
+// plugin's providersrepository or custom host parameters. Tiles are rendered and encoded on a worker
+// pool and the response is written once they are done.
+//
+// The file of a local layer is also served as is, with byte range support, under
+// /geotiff/<layer>/file.tif. Opening that URL in the viewer reads the file the way a cloud optimized
+// GeoTIFF on a web server is read, which makes remote access and the RangeCache testable locally.
 class ThunderForestConfigServer : public QAbstractHttpServer
 {
 public:
     explicit ThunderForestConfigServer(const QString &apiKey = QString(), QObject *parent = nullptr);
+    ~ThunderForestConfigServer();
     bool listen();
     quint16 serverPort();
 
+    // Gives the name of the layer serving filePath, or an empty string when it can't be opened or is
+    // not georeferenced. The name changes when the file does, so cached tiles of an older version are
+    // not reused. The file is opened, and its stretch computed, on a worker thread; the layer is served
+    // once the future has finished.
+    QFuture<QString> publishLayer(const QString &filePath);
+    // Base URL of a layer's tiles and provider JSON, ending with a slash.
+    QString layerAddress(const QString &layer);
+
     // QAbstractHttpServer interface
 protected:
     bool handleRequest(const QHttpServerRequest &request, QHttpServerResponder &responder);
     void missingHandler(const QHttpServerRequest &request, QHttpServerResponder &responder);
 
+private:
+    struct Layer
+    {
+        QString filePath;
+        QRectF mercatorBounds;
+        int maxZoomLevel = 0;
+        QList<ChannelStretch> stretch;
+    };
+
+    // Reads the bounds, zoom levels and stretch of a layer on a worker. The file path is empty on failure.
+    static Layer readLayer(const QString &filePath);
+    bool handleGeoTiffRequest(const QHttpServerRequest &request, const QStringList &parts, QHttpServerResponder &responder);
+    bool handleFileRequest(const QHttpServerRequest &request, const QString &filePath, QHttpServerResponder &responder);
+
 private:
     QTcpServer *m_tcpServer;
     QString m_apiKey;
+    QHash<QString, Layer> m_layers;     // GUI thread only, jobs get a copy
+    QThreadPool m_tilePool;
 };
 
 #endif // THUNDERFORESTCONFIGSERVER_H
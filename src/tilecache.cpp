@@ -0,0 +1,94 @@
+#include "tilecache.h"
+#include "memorybudget.h"
+
+TileCache::TileCache(qint64 maxBytes)
+    : m_maxBytes{maxBytes}
+{
+    MemoryBudget::instance()->registerCache(this);
+}
+
+TileCache::~TileCache()
+{
+    clear();
+    MemoryBudget::instance()->unregisterCache(this);
+}
+
+QImage TileCache::emptyTile()
+{
+    static const QImage empty = [] {
+        QImage image(1, 1, QImage::Format_Alpha8);
+        image.fill(0);
+        return image;
+    }();
+    return empty;
+}
+
+QImage TileCache::find(const TileKey &key)
+{
+    auto it = m_entries.find(key);
+    if (it == m_entries.end()) {
+        ++m_misses;
+        return QImage();
+    }
+
+    ++m_hits;
+    m_lru.splice(m_lru.begin(), m_lru, it->lruPosition);
+    it->lastUse = MemoryBudget::instance()->touch();
+    return it->image;
+}
+
+void TileCache::insert(const TileKey &key, const QImage &image)
+{
+    MemoryBudget *budget = MemoryBudget::instance();
+    auto it = m_entries.find(key);
+    if (it != m_entries.end()) {
+        m_bytes -= it->image.sizeInBytes();
+        budget->release(it->image.sizeInBytes());
+        m_lru.erase(it->lruPosition);
+        m_entries.erase(it);
+    }
+
+    m_lru.push_front(key);
+    m_entries.insert(key, Entry{image, m_lru.begin(), budget->touch()});
+    m_bytes += image.sizeInBytes();
+    trim();
+    // May evict older tiles of this or other caches
+    budget->charge(image.sizeInBytes());
+}
+
+void TileCache::clear()
+{
+    MemoryBudget::instance()->release(m_bytes);
+    m_entries.clear();
+    m_lru.clear();
+    m_bytes = 0;
+}
+
+void TileCache::setMaxBytes(qint64 maxBytes)
+{
+    m_maxBytes = maxBytes;
+    trim();
+}
+
+quint64 TileCache::oldestUse() const
+{
+    return m_lru.empty() ? 0 : m_entries.constFind(m_lru.back())->lastUse;
+}
+
+void TileCache::evictOldest()
+{
+    if (m_lru.empty())
+        return;
+    auto it = m_entries.find(m_lru.back());
+    m_bytes -= it->image.sizeInBytes();
+    MemoryBudget::instance()->release(it->image.sizeInBytes());
+    m_entries.erase(it);
+    m_lru.pop_back();
+}
+
+void TileCache::trim()
+{
+    // Never evict the tile that was just inserted, even if it alone is over the limit.
+    while (m_bytes > m_maxBytes && m_lru.size() > 1)
+        evictOldest();
+}
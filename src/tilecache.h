@@ -0,0 +1,78 @@
+#ifndef TILECACHE_H
+#define TILECACHE_H
+
+#include <QHash>
+#include <QImage>
+#include <list>
+
+// Identifies one tile of a raster. Tiles of a level cover (tileSize << level) raster pixels per side,
+// so level 0 is full resolution and each following level halves the resolution.
+struct TileKey
+{
+    int level = 0;
+    int x = 0;
+    int y = 0;
+};
+
+inline bool operator==(const TileKey &a, const TileKey &b)
+{
+    return a.level == b.level && a.x == b.x && a.y == b.y;
+}
+
+inline size_t qHash(const TileKey &key, size_t seed = 0)
+{
+    return qHashMulti(seed, key.level, key.x, key.y);
+}
+
+// Least recently used cache of decoded tiles, bounded by the number of bytes the images hold. The
+// tiles also count towards the process wide MemoryBudget, which may evict them to make room for the
+// tiles of other caches.
+class TileCache
+{
+public:
+    explicit TileCache(qint64 maxBytes);
+    ~TileCache();
+    Q_DISABLE_COPY(TileCache)
+
+    // Stands in for a tile that is entirely nodata or masked out, so it is cached (and not decoded
+    // again) without holding any pixels, and never uploaded.
+    static QImage emptyTile();
+    static inline bool isEmptyTile(const QImage &image) { return image.format() == QImage::Format_Alpha8 && image.width() == 1; }
+
+    // Returns a null image on a miss. A hit makes the tile the most recently used one.
+    QImage find(const TileKey &key);
+    inline bool contains(const TileKey &key) const { return m_entries.contains(key); }
+    void insert(const TileKey &key, const QImage &image);
+    void clear();
+
+    inline qint64 maxBytes() const { return m_maxBytes; }
+    void setMaxBytes(qint64 maxBytes);
+    inline qint64 bytes() const { return m_bytes; }
+    inline qsizetype count() const { return m_entries.size(); }
+
+    inline quint64 hits() const { return m_hits; }
+    inline quint64 misses() const { return m_misses; }
+
+    // MemoryBudget stamp of the least recently used tile, 0 when empty.
+    quint64 oldestUse() const;
+    void evictOldest();
+
+private:
+    void trim();
+
+private:
+    struct Entry {
+        QImage image;
+        std::list<TileKey>::iterator lruPosition;
+        quint64 lastUse = 0;
+    };
+
+    QHash<TileKey, Entry> m_entries;
+    std::list<TileKey> m_lru; // Most recently used first
+    qint64 m_maxBytes;
+    qint64 m_bytes = 0;
+    quint64 m_hits = 0;
+    quint64 m_misses = 0;
+};
+
+#endif // TILECACHE_H
@@ -0,0 +1,205 @@
+#include "tiledecoder.h"
+#include "rasterreader.h"
+#include "datasetpool.h"
+#include "perfcounters.h"
+#include <QMutexLocker>
+#include <QDebug>
+#include <algorithm>
+#include <functional>
+
+namespace {
+
+// Hands itself to its work, so that a started job can take itself off its decoder's queued jobs.
+class DecodeJob : public QRunnable
+{
+public:
+    explicit DecodeJob(std::function<void(QRunnable *)> work) : m_work(std::move(work)) {}
+    void run() override { m_work(this); }
+
+private:
+    std::function<void(QRunnable *)> m_work;
+};
+
+} // namespace
+
+TileDecoder::TileDecoder(QObject *parent)
+    : QObject{parent}
+{}
+
+TileDecoder::~TileDecoder()
+{
+    ++m_generation;
+    cancelQueuedJobs();
+    QMutexLocker locker(&m_jobsMutex);
+    while (m_activeJobs > 0)
+        m_jobsDone.wait(&m_jobsMutex);
+}
+
+void TileDecoder::setThreadPool(QThreadPool *pool)
+{
+    cancelQueuedJobs();
+    m_pending.clear();
+    m_pool = pool ? pool : &m_ownPool;
+}
+
+void TileDecoder::cancelQueuedJobs()
+{
+    QMutexLocker locker(&m_jobsMutex);
+    for (QRunnable *job : std::as_const(m_queuedJobs)) {
+        // A job the pool has just started can't be taken back, it finds its generation stale instead
+        if (m_pool->tryTake(job)) {
+            delete job;
+            --m_activeJobs;
+        }
+    }
+    m_queuedJobs.clear();
+}
+
+void TileDecoder::jobFinished()
+{
+    QMutexLocker locker(&m_jobsMutex);
+    --m_activeJobs;
+    m_jobsDone.wakeAll();
+}
+
+quint64 TileDecoder::reset(const QString &filePath, GDALRIOResampleAlg resampleAlg, RasterReader::StretchMode stretchMode)
+{
+    ++m_generation;
+    cancelQueuedJobs();
+    m_pending.clear();
+    m_filePath = filePath;
+    m_resampleAlg = resampleAlg;
+    m_stretchMode = stretchMode;
+
+    {
+        QMutexLocker locker(&m_mappedMutex);
+        m_mapped.reset();
+    }
+    QMutexLocker locker(&m_wantedMutex);
+    m_wanted.clear();
+    return m_generation;
+}
+
+void TileDecoder::setWanted(const QSet<TileKey> &keys)
+{
+    QMutexLocker locker(&m_wantedMutex);
+    m_wanted = keys;
+}
+
+void TileDecoder::request(const TileKey &key, const QRect &window, const QSize &outSize, int priority)
+{
+    requestBatch({ key }, { QRect(QPoint(0, 0), outSize) }, window, outSize, priority);
+}
+
+void TileDecoder::requestBatch(const QList<TileKey> &keys, const QList<QRect> &outRects, const QRect &window,
+                               const QSize &outSize, int priority)
+{
+    if (m_filePath.isEmpty() || keys.isEmpty())
+        return;
+    for (const TileKey &key : keys) {
+        if (m_pending.contains(key))
+            return;
+    }
+
+    for (const TileKey &key : keys)
+        m_pending.insert(key);
+    quint64 generation = m_generation;
+    QString filePath = m_filePath;
+    GDALRIOResampleAlg resampleAlg = m_resampleAlg;
+    RasterReader::StretchMode stretchMode = m_stretchMode;
+    QRunnable *job = new DecodeJob([this, generation, keys, outRects, window, outSize, filePath, resampleAlg,
+                                    stretchMode](QRunnable *self) {
+        {
+            QMutexLocker locker(&m_jobsMutex);
+            m_queuedJobs.remove(self);
+        }
+        QList<QImage> images(keys.size());
+        // A batch is read whole as long as any of its tiles is still wanted
+        bool stale = std::all_of(keys.cbegin(), keys.cend(), [&](const TileKey &key) { return isStale(generation, key); });
+        if (!stale) {
+            // Every worker thread reads through its own pooled handle, kept open between tiles
+            DatasetPool::Handle handle = DatasetPool::instance()->acquire(filePath);
+            if (GDALDataset *dataset = handle.get()) {
+                QList<ChannelStretch> stretch = stretchFor(generation, dataset, stretchMode);
+                PerfCounters *counters = PerfCounters::instance();
+                RasterReader::Timings timings;
+                qint64 start = counters->now();
+                int overviewLevel = RasterReader::selectOverview(dataset, window, outSize);
+                if (RasterReader::isEmpty(dataset, window, overviewLevel)) {
+                    images.fill(TileCache::emptyTile());
+                } else {
+                    std::shared_ptr<const MappedRaster> mapped = mappedFor(generation, dataset);
+                    QImage image = mapped && mapped->canRead(window, outSize, overviewLevel, resampleAlg)
+                                       ? mapped->read(window, outSize, &timings)
+                                       : RasterReader::read(dataset, window, outSize, overviewLevel, resampleAlg, stretch, &timings);
+                    counters->record(PerfCounters::Read, start, timings.readNs);
+                    if (timings.conversionNs > 0)
+                        counters->record(PerfCounters::Conversion, start + timings.readNs, timings.conversionNs);
+                    if (timings.scalingNs > 0)
+                        counters->record(PerfCounters::Scaling, start + timings.readNs + timings.conversionNs, timings.scalingNs);
+                    counters->addBytesRead(timings.bytes);
+
+                    // Tiles that turned out to be all nodata are cached as empty and never uploaded
+                    for (qsizetype i = 0; i < keys.size() && !image.isNull(); ++i) {
+                        images[i] = keys.size() == 1 ? image : image.copy(outRects[i]);
+                        if (RasterReader::isTransparent(images[i]))
+                            images[i] = TileCache::emptyTile();
+                    }
+                }
+            }
+        }
+        QMetaObject::invokeMethod(this, [this, generation, keys, images]() {
+            for (qsizetype i = 0; i < keys.size(); ++i)
+                onJobFinished(generation, keys[i], images[i]);
+        }, Qt::QueuedConnection);
+        jobFinished();
+    });
+
+    {
+        QMutexLocker locker(&m_jobsMutex);
+        m_queuedJobs.insert(job);
+        ++m_activeJobs;
+    }
+    m_pool->start(job, priority);
+}
+
+bool TileDecoder::isStale(quint64 generation, const TileKey &key) const
+{
+    if (generation != m_generation)
+        return true;
+    QMutexLocker locker(&m_wantedMutex);
+    return !m_wanted.contains(key);
+}
+
+QList<ChannelStretch> TileDecoder::stretchFor(quint64 generation, GDALDataset *dataset, RasterReader::StretchMode mode)
+{
+    QMutexLocker locker(&m_stretchMutex);
+    if (m_stretchGeneration != generation) {
+        m_stretch = RasterReader::needsStretch(dataset) ? RasterReader::computeStretch(dataset, mode)
+                                                        : QList<ChannelStretch>();
+        m_stretchGeneration = generation;
+    }
+    return m_stretch;
+}
+
+std::shared_ptr<const MappedRaster> TileDecoder::mappedFor(quint64 generation, GDALDataset *dataset)
+{
+    QMutexLocker locker(&m_mappedMutex);
+    if (m_mappedGeneration != generation) {
+        m_mapped = MappedRaster::map(dataset);
+        m_mappedGeneration = generation;
+        if (m_mapped)
+            qDebug() << "Reading" << dataset->GetDescription() << "through a memory mapping";
+    }
+    return m_mapped;
+}
+
+void TileDecoder::onJobFinished(quint64 generation, const TileKey &key, const QImage &image)
+{
+    if (generation != m_generation)
+        return;
+
+    m_pending.remove(key);
+    if (!image.isNull())
+        emit tileDecoded(key, image);
+}
@@ -0,0 +1,94 @@
+#ifndef TILEDECODER_H
+#define TILEDECODER_H
+
+#include <QObject>
+#include <QThreadPool>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QSet>
+#include <QImage>
+#include <atomic>
+#include <gdal_priv.h>
+#include "tilecache.h"
+#include "rasterreader.h"
+#include "mappedraster.h"
+
+// Decodes raster tiles on a pool of worker threads. Every worker reads through its own GDAL dataset
+// handle from the DatasetPool, since a handle must not be used from two threads at once. The pool is the
+// decoder's own unless setThreadPool() shares one between decoders, e.g. all sheets of a mosaic.
+//
+// reset() starts a new generation whenever the source or decode settings change: queued jobs of older
+// generations are discarded and their results, should they still arrive, are ignored. Within a
+// generation, setWanted() tells the decoder which tiles are in view, and jobs for tiles that scrolled
+// or zoomed out of view are dropped before doing any I/O.
+class TileDecoder : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit TileDecoder(QObject *parent = nullptr);
+    ~TileDecoder();
+
+    // Must be set before the first request, a null pool goes back to the decoder's own. The pool has
+    // to outlive the decoder.
+    void setThreadPool(QThreadPool *pool);
+
+    quint64 reset(const QString &filePath, GDALRIOResampleAlg resampleAlg, RasterReader::StretchMode stretchMode);
+    inline quint64 generation() const { return m_generation.load(); }
+
+    void setWanted(const QSet<TileKey> &keys);
+    // Jobs with a higher priority are started first.
+    void request(const TileKey &key, const QRect &window, const QSize &outSize, int priority = 0);
+    // Decodes neighbouring tiles with a single read of window at outSize, split into the tiles at
+    // outRects. Tiles that share a (compressed) block are then decoded together, instead of each
+    // worker decompressing the block again for its own tile. Nothing is queued if any of the tiles is
+    // already pending.
+    void requestBatch(const QList<TileKey> &keys, const QList<QRect> &outRects, const QRect &window,
+                      const QSize &outSize, int priority = 0);
+    inline bool isPending(const TileKey &key) const { return m_pending.contains(key); }
+    inline qsizetype pendingCount() const { return m_pending.size(); }
+
+signals:
+    // Only emitted for tiles decoded for the current generation. Tiles without any valid pixels come as
+    // TileCache::emptyTile().
+    void tileDecoded(const TileKey &key, const QImage &image);
+
+private:
+    void cancelQueuedJobs();
+    void jobFinished();
+    bool isStale(quint64 generation, const TileKey &key) const;
+    QList<ChannelStretch> stretchFor(quint64 generation, GDALDataset *dataset, RasterReader::StretchMode mode);
+    std::shared_ptr<const MappedRaster> mappedFor(quint64 generation, GDALDataset *dataset);
+    void onJobFinished(quint64 generation, const TileKey &key, const QImage &image);
+
+private:
+    QThreadPool m_ownPool;
+    QThreadPool *m_pool = &m_ownPool;
+    // Jobs of this decoder that are queued or running. A shared pool may hold other decoders' jobs, so
+    // only these are taken back out of it, and the destructor waits for the running ones.
+    QMutex m_jobsMutex;
+    QWaitCondition m_jobsDone;
+    QSet<QRunnable *> m_queuedJobs;
+    int m_activeJobs = 0;
+    std::atomic<quint64> m_generation = 0;
+    QString m_filePath;
+    GDALRIOResampleAlg m_resampleAlg = GRIORA_NearestNeighbour;
+    RasterReader::StretchMode m_stretchMode = RasterReader::PercentileStretch;
+    QSet<TileKey> m_pending;          // GUI thread only
+
+    mutable QMutex m_wantedMutex;
+    QSet<TileKey> m_wanted;
+
+    // Contrast stretch for non-Byte data, computed by the first job of a generation and shared by all
+    // tiles so that they match.
+    QMutex m_stretchMutex;
+    quint64 m_stretchGeneration = 0;
+    QList<ChannelStretch> m_stretch;
+
+    // Mapping of the file for uncompressed 8-bit GeoTIFFs, tried by the first job of a generation.
+    QMutex m_mappedMutex;
+    quint64 m_mappedGeneration = 0;
+    std::shared_ptr<const MappedRaster> m_mapped;
+};
+
+#endif // TILEDECODER_H
@@ -0,0 +1,197 @@
+#include "tilerenderer.h"
+#include "rasterreader.h"
+#include <QDebug>
+#include <gdalwarper.h>
+#include <gdal_alg.h>
+#include <ogr_spatialref.h>
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <vector>
+
+// Half the width of the Web Mercator world square, in metres.
+static constexpr double s_originShift = 20037508.342789244;
+// Tolerance of the approximate transformer in tile pixels, the same as gdalwarp's default.
+static constexpr double s_approximationError = 0.125;
+
+static OGRSpatialReference webMercator()
+{
+    OGRSpatialReference srs;
+    srs.importFromEPSG(3857);
+    srs.SetAxisMappingStrategy(OAMS_TRADITIONAL_GIS_ORDER);
+    return srs;
+}
+
+QRectF TileRenderer::mercatorBounds(GDALDataset *dataset)
+{
+    double geoTransform[6];
+    const char *projWkt = dataset ? dataset->GetProjectionRef() : nullptr;
+    if (!projWkt || strlen(projWkt) == 0 || dataset->GetGeoTransform(geoTransform) != CE_None)
+        return QRectF();
+
+    OGRSpatialReference srcSRS;
+    srcSRS.importFromWkt(projWkt);
+    srcSRS.SetAxisMappingStrategy(OAMS_TRADITIONAL_GIS_ORDER);
+    OGRSpatialReference dstSRS = webMercator();
+    std::unique_ptr<OGRCoordinateTransformation> transform(OGRCreateCoordinateTransformation(&srcSRS, &dstSRS));
+    if (!transform)
+        return QRectF();
+
+    // Corners of the raster in source coordinates, the geotransform may be rotated
+    double width = dataset->GetRasterXSize();
+    double height = dataset->GetRasterYSize();
+    double minX = INFINITY, minY = INFINITY, maxX = -INFINITY, maxY = -INFINITY;
+    for (double px : { 0.0, width }) {
+        for (double py : { 0.0, height }) {
+            double x = geoTransform[0] + px * geoTransform[1] + py * geoTransform[2];
+            double y = geoTransform[3] + px * geoTransform[4] + py * geoTransform[5];
+            minX = std::min(minX, x);
+            maxX = std::max(maxX, x);
+            minY = std::min(minY, y);
+            maxY = std::max(maxY, y);
+        }
+    }
+
+    // Densified, since edges that are straight in the source are curves in Web Mercator
+    double outMinX, outMinY, outMaxX, outMaxY;
+    if (!transform->TransformBounds(minX, minY, maxX, maxY, &outMinX, &outMinY, &outMaxX, &outMaxY, 21)) {
+        qWarning() << "Failed to transform the bounds of" << dataset->GetDescription() << "to Web Mercator";
+        return QRectF();
+    }
+    return QRectF(QPointF(outMinX, outMinY), QPointF(outMaxX, outMaxY));
+}
+
+QRectF TileRenderer::tileBounds(int z, int x, int y)
+{
+    double span = 2 * s_originShift / double(1 << z);
+    // Tile rows count down from the north edge, y grows upwards in Web Mercator
+    return QRectF(-s_originShift + x * span, s_originShift - (y + 1) * span, span, span);
+}
+
+int TileRenderer::nativeZoomLevel(GDALDataset *dataset, const QRectF &mercatorBounds)
+{
+    if (!dataset || mercatorBounds.isEmpty())
+        return 0;
+    double resolution = mercatorBounds.width() / dataset->GetRasterXSize();
+    return std::clamp(int(std::ceil(std::log2(2 * s_originShift / (s_tileSize * resolution)))), 0, 30);
+}
+
+QImage TileRenderer::render(GDALDataset *dataset, const QRectF &mercatorBounds, int z, int x, int y,
+                            const QList<ChannelStretch> &stretch)
+{
+    if (!dataset || dataset->GetRasterCount() < 1 || mercatorBounds.isEmpty())
+        return QImage();
+
+    QRectF bounds = tileBounds(z, x, y);
+    int bandCount = dataset->GetRasterCount();
+    int colorBands = bandCount >= 3 ? 3 : 1;
+    GDALRasterBand *alphaBand = bandCount > colorBands ? dataset->GetRasterBand(colorBands + 1) : nullptr;
+    if (alphaBand && alphaBand->GetColorInterpretation() != GCI_AlphaBand)
+        alphaBand = nullptr;
+
+    // Warp from the overview closest to the tile resolution, zoomed out tiles of a large raster would
+    // otherwise read all of it.
+    double decimation = (bounds.width() / s_tileSize) / (mercatorBounds.width() / dataset->GetRasterXSize());
+    QRect rasterRect(0, 0, dataset->GetRasterXSize(), dataset->GetRasterYSize());
+    QSize outSize(std::max(1, int(rasterRect.width() / decimation)), std::max(1, int(rasterRect.height() / decimation)));
+    int overviewLevel = RasterReader::selectOverview(dataset, rasterRect, outSize);
+    GDALDatasetUniquePtr overview;
+    if (overviewLevel >= 0)
+        overview.reset(GDALCreateOverviewDataset(dataset, overviewLevel, true));
+    GDALDataset *source = overview ? overview.get() : dataset;
+
+    GDALDriver *memDriver = GetGDALDriverManager()->GetDriverByName("MEM");
+    GDALDataType dataType = dataset->GetRasterBand(1)->GetRasterDataType();
+    GDALDatasetUniquePtr tile(memDriver->Create("", s_tileSize, s_tileSize, colorBands, dataType, nullptr));
+    if (!tile || tile->AddBand(GDT_Byte) != CE_None)
+        return QImage();
+    // Palette indices are warped as they are and the tile reads back as Indexed8 with the source's colours
+    bool paletted = !RasterReader::colorTable(dataset).isEmpty();
+    if (paletted) {
+        tile->GetRasterBand(1)->SetColorInterpretation(GCI_PaletteIndex);
+        tile->GetRasterBand(1)->SetColorTable(dataset->GetRasterBand(1)->GetColorTable());
+    }
+    double geoTransform[6] = { bounds.left(), bounds.width() / s_tileSize, 0,
+                               bounds.bottom(), 0, -bounds.height() / s_tileSize };
+    tile->SetGeoTransform(geoTransform);
+    OGRSpatialReference tileSRS = webMercator();
+    tile->SetSpatialRef(&tileSRS);
+
+    void *transformer = GDALCreateGenImgProjTransformer2(source, tile.get(), nullptr);
+    if (!transformer) {
+        qWarning() << "Failed to create a transformer from" << dataset->GetDescription() << "to Web Mercator";
+        return QImage();
+    }
+    void *approxTransformer = GDALCreateApproxTransformer(GDALGenImgProjTransform, transformer, s_approximationError);
+    GDALApproxTransformerOwnsSubtransformer(approxTransformer, TRUE);
+
+    GDALWarpOptions *options = GDALCreateWarpOptions();
+    options->hSrcDS = GDALDataset::ToHandle(source);
+    options->hDstDS = GDALDataset::ToHandle(tile.get());
+    options->nBandCount = colorBands;
+    options->panSrcBands = static_cast<int*>(CPLMalloc(sizeof(int) * colorBands));
+    options->panDstBands = static_cast<int*>(CPLMalloc(sizeof(int) * colorBands));
+    for (int i = 0; i < colorBands; ++i) {
+        options->panSrcBands[i] = i + 1;
+        options->panDstBands[i] = i + 1;
+    }
+    options->nDstAlphaBand = colorBands + 1;
+    // An explicit mask (internal or .msk) takes precedence over nodata values, as it does in GDAL's
+    // GetMaskBand(). Given neither an alpha band nor nodata values, the warper masks the source with
+    // such a per-dataset mask band itself.
+    if (alphaBand) {
+        options->nSrcAlphaBand = colorBands + 1;
+    } else if (source->GetRasterBand(1)->GetMaskFlags() != GMF_PER_DATASET) {
+        // As in RasterReader::read(), a pixel is transparent only when every colour band is nodata, so
+        // a band without a nodata value leaves all pixels valid.
+        std::vector<double> noData(colorBands);
+        bool allHaveNoData = true;
+        for (int i = 0; i < colorBands && allHaveNoData; ++i) {
+            int hasNoData = FALSE;
+            noData[i] = source->GetRasterBand(i + 1)->GetNoDataValue(&hasNoData);
+            allHaveNoData = hasNoData;
+        }
+        if (allHaveNoData) {
+            options->padfSrcNoDataReal = static_cast<double*>(CPLMalloc(sizeof(double) * colorBands));
+            std::copy(noData.begin(), noData.end(), options->padfSrcNoDataReal);
+            options->papszWarpOptions = CSLSetNameValue(options->papszWarpOptions, "UNIFIED_SRC_NODATA", "YES");
+        }
+    }
+    options->eResampleAlg = paletted ? GRA_NearestNeighbour : GRA_Bilinear;
+    options->pfnTransformer = GDALApproxTransform;
+    options->pTransformerArg = approxTransformer;
+    options->papszWarpOptions = CSLSetNameValue(options->papszWarpOptions, "INIT_DEST", "0");
+
+    GDALWarpOperation operation;
+    bool ok = operation.Initialize(options) == CE_None
+              && operation.ChunkAndWarpImage(0, 0, s_tileSize, s_tileSize) == CE_None;
+    GDALDestroyWarpOptions(options);
+    GDALDestroyApproxTransformer(approxTransformer);
+    if (!ok) {
+        qWarning() << "Failed to warp tile" << z << x << y << "of" << dataset->GetDescription() << ":" << CPLGetLastErrorMsg();
+        return QImage();
+    }
+
+    // The tile's bands are colour plus alpha: 4 read as RGBA, with the alpha passed through unstretched.
+    // A grayscale or paletted tile gets its alpha merged in afterwards.
+    QList<ChannelStretch> tileStretch = stretch;
+    if (colorBands == 3 && tileStretch.size() == 4)
+        tileStretch[3] = ChannelStretch::fromRange(0, 255);
+    QRect tileRect(0, 0, s_tileSize, s_tileSize);
+    QImage image = RasterReader::read(tile.get(), tileRect, tileRect.size(), -1, GRIORA_NearestNeighbour, tileStretch);
+    if (image.isNull() || colorBands == 3)
+        return image;
+
+    image = image.convertToFormat(QImage::Format_RGBA8888);
+    std::vector<uint8_t> alpha(size_t(s_tileSize) * s_tileSize);
+    if (tile->GetRasterBand(2)->RasterIO(GF_Read, 0, 0, s_tileSize, s_tileSize, alpha.data(), s_tileSize, s_tileSize,
+                                         GDT_Byte, 0, 0, nullptr) != CE_None) {
+        return QImage();
+    }
+    for (int row = 0; row < s_tileSize; ++row) {
+        uint8_t *line = image.scanLine(row);
+        for (int column = 0; column < s_tileSize; ++column)
+            line[column * 4 + 3] = alpha[size_t(row) * s_tileSize + column];
+    }
+    return image;
+}
@@ -0,0 +1,31 @@
+#ifndef TILERENDERER_H
+#define TILERENDERER_H
+
+#include <QImage>
+#include <QList>
+#include <QRectF>
+#include <gdal_priv.h>
+#include "pixelconvert.h"
+
+// Renders Web Mercator (EPSG:3857) XYZ tiles of a georeferenced dataset, as served to Qt Location's
+// tile fetcher. The raster is warped with GDAL into an in-memory tile that has an alpha band, so the
+// area outside the raster (and its nodata or alpha) is transparent.
+class TileRenderer
+{
+public:
+    static constexpr int s_tileSize = 256;
+
+    // Extent of the dataset in Web Mercator metres, empty when it has no usable georeferencing.
+    static QRectF mercatorBounds(GDALDataset *dataset);
+    // Extent of tile x, y at zoom level z in Web Mercator metres.
+    static QRectF tileBounds(int z, int x, int y);
+    // Lowest zoom level at which tiles are at least as detailed as the raster.
+    static int nativeZoomLevel(GDALDataset *dataset, const QRectF &mercatorBounds);
+
+    // stretch is the one RasterReader::computeStretch() gives for the dataset, only used for non-Byte
+    // data. Reads from the overview closest to the tile resolution. Returns a null image on failure.
+    static QImage render(GDALDataset *dataset, const QRectF &mercatorBounds, int z, int x, int y,
+                         const QList<ChannelStretch> &stretch);
+};
+
+#endif // TILERENDERER_H
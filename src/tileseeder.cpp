@@ -0,0 +1,317 @@
+#include "tileseeder.h"
+#include "datasetpool.h"
+#include "rasterreader.h"
+#include "tilerenderer.h"
+#include <QBuffer>
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QImage>
+#include <QPainter>
+#include <QSqlError>
+#include <QSqlQuery>
+#include <QMutexLocker>
+#include <QThread>
+#include <algorithm>
+#include <cmath>
+
+static constexpr double s_originShift = 20037508.342789244;
+// Native zoom level and this many levels above it are seeded by default.
+static constexpr int s_defaultZoomLevels = 4;
+// Tiles waiting for the MBTiles writer before workers block.
+static constexpr int s_maxQueuedTiles = 512;
+static constexpr int s_progressInterval = 1000;
+static const char *s_connectionName = "tileseeder";
+
+TileSeeder::TileSeeder(const QStringList &files, const QString &output, int minZoom, int maxZoom)
+    : m_files(files)
+    , m_output(output)
+    , m_mbtiles(output.endsWith(".mbtiles", Qt::CaseInsensitive))
+    , m_minZoom(minZoom)
+    , m_maxZoom(maxZoom)
+{
+    m_pool.setMaxThreadCount(QThread::idealThreadCount());
+}
+
+TileSeeder::~TileSeeder()
+{
+    m_pool.waitForDone();
+    if (m_database.isValid()) {
+        m_database.close();
+        m_database = QSqlDatabase();
+        QSqlDatabase::removeDatabase(s_connectionName);
+    }
+}
+
+bool TileSeeder::openSources()
+{
+    for (const QString &filePath : std::as_const(m_files)) {
+        DatasetPool::Handle dataset = DatasetPool::instance()->acquire(filePath);
+        if (!dataset) {
+            qCritical() << "Failed to open" << filePath;
+            return false;
+        }
+        Source source;
+        source.filePath = filePath;
+        source.mercatorBounds = TileRenderer::mercatorBounds(dataset.get());
+        if (source.mercatorBounds.isEmpty()) {
+            qCritical() << filePath << "is not georeferenced";
+            return false;
+        }
+        // One stretch per source so that its tiles match
+        if (RasterReader::needsStretch(dataset.get()))
+            source.stretch = RasterReader::computeStretch(dataset.get(), RasterReader::PercentileStretch);
+        if (m_maxZoom < 0)
+            m_minZoom = std::max(m_minZoom, TileRenderer::nativeZoomLevel(dataset.get(), source.mercatorBounds));
+        m_sources.append(source);
+    }
+    if (m_maxZoom < 0) {
+        m_maxZoom = m_minZoom;
+        m_minZoom = std::max(0, m_maxZoom - s_defaultZoomLevels);
+    }
+    return true;
+}
+
+bool TileSeeder::openMbtiles()
+{
+    m_database = QSqlDatabase::addDatabase("QSQLITE", s_connectionName);
+    m_database.setDatabaseName(m_output);
+    if (!m_database.open()) {
+        qCritical() << "Failed to open" << m_output << ":" << m_database.lastError().text();
+        return false;
+    }
+
+    QSqlQuery query(m_database);
+    const char *statements[] = {
+        "PRAGMA synchronous = OFF",
+        "CREATE TABLE IF NOT EXISTS metadata (name text, value text)",
+        "CREATE UNIQUE INDEX IF NOT EXISTS name ON metadata (name)",
+        "CREATE TABLE IF NOT EXISTS tiles (zoom_level integer, tile_column integer, tile_row integer, tile_data blob)",
+        "CREATE UNIQUE INDEX IF NOT EXISTS tile_index ON tiles (zoom_level, tile_column, tile_row)"
+    };
+    for (const char *statement : statements) {
+        if (!query.exec(statement)) {
+            qCritical() << "Failed to set up" << m_output << ":" << query.lastError().text();
+            return false;
+        }
+    }
+    return true;
+}
+
+void TileSeeder::writeMbtilesMetadata(const QRectF &bounds)
+{
+    auto longitude = [](double x) { return x / s_originShift * 180.0; };
+    auto latitude = [](double y) { return std::atan(std::sinh(y / s_originShift * M_PI)) * 180.0 / M_PI; };
+    QList<std::pair<QString, QString>> metadata = {
+        { "name", QFileInfo(m_output).completeBaseName() },
+        { "format", "png" },
+        { "type", "overlay" },
+        { "version", "1.0" },
+        { "minzoom", QString::number(m_minZoom) },
+        { "maxzoom", QString::number(m_maxZoom) },
+        { "bounds", QString("%1,%2,%3,%4").arg(longitude(bounds.left())).arg(latitude(bounds.top()))
+                        .arg(longitude(bounds.right())).arg(latitude(bounds.bottom())) }
+    };
+
+    QSqlQuery query(m_database);
+    query.prepare("INSERT OR REPLACE INTO metadata (name, value) VALUES (?, ?)");
+    for (const auto &[name, value] : metadata) {
+        query.addBindValue(name);
+        query.addBindValue(value);
+        if (!query.exec())
+            qWarning() << "Failed to write MBTiles metadata" << name << ":" << query.lastError().text();
+    }
+}
+
+int TileSeeder::run()
+{
+    if (m_files.isEmpty()) {
+        qCritical() << "No GeoTIFFs given to seed tiles from";
+        return 1;
+    }
+    if (!openSources())
+        return 1;
+
+    QRectF bounds;
+    for (const Source &source : std::as_const(m_sources))
+        bounds = bounds.united(source.mercatorBounds);
+
+    if (m_mbtiles) {
+        if (!openMbtiles())
+            return 1;
+        writeMbtilesMetadata(bounds);
+    } else if (!QDir().mkpath(m_output)) {
+        qCritical() << "Failed to create" << m_output;
+        return 1;
+    }
+
+    qInfo().noquote() << QString("Seeding zoom levels %1-%2 from %3 file(s) into %4 with %5 threads")
+                             .arg(m_minZoom).arg(m_maxZoom).arg(m_sources.size()).arg(m_output)
+                             .arg(m_pool.maxThreadCount());
+    m_timer.start();
+
+    // Count the tiles that touch a source, so progress can be reported against the total, and queue a
+    // job per tile row.
+    qint64 total = 0;
+    for (int z = m_minZoom; z <= m_maxZoom; ++z) {
+        int tileCount = 1 << z;
+        double span = 2 * s_originShift / tileCount;
+        int firstX = std::clamp(int(std::floor((bounds.left() + s_originShift) / span)), 0, tileCount - 1);
+        int lastX = std::clamp(int(std::floor((bounds.right() + s_originShift) / span)), 0, tileCount - 1);
+        int firstY = std::clamp(int(std::floor((s_originShift - bounds.bottom()) / span)), 0, tileCount - 1);
+        int lastY = std::clamp(int(std::floor((s_originShift - bounds.top()) / span)), 0, tileCount - 1);
+        for (int y = firstY; y <= lastY; ++y) {
+            qint64 rowTiles = 0;
+            for (int x = firstX; x <= lastX; ++x) {
+                QRectF tileBounds = TileRenderer::tileBounds(z, x, y);
+                rowTiles += std::any_of(m_sources.cbegin(), m_sources.cend(), [&](const Source &source) {
+                    return tileBounds.intersects(source.mercatorBounds);
+                });
+            }
+            if (rowTiles > 0) {
+                total += rowTiles;
+                m_pool.start([this, z, y, firstX, lastX]() { seedRow(z, y, firstX, lastX); });
+            }
+        }
+    }
+
+    // Write queued tiles (for MBTiles) and report progress until every job is done.
+    QElapsedTimer sinceReport;
+    sinceReport.start();
+    forever {
+        bool finished = m_pool.waitForDone(0);
+        drainQueue();
+        if (finished)
+            break;
+        if (sinceReport.elapsed() >= s_progressInterval) {
+            reportProgress(total);
+            sinceReport.restart();
+        }
+    }
+    reportProgress(total, true);
+    return m_failed > 0 ? 1 : 0;
+}
+
+void TileSeeder::seedRow(int z, int y, int firstX, int lastX)
+{
+    for (int x = firstX; x <= lastX; ++x) {
+        QRectF tileBounds = TileRenderer::tileBounds(z, x, y);
+        QImage image;
+        bool touched = false;
+        bool failed = false;
+        for (const Source &source : std::as_const(m_sources)) {
+            if (!tileBounds.intersects(source.mercatorBounds))
+                continue;
+            touched = true;
+            DatasetPool::Handle dataset = DatasetPool::instance()->acquire(source.filePath);
+            QImage sourceImage = TileRenderer::render(dataset.get(), source.mercatorBounds, z, x, y, source.stretch);
+            if (sourceImage.isNull()) {
+                failed = true;
+                break;
+            }
+            if (image.isNull()) {
+                image = sourceImage;
+            } else {
+                // Overlapping sources, later ones are drawn over earlier ones
+                image = image.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+                QPainter painter(&image);
+                painter.drawImage(0, 0, sourceImage);
+            }
+        }
+        if (!touched)
+            continue;
+        ++m_done;
+        if (failed) {
+            ++m_failed;
+            continue;
+        }
+
+        QImage alpha = image.convertToFormat(QImage::Format_Alpha8);
+        bool empty = true;
+        for (int row = 0; row < alpha.height() && empty; ++row) {
+            const uchar *line = alpha.constScanLine(row);
+            empty = std::all_of(line, line + alpha.width(), [](uchar a) { return a == 0; });
+        }
+        if (empty) {
+            ++m_empty;
+            continue;
+        }
+
+        Tile tile { z, x, y, QByteArray() };
+        QBuffer buffer(&tile.png);
+        buffer.open(QIODevice::WriteOnly);
+        image.save(&buffer, "PNG");
+
+        if (m_mbtiles) {
+            enqueue(std::move(tile));
+            continue;
+        }
+        QString dir = QString("%1/%2/%3").arg(m_output).arg(z).arg(x);
+        QFile file(QString("%1/%2.png").arg(dir).arg(y));
+        if (!QDir().mkpath(dir) || !file.open(QIODevice::WriteOnly) || file.write(tile.png) != tile.png.size()) {
+            qWarning() << "Failed to write" << file.fileName() << ":" << file.errorString();
+            ++m_failed;
+            continue;
+        }
+        ++m_written;
+    }
+}
+
+void TileSeeder::enqueue(Tile &&tile)
+{
+    QMutexLocker locker(&m_queueMutex);
+    while (m_queue.size() >= s_maxQueuedTiles)
+        m_queueNotFull.wait(&m_queueMutex);
+    m_queue.enqueue(std::move(tile));
+    m_queueNotEmpty.wakeOne();
+}
+
+void TileSeeder::drainQueue()
+{
+    QQueue<Tile> tiles;
+    {
+        QMutexLocker locker(&m_queueMutex);
+        // Doubles as the wait between progress checks, directory tiles never go through the queue
+        if (m_queue.isEmpty())
+            m_queueNotEmpty.wait(&m_queueMutex, s_progressInterval / 4);
+        tiles.swap(m_queue);
+        m_queueNotFull.wakeAll();
+    }
+    if (tiles.isEmpty())
+        return;
+
+    // MBTiles counts rows from the south (TMS), XYZ tiles from the north
+    m_database.transaction();
+    QSqlQuery query(m_database);
+    query.prepare("INSERT OR REPLACE INTO tiles (zoom_level, tile_column, tile_row, tile_data) VALUES (?, ?, ?, ?)");
+    for (const Tile &tile : std::as_const(tiles)) {
+        query.addBindValue(tile.z);
+        query.addBindValue(tile.x);
+        query.addBindValue((1 << tile.z) - 1 - tile.y);
+        query.addBindValue(tile.png);
+        if (query.exec()) {
+            ++m_written;
+        } else {
+            qWarning() << "Failed to write tile" << tile.z << tile.x << tile.y << ":" << query.lastError().text();
+            ++m_failed;
+        }
+    }
+    m_database.commit();
+}
+
+void TileSeeder::reportProgress(qint64 total, bool final)
+{
+    double seconds = std::max(m_timer.elapsed(), qint64(1)) / 1000.0;
+    qint64 done = m_done;
+    QString message = QString("%1/%2 tiles (%3%), %4 tiles/s, %5 written, %6 empty skipped")
+                          .arg(done).arg(total)
+                          .arg(total > 0 ? 100.0 * done / total : 100.0, 0, 'f', 1)
+                          .arg(done / seconds, 0, 'f', 1)
+                          .arg(m_written.load()).arg(m_empty.load());
+    if (m_failed > 0)
+        message += QString(", %1 failed").arg(m_failed.load());
+    if (final)
+        message = QString("Done in %1 s: ").arg(seconds, 0, 'f', 1) + message;
+    qInfo().noquote() << message;
+}
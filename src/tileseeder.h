@@ -0,0 +1,82 @@
+#ifndef TILESEEDER_H
+#define TILESEEDER_H
+
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QList>
+#include <QMutex>
+#include <QQueue>
+#include <QRectF>
+#include <QStringList>
+#include <QThreadPool>
+#include <QWaitCondition>
+#include <QSqlDatabase>
+#include <atomic>
+#include "pixelconvert.h"
+
+// Pre-renders the Web Mercator tiles of one or more GeoTIFFs for a range of zoom levels, without any
+// UI, into an MBTiles file (when the output ends with .mbtiles) or a {z}/{x}/{y}.png directory tree.
+//
+// Tiles are rendered with TileRenderer on a thread pool using every core, one job per tile row.
+// Where sources overlap, later files are drawn over earlier ones. Tiles that come out fully
+// transparent are skipped. Directory tiles are written by the workers themselves; MBTiles tiles are
+// queued to the calling thread, which owns the SQLite connection and commits them in batches.
+class TileSeeder
+{
+public:
+    // minZoom and maxZoom of -1 pick the native zoom level of the most detailed source and the 4 levels
+    // above it.
+    TileSeeder(const QStringList &files, const QString &output, int minZoom = -1, int maxZoom = -1);
+    ~TileSeeder();
+
+    // Blocks until all tiles are written, reporting progress every second. Returns the process exit code.
+    int run();
+
+private:
+    struct Source
+    {
+        QString filePath;
+        QRectF mercatorBounds;
+        QList<ChannelStretch> stretch;
+    };
+
+    struct Tile
+    {
+        int z;
+        int x;
+        int y;
+        QByteArray png;
+    };
+
+    bool openSources();
+    bool openMbtiles();
+    void writeMbtilesMetadata(const QRectF &bounds);
+    void seedRow(int z, int y, int firstX, int lastX);
+    void enqueue(Tile &&tile);
+    void drainQueue();
+    void reportProgress(qint64 total, bool final = false);
+
+private:
+    QStringList m_files;
+    QString m_output;
+    bool m_mbtiles;
+    int m_minZoom;
+    int m_maxZoom;
+    QList<Source> m_sources;
+
+    QThreadPool m_pool;
+    QSqlDatabase m_database;
+    QElapsedTimer m_timer;
+    std::atomic<qint64> m_done = 0;
+    std::atomic<qint64> m_written = 0;
+    std::atomic<qint64> m_empty = 0;
+    std::atomic<qint64> m_failed = 0;
+
+    // Rendered tiles waiting for the MBTiles writer, bounded so that workers can't run ahead of it.
+    QMutex m_queueMutex;
+    QWaitCondition m_queueNotEmpty;
+    QWaitCondition m_queueNotFull;
+    QQueue<Tile> m_queue;
+};
+
+#endif // TILESEEDER_H
@@ -0,0 +1,167 @@
+#include "warpgrid.h"
+#include <QDebug>
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+// Largest interpolation error tolerated, in raster pixels. Same as gdalwarp's default.
+static constexpr double s_maxError = 0.125;
+static constexpr int s_maxCells = 128;
+// Web Mercator is cut off at this latitude, the same as Qt Location does.
+static constexpr double s_maxLatitude = 85.05112878;
+
+bool WarpGrid::project(std::vector<double> &x, std::vector<double> &y) const
+{
+    // Raster pixel to georeferenced coordinates, which also takes care of rotated geotransforms
+    const double *gt = m_geoTransform;
+    for (size_t i = 0; i < x.size(); ++i) {
+        double column = x[i];
+        double row = y[i];
+        x[i] = gt[0] + column * gt[1] + row * gt[2];
+        y[i] = gt[3] + column * gt[4] + row * gt[5];
+    }
+
+    if (m_toWgs84) {
+        std::vector<int> success(x.size());
+        m_toWgs84->Transform(x.size(), x.data(), y.data(), nullptr, success.data());
+        if (std::find(success.cbegin(), success.cend(), FALSE) != success.cend())
+            return false;
+    }
+
+    // Longitude/latitude to normalized Web Mercator, (0, 0) top left and (1, 1) bottom right
+    for (size_t i = 0; i < x.size(); ++i) {
+        double latitude = std::clamp(y[i], -s_maxLatitude, s_maxLatitude) * M_PI / 180.0;
+        x[i] = (x[i] + 180.0) / 360.0;
+        y[i] = (1.0 - std::log(std::tan(latitude) + 1.0 / std::cos(latitude)) / M_PI) / 2.0;
+    }
+    return true;
+}
+
+void WarpGrid::clear()
+{
+    m_columns = 0;
+    m_rows = 0;
+    m_points.clear();
+    m_bounds = QRectF();
+}
+
+bool WarpGrid::build(const double *geoTransform, const QSize &rasterSize, OGRCoordinateTransformation *toWgs84)
+{
+    clear();
+    if (rasterSize.isEmpty())
+        return false;
+
+    m_rasterSize = rasterSize;
+    m_geoTransform = geoTransform;
+    m_toWgs84 = toWgs84;
+
+    // Warp space origin at the raster centre, scaled so that the raster is about as wide as it has pixels
+    std::vector<double> x { rasterSize.width() / 2.0, 0.0, double(rasterSize.width()) };
+    std::vector<double> y(3, rasterSize.height() / 2.0);
+    if (!project(x, y)) {
+        qWarning() << "Failed to transform the raster centre to Web Mercator";
+        return false;
+    }
+    m_origin = QPointF(x[0], y[0]);
+    double mercatorWidth = std::hypot(x[2] - x[1], y[2] - y[1]);
+    m_scale = mercatorWidth > 0 ? rasterSize.width() / mercatorWidth : 1.0;
+
+    bool converged = false;
+    for (int cells = 1; cells <= s_maxCells && !converged; cells *= 2) {
+        m_columns = std::min(cells, rasterSize.width());
+        m_rows = std::min(cells, rasterSize.height());
+
+        // Grid points, followed by the centre and the right and bottom edge midpoints of every cell.
+        // Top and left midpoints are those of the neighbouring cells, or on the outer border.
+        std::vector<double> px;
+        std::vector<double> py;
+        for (int row = 0; row <= m_rows; ++row) {
+            for (int column = 0; column <= m_columns; ++column) {
+                px.push_back(columnPosition(column));
+                py.push_back(rowPosition(row));
+            }
+        }
+        size_t pointCount = px.size();
+        for (int row = 0; row < m_rows; ++row) {
+            for (int column = 0; column < m_columns; ++column) {
+                double left = columnPosition(column);
+                double right = columnPosition(column + 1);
+                double top = rowPosition(row);
+                double bottom = rowPosition(row + 1);
+                px.insert(px.end(), { (left + right) / 2, right, (left + right) / 2, left, (left + right) / 2 });
+                py.insert(py.end(), { (top + bottom) / 2, (top + bottom) / 2, bottom, (top + bottom) / 2, top });
+            }
+        }
+        std::vector<double> exactX = px;
+        std::vector<double> exactY = py;
+        if (!project(exactX, exactY)) {
+            qWarning() << "Failed to transform the raster to Web Mercator";
+            clear();
+            return false;
+        }
+
+        m_points.clear();
+        m_points.reserve(pointCount);
+        for (size_t i = 0; i < pointCount; ++i)
+            m_points.append(QPointF((exactX[i] - m_origin.x()) * m_scale, (exactY[i] - m_origin.y()) * m_scale));
+
+        converged = true;
+        for (size_t i = pointCount; i < px.size() && converged; ++i) {
+            QPointF exact((exactX[i] - m_origin.x()) * m_scale, (exactY[i] - m_origin.y()) * m_scale);
+            QPointF delta = map(QPointF(px[i], py[i])) - exact;
+            converged = std::hypot(delta.x(), delta.y()) <= s_maxError;
+        }
+        converged = converged || (m_columns == rasterSize.width() && m_rows == rasterSize.height());
+    }
+    if (!converged)
+        qDebug() << "Warp grid error above" << s_maxError << "px with" << m_columns << "x" << m_rows << "cells";
+
+    qreal minX = m_points.first().x();
+    qreal maxX = minX;
+    qreal minY = m_points.first().y();
+    qreal maxY = minY;
+    for (const QPointF &point : std::as_const(m_points)) {
+        minX = std::min(minX, point.x());
+        maxX = std::max(maxX, point.x());
+        minY = std::min(minY, point.y());
+        maxY = std::max(maxY, point.y());
+    }
+    m_bounds = QRectF(QPointF(minX, minY), QPointF(maxX, maxY));
+
+    m_geoTransform = nullptr;
+    m_toWgs84 = nullptr;
+    return true;
+}
+
+double WarpGrid::columnPosition(int column) const
+{
+    return double(m_rasterSize.width()) * column / m_columns;
+}
+
+double WarpGrid::rowPosition(int row) const
+{
+    return double(m_rasterSize.height()) * row / m_rows;
+}
+
+QPointF WarpGrid::map(const QPointF &rasterPos) const
+{
+    double u = rasterPos.x() / m_rasterSize.width() * m_columns;
+    double v = rasterPos.y() / m_rasterSize.height() * m_rows;
+    int column = std::clamp(int(std::floor(u)), 0, m_columns - 1);
+    int row = std::clamp(int(std::floor(v)), 0, m_rows - 1);
+    double fx = u - column;
+    double fy = v - row;
+
+    QPointF top = point(column, row) * (1 - fx) + point(column + 1, row) * fx;
+    QPointF bottom = point(column, row + 1) * (1 - fx) + point(column + 1, row + 1) * fx;
+    return top * (1 - fy) + bottom * fy;
+}
+
+QGeoCoordinate WarpGrid::toCoordinate(const QPointF &warpPos) const
+{
+    double x = warpPos.x() / m_scale + m_origin.x();
+    double y = warpPos.y() / m_scale + m_origin.y();
+    double longitude = x * 360.0 - 180.0;
+    double latitude = std::atan(std::sinh(M_PI * (1.0 - 2.0 * y))) * 180.0 / M_PI;
+    return QGeoCoordinate(latitude, longitude);
+}
@@ -0,0 +1,61 @@
+#ifndef WARPGRID_H
+#define WARPGRID_H
+
+#include <QGeoCoordinate>
+#include <QList>
+#include <QPointF>
+#include <QRectF>
+#include <QSize>
+#include <ogr_spatialref.h>
+
+// Maps raster pixel positions to Web Mercator through a coarse grid of control points, the way GDAL's
+// approximate transformer does: the exact transform is only evaluated at the grid points and
+// interpolated (bilinearly) in between. The grid starts as a single cell and is refined until the
+// interpolation error at the cell centres and edge midpoints stays below s_maxError raster pixels,
+// so a north-up raster in geographic or Web Mercator coordinates needs just the four corners.
+//
+// Positions are given in "warp space": Web Mercator relative to the centre of the raster and scaled
+// to roughly one unit per raster pixel, which keeps them small enough to be stored as floats in the
+// scene graph without losing precision at high zoom levels.
+class WarpGrid
+{
+public:
+    // toWgs84 transforms georeferenced coordinates to WGS84 longitude/latitude (in traditional GIS
+    // axis order). It is only used while building and may be null when the raster is already
+    // georeferenced in WGS84 longitude/latitude.
+    bool build(const double *geoTransform, const QSize &rasterSize, OGRCoordinateTransformation *toWgs84);
+    void clear();
+
+    inline bool isValid() const { return !m_points.isEmpty(); }
+    inline int columns() const { return m_columns; }
+    inline int rows() const { return m_rows; }
+    inline QSize rasterSize() const { return m_rasterSize; }
+
+    // Raster position of a grid line, and the grid point where two of them cross.
+    double columnPosition(int column) const;
+    double rowPosition(int row) const;
+    inline QPointF point(int column, int row) const { return m_points[row * (m_columns + 1) + column]; }
+
+    QPointF map(const QPointF &rasterPos) const;
+    QGeoCoordinate toCoordinate(const QPointF &warpPos) const;
+    // Bounding rectangle of the whole raster in warp space.
+    inline QRectF bounds() const { return m_bounds; }
+
+private:
+    bool project(std::vector<double> &x, std::vector<double> &y) const;
+
+private:
+    QSize m_rasterSize;
+    int m_columns = 0;
+    int m_rows = 0;
+    QList<QPointF> m_points;
+    QRectF m_bounds;
+    QPointF m_origin;       // Normalized Web Mercator position of warp space (0, 0)
+    double m_scale = 1;     // Warp units per normalized Web Mercator unit
+
+    // Only valid during build()
+    const double *m_geoTransform = nullptr;
+    OGRCoordinateTransformation *m_toWgs84 = nullptr;
+};
+
+#endif // WARPGRID_H